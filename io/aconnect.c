@@ -0,0 +1,271 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "aconnect.h"
+#include "containers.h"
+
+/************************************************************************
+ * Address selection and attempts. Everything here is called with the
+ * lock held, which is safe because asock never invokes a callback
+ * before returning.
+ */
+
+static void attempt_done(struct asock *t);
+static void timer_done(struct waitq_timer *t);
+
+/* Find the first address in or out of the given family */
+static const struct addrinfo *skip(const struct addrinfo *ai,
+				   int family, int same)
+{
+	while (ai && (ai->ai_family == family) != same)
+		ai = ai->ai_next;
+
+	return ai;
+}
+
+/* Take the next address, alternating between families */
+static const struct addrinfo *next_addr(struct aconnect *c)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const int k = c->turn ^ i;
+		const struct addrinfo *ai = c->cursor[k];
+
+		if (ai) {
+			c->cursor[k] = skip(ai->ai_next, c->family, !k);
+			c->turn = !k;
+			return ai;
+		}
+	}
+
+	return NULL;
+}
+
+static int has_addr(const struct aconnect *c)
+{
+	return c->cursor[0] || c->cursor[1];
+}
+
+static struct aconnect_slot *free_slot(struct aconnect *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->n_slots; i++)
+		if (!c->slots[i].busy)
+			return &c->slots[i];
+
+	return NULL;
+}
+
+/* Start an attempt, if there's an address left and a slot for it.
+ * Returns non-zero if one was started.
+ */
+static int start_next(struct aconnect *c)
+{
+	struct aconnect_slot *s;
+	const struct addrinfo *ai;
+
+	if (c->cancelled || c->winner || !has_addr(c))
+		return 0;
+
+	s = free_slot(c);
+	if (!s)
+		return 0;
+
+	ai = next_addr(c);
+	s->busy = 1;
+	s->cancelled = 0;
+	c->running++;
+	asock_connect(&s->sock, ai->ai_addr, ai->ai_addrlen, attempt_done);
+
+	return 1;
+}
+
+static void arm_timer(struct aconnect *c)
+{
+	if (c->timer_busy || !has_addr(c))
+		return;
+
+	c->timer_busy = 1;
+	waitq_timer_wait(&c->timer, c->delay_ms, timer_done);
+}
+
+/* Close every attempt other than the winner */
+static void cancel_others(struct aconnect *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->n_slots; i++) {
+		struct aconnect_slot *s = &c->slots[i];
+
+		if (s->busy && s != c->winner) {
+			s->cancelled = 1;
+			asock_close(&s->sock);
+		}
+	}
+
+	if (c->timer_busy)
+		waitq_timer_cancel(&c->timer);
+}
+
+static void task_func(struct runq_task *task)
+{
+	struct aconnect *c = container_of(task, struct aconnect, task);
+
+	c->func(c);
+}
+
+/* Complete the operation if nothing is left outstanding */
+static void check_done(struct aconnect *c)
+{
+	if (c->running || c->timer_busy)
+		return;
+
+	runq_task_exec(&c->task, task_func);
+}
+
+/************************************************************************
+ * Events
+ */
+
+static void attempt_done(struct asock *t)
+{
+	struct aconnect_slot *s = container_of(t, struct aconnect_slot, sock);
+	struct aconnect *c = s->owner;
+	const neterr_t err = asock_get_error(t);
+
+	thr_mutex_lock(&c->lock);
+	s->busy = 0;
+	c->running--;
+
+	if (s->cancelled) {
+		s->cancelled = 0;
+	} else if (!err && !c->winner) {
+		c->winner = s;
+		c->error = 0;
+		cancel_others(c);
+	} else {
+		if (err)
+			c->error = err;
+
+		asock_close(t);
+
+		/* Don't wait for the delay after a failure */
+		if (start_next(c))
+			arm_timer(c);
+		else if (!c->running && c->timer_busy)
+			waitq_timer_cancel(&c->timer);
+	}
+
+	check_done(c);
+	thr_mutex_unlock(&c->lock);
+}
+
+static void timer_done(struct waitq_timer *t)
+{
+	struct aconnect *c = container_of(t, struct aconnect, timer);
+
+	thr_mutex_lock(&c->lock);
+	c->timer_busy = 0;
+
+	if (!waitq_timer_cancelled(t) && start_next(c))
+		arm_timer(c);
+
+	check_done(c);
+	thr_mutex_unlock(&c->lock);
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+void aconnect_init(struct aconnect *c, struct ioq *q,
+		   struct aconnect_slot *slots, unsigned int n_slots)
+{
+	unsigned int i;
+
+	runq_task_init(&c->task, ioq_runq(q));
+	waitq_timer_init(&c->timer, ioq_waitq(q));
+	thr_mutex_init(&c->lock);
+
+	c->slots = slots;
+	c->n_slots = n_slots;
+	c->winner = NULL;
+	c->timer_busy = 0;
+	c->running = 0;
+
+	for (i = 0; i < n_slots; i++) {
+		struct aconnect_slot *s = &slots[i];
+
+		asock_init(&s->sock, q);
+		s->owner = c;
+		s->busy = 0;
+		s->cancelled = 0;
+	}
+}
+
+void aconnect_destroy(struct aconnect *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->n_slots; i++)
+		asock_destroy(&c->slots[i].sock);
+
+	thr_mutex_destroy(&c->lock);
+}
+
+void aconnect_start(struct aconnect *c, const struct addrinfo *list,
+		    int delay_ms, aconnect_func_t func)
+{
+	thr_mutex_lock(&c->lock);
+	if (c->winner)
+		asock_close(&c->winner->sock);
+
+	c->func = func;
+	c->delay_ms = delay_ms;
+	c->winner = NULL;
+	c->cancelled = 0;
+	c->error = ACONNECT_ERR_NOADDR;
+
+	c->family = list ? list->ai_family : AF_UNSPEC;
+	c->cursor[0] = skip(list, c->family, 1);
+	c->cursor[1] = skip(list, c->family, 0);
+	c->turn = 0;
+
+	if (start_next(c))
+		arm_timer(c);
+
+	check_done(c);
+	thr_mutex_unlock(&c->lock);
+}
+
+void aconnect_cancel(struct aconnect *c)
+{
+	thr_mutex_lock(&c->lock);
+	if (c->running || c->timer_busy) {
+		c->cancelled = 1;
+		c->error = ACONNECT_ERR_CANCELLED;
+
+		if (c->winner) {
+			asock_close(&c->winner->sock);
+			c->winner = NULL;
+		}
+
+		cancel_others(c);
+	}
+	thr_mutex_unlock(&c->lock);
+}
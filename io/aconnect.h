@@ -0,0 +1,122 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_ACONNECT_H_
+#define IO_ACONNECT_H_
+
+#include "asock.h"
+#include "waitq.h"
+
+#ifndef __Windows__
+#include <netdb.h>
+#endif
+
+/* Multi-address connect ("happy eyeballs"). Connection attempts are
+ * made to the addresses of a list, such as one returned by adns, with
+ * staggered starts: a new attempt is begun each time the delay elapses
+ * without success, or as soon as an attempt fails. Addresses of the
+ * first family in the list are interleaved with those of other
+ * families.
+ *
+ * The first attempt to succeed wins, and the others are cancelled. The
+ * number of simultaneous attempts is limited by the number of slots
+ * given.
+ */
+struct aconnect;
+typedef void (*aconnect_func_t)(struct aconnect *c);
+
+struct aconnect_slot {
+	struct asock		sock;
+	struct aconnect		*owner;
+	int			busy;
+	int			cancelled;
+};
+
+struct aconnect {
+	/* Callback -- must be first */
+	struct runq_task	task;
+	aconnect_func_t		func;
+
+	struct aconnect_slot	*slots;
+	unsigned int		n_slots;
+	int			delay_ms;
+
+	/* State: protected by lock. Addresses not yet tried are found
+	 * via one cursor for the first family, and one for the rest.
+	 */
+	thr_mutex_t		lock;
+	const struct addrinfo	*cursor[2];
+	int			family;
+	int			turn;
+	unsigned int		running;
+	struct waitq_timer	timer;
+	int			timer_busy;
+	int			cancelled;
+
+	/* Result */
+	struct aconnect_slot	*winner;
+	neterr_t		error;
+};
+
+/* Errors reported if there were no addresses to try, or if the
+ * operation was cancelled.
+ */
+#ifdef __Windows__
+#define ACONNECT_ERR_NOADDR	WSAEHOSTUNREACH
+#define ACONNECT_ERR_CANCELLED	WSAECANCELLED
+#else
+#define ACONNECT_ERR_NOADDR	EHOSTUNREACH
+#define ACONNECT_ERR_CANCELLED	ECANCELED
+#endif
+
+/* Initialize/destroy a multi-address connect, with the given array of
+ * slots for simultaneous attempts. It may be destroyed only if no
+ * operation is outstanding.
+ */
+void aconnect_init(struct aconnect *c, struct ioq *q,
+		   struct aconnect_slot *slots, unsigned int n_slots);
+void aconnect_destroy(struct aconnect *c);
+
+/* Begin connecting. The address list must remain valid until the
+ * operation completes. A new attempt is started every delay_ms until
+ * one succeeds.
+ *
+ * The callback is invoked via the run queue once every attempt has
+ * finished. Starting another operation closes any socket won by the
+ * previous one.
+ */
+void aconnect_start(struct aconnect *c, const struct addrinfo *list,
+		    int delay_ms, aconnect_func_t func);
+
+/* Cancel an outstanding operation. It completes with
+ * ACONNECT_ERR_CANCELLED, and no socket.
+ */
+void aconnect_cancel(struct aconnect *c);
+
+/* Obtain the connected socket, or NULL if every attempt failed. The
+ * error is that of the last failure, and is 0 on success.
+ */
+static inline struct asock *aconnect_get_sock(const struct aconnect *c)
+{
+	return c->winner ? &c->winner->sock : NULL;
+}
+
+static inline neterr_t aconnect_get_error(const struct aconnect *c)
+{
+	return c->error;
+}
+
+#endif
@@ -0,0 +1,439 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "adgram.h"
+#include "containers.h"
+
+#define OP_SEND		0x01
+#define OP_RECV		0x02
+#define OP_CANCEL	0x04
+
+/* Ancillary data for a single datagram: either a UDP_SEGMENT request
+ * (uint16_t) or a UDP_GRO report (int).
+ */
+union pkt_cmsg {
+	struct cmsghdr		hdr;
+	uint8_t			buf[CMSG_SPACE(sizeof(int))];
+};
+
+/************************************************************************
+ * Dispatcher
+ */
+
+static void dispatch_func(struct runq_task *task)
+{
+	struct adgram *d = container_of(task, struct adgram, dispatch_task);
+	const int ops = thr_atomic_swap(&d->dispatch_queue, 0);
+
+	if (ops & OP_SEND)
+		d->send_func(d);
+	if (ops & OP_RECV)
+		d->recv_func(d);
+}
+
+static void dispatch_push(struct adgram *d, int ops)
+{
+	if (!thr_atomic_or(&d->dispatch_queue, ops) && ops)
+		runq_task_exec(&d->dispatch_task, dispatch_func);
+}
+
+/************************************************************************
+ * Transfers
+ */
+
+static unsigned int batch_size(unsigned int n)
+{
+	return n > ADGRAM_BATCH ? ADGRAM_BATCH : n;
+}
+
+static uint16_t gro_segment(struct msghdr *h)
+{
+#ifdef UDP_GRO
+	struct cmsghdr *c;
+
+	for (c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c))
+		if (c->cmsg_level == IPPROTO_UDP && c->cmsg_type == UDP_GRO) {
+			int seg;
+
+			memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+			return seg;
+		}
+#endif
+
+	return 0;
+}
+
+static int do_send(struct adgram *d, int fd)
+{
+	struct mmsghdr msgs[ADGRAM_BATCH];
+	struct iovec iov[ADGRAM_BATCH];
+	union pkt_cmsg cmsg[ADGRAM_BATCH];
+	const unsigned int n = batch_size(d->send_max);
+	unsigned int i;
+	int r;
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+
+	for (i = 0; i < n; i++) {
+		struct adgram_pkt *p = &d->send_pkts[i];
+		struct msghdr *h = &msgs[i].msg_hdr;
+
+		iov[i].iov_base = p->data;
+		iov[i].iov_len = p->len;
+		h->msg_iov = &iov[i];
+		h->msg_iovlen = 1;
+
+		if (p->addr_len) {
+			h->msg_name = &p->addr;
+			h->msg_namelen = p->addr_len;
+		}
+
+#ifdef UDP_SEGMENT
+		if (p->segment) {
+			struct cmsghdr *c = &cmsg[i].hdr;
+
+			memset(&cmsg[i], 0, sizeof(cmsg[i]));
+			c->cmsg_level = IPPROTO_UDP;
+			c->cmsg_type = UDP_SEGMENT;
+			c->cmsg_len = CMSG_LEN(sizeof(p->segment));
+			memcpy(CMSG_DATA(c), &p->segment, sizeof(p->segment));
+
+			h->msg_control = cmsg[i].buf;
+			h->msg_controllen = CMSG_SPACE(sizeof(p->segment));
+		}
+#endif
+	}
+
+	r = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return 0;
+
+		d->send_error = errno;
+		d->send_count = 0;
+	} else {
+		d->send_count = r;
+		d->send_error = 0;
+	}
+
+	return OP_SEND;
+}
+
+static int do_recv(struct adgram *d, int fd)
+{
+	struct mmsghdr msgs[ADGRAM_BATCH];
+	struct iovec iov[ADGRAM_BATCH];
+	union pkt_cmsg cmsg[ADGRAM_BATCH];
+	const unsigned int n = batch_size(d->recv_max);
+	unsigned int i;
+	int r;
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+
+	for (i = 0; i < n; i++) {
+		struct adgram_pkt *p = &d->recv_pkts[i];
+		struct msghdr *h = &msgs[i].msg_hdr;
+
+		iov[i].iov_base = p->data;
+		iov[i].iov_len = p->size;
+		h->msg_iov = &iov[i];
+		h->msg_iovlen = 1;
+		h->msg_name = &p->addr;
+		h->msg_namelen = sizeof(p->addr);
+
+		if (d->gro) {
+			h->msg_control = cmsg[i].buf;
+			h->msg_controllen = sizeof(cmsg[i].buf);
+		}
+	}
+
+	r = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+	if (r < 0) {
+		if (errno == EAGAIN)
+			return 0;
+
+		d->recv_error = errno;
+		d->recv_count = 0;
+		return OP_RECV;
+	}
+
+	for (i = 0; i < r; i++) {
+		struct adgram_pkt *p = &d->recv_pkts[i];
+		struct msghdr *h = &msgs[i].msg_hdr;
+
+		p->len = msgs[i].msg_len;
+		p->addr_len = h->msg_namelen;
+		p->flags = h->msg_flags;
+		p->segment = d->gro ? gro_segment(h) : 0;
+	}
+
+	d->recv_count = r;
+	d->recv_error = 0;
+	return OP_RECV;
+}
+
+/************************************************************************
+ * Wait process
+ */
+
+static ioq_fd_mask_t wait_mask(int ops)
+{
+	ioq_fd_mask_t m = 0;
+
+	if (ops & OP_SEND)
+		m |= IOQ_EVENT_OUT;
+	if (ops & OP_RECV)
+		m |= IOQ_EVENT_IN;
+
+	return m;
+}
+
+static int wait_send(struct adgram *d)
+{
+	if (!(ioq_fd_ready(&d->wait_fd) & (IOQ_EVENT_OUT | IOQ_EVENT_ERR)))
+		return 0;
+
+	return do_send(d, d->wait_fd.fd);
+}
+
+static int wait_recv(struct adgram *d)
+{
+	if (!(ioq_fd_ready(&d->wait_fd) &
+	      (IOQ_EVENT_IN | IOQ_EVENT_ERR | IOQ_EVENT_HUP)))
+		return 0;
+
+	return do_recv(d, d->wait_fd.fd);
+}
+
+static void wait_end(struct ioq_fd *f)
+{
+	struct adgram *d = container_of(f, struct adgram, wait_fd);
+	int dispatch_mask = 0;
+
+	thr_mutex_lock(&d->wait_lock);
+	if ((d->wait_ops & OP_CANCEL) || ioq_fd_error(f)) {
+		const int e = ioq_fd_error(f);
+
+		if (d->wait_ops & OP_SEND) {
+			d->send_count = 0;
+			d->send_error = e;
+		}
+
+		if (d->wait_ops & OP_RECV) {
+			d->recv_count = 0;
+			d->recv_error = e;
+		}
+
+		if (d->wait_ops & OP_CANCEL)
+			close(d->wait_fd.fd);
+
+		dispatch_mask = d->wait_ops;
+		d->wait_ops = 0;
+	} else {
+		if (d->wait_ops & OP_SEND)
+			dispatch_mask |= wait_send(d);
+
+		if (d->wait_ops & OP_RECV)
+			dispatch_mask |= wait_recv(d);
+
+		d->wait_ops &= ~dispatch_mask;
+		if (d->wait_ops)
+			ioq_fd_wait(&d->wait_fd,
+				wait_mask(d->wait_ops), wait_end);
+	}
+	thr_mutex_unlock(&d->wait_lock);
+
+	if (dispatch_mask)
+		dispatch_push(d, dispatch_mask);
+}
+
+static int wait_begin(struct adgram *d, int mask)
+{
+	int r;
+
+	thr_mutex_lock(&d->wait_lock);
+	r = d->wait_ops;
+
+	if (mask & OP_CANCEL) {
+		if (d->wait_ops) {
+			d->wait_ops |= OP_CANCEL;
+			ioq_fd_cancel(&d->wait_fd);
+		}
+	} else {
+		ioq_fd_mask_t m;
+
+		d->wait_ops |= mask;
+		m = wait_mask(d->wait_ops);
+
+		if (r)
+			ioq_fd_rewait(&d->wait_fd, m);
+		else
+			ioq_fd_wait(&d->wait_fd, m, wait_end);
+	}
+	thr_mutex_unlock(&d->wait_lock);
+
+	return r;
+}
+
+static void wait_init(struct adgram *d)
+{
+	thr_mutex_lock(&d->wait_lock);
+	ioq_fd_init(&d->wait_fd, d->ioq, d->sock);
+	d->wait_ops = 0;
+	thr_mutex_unlock(&d->wait_lock);
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+void adgram_init(struct adgram *d, struct ioq *q)
+{
+	memset(d, 0, sizeof(*d));
+
+	d->ioq = q;
+	d->sock = -1;
+
+	runq_task_init(&d->dispatch_task, ioq_runq(q));
+	thr_mutex_init(&d->wait_lock);
+}
+
+void adgram_destroy(struct adgram *d)
+{
+	if (d->sock >= 0)
+		close(d->sock);
+
+	thr_mutex_destroy(&d->wait_lock);
+}
+
+int adgram_bind(struct adgram *d, const struct sockaddr *sa,
+		size_t sa_len)
+{
+	if (d->sock >= 0)
+		close(d->sock);
+
+	d->gro = 0;
+	d->sock = socket(sa->sa_family, SOCK_DGRAM, 0);
+	if (d->sock < 0) {
+		d->error = errno;
+		return -1;
+	}
+
+	wait_init(d);
+
+	if (bind(d->sock, sa, sa_len) < 0) {
+		d->error = errno;
+		return -1;
+	}
+
+	d->error = 0;
+	return 0;
+}
+
+void adgram_close(struct adgram *d)
+{
+	if (d->sock < 0)
+		return;
+
+	if (!wait_begin(d, OP_CANCEL))
+		close(d->sock);
+
+	d->sock = -1;
+}
+
+int adgram_set_gro(struct adgram *d, int enable)
+{
+#ifdef UDP_GRO
+	if (setsockopt(d->sock, IPPROTO_UDP, UDP_GRO,
+		       &enable, sizeof(enable)) < 0) {
+		d->error = errno;
+		return -1;
+	}
+
+	d->gro = enable;
+	return 0;
+#else
+	d->error = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
+void adgram_recv(struct adgram *d, struct adgram_pkt *pkts,
+		 unsigned int max, adgram_func_t func)
+{
+	d->recv_func = func;
+	d->recv_pkts = pkts;
+	d->recv_max = max;
+
+	if (d->sock < 0) {
+		d->recv_count = 0;
+		d->recv_error = EBADF;
+		dispatch_push(d, OP_RECV);
+		return;
+	}
+
+	if (!max) {
+		d->recv_count = 0;
+		d->recv_error = 0;
+		dispatch_push(d, OP_RECV);
+		return;
+	}
+
+	/* Try optimistically first */
+	if (do_recv(d, d->sock)) {
+		dispatch_push(d, OP_RECV);
+		return;
+	}
+
+	wait_begin(d, OP_RECV);
+}
+
+void adgram_send(struct adgram *d, struct adgram_pkt *pkts,
+		 unsigned int count, adgram_func_t func)
+{
+	d->send_func = func;
+	d->send_pkts = pkts;
+	d->send_max = count;
+
+	if (d->sock < 0) {
+		d->send_count = 0;
+		d->send_error = EBADF;
+		dispatch_push(d, OP_SEND);
+		return;
+	}
+
+	if (!count) {
+		d->send_count = 0;
+		d->send_error = 0;
+		dispatch_push(d, OP_SEND);
+		return;
+	}
+
+	/* Try optimistically first */
+	if (do_send(d, d->sock)) {
+		dispatch_push(d, OP_SEND);
+		return;
+	}
+
+	wait_begin(d, OP_SEND);
+}
@@ -0,0 +1,164 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_ADGRAM_H_
+#define IO_ADGRAM_H_
+
+#include <stdint.h>
+#include "net.h"
+#include "ioq.h"
+
+/* Asynchronous datagram socket. Datagrams are received and sent in
+ * batches, using a single recvmmsg()/sendmmsg() call for up to
+ * ADGRAM_BATCH datagrams at a time. This module is available on Linux
+ * only.
+ */
+#define ADGRAM_BATCH		64
+
+/* Datagram descriptor. For receiving, data and size describe the
+ * buffer, and the remaining fields are filled in on completion. For
+ * sending, len bytes of data are sent to the given address.
+ *
+ * If segment is non-zero, it gives the segment size for generic
+ * segmentation/receive offload. A single send of len bytes is split by
+ * the kernel into datagrams of this size. On receive, it's set if
+ * several datagrams were coalesced into this buffer (only if enabled
+ * via adgram_set_gro()).
+ */
+struct adgram_pkt {
+	uint8_t			*data;
+	size_t			size;
+	size_t			len;
+
+	struct sockaddr_storage	addr;
+	socklen_t		addr_len;
+
+	uint16_t		segment;
+
+	/* Receive flags (MSG_TRUNC if the datagram didn't fit) */
+	int			flags;
+};
+
+struct adgram;
+typedef void (*adgram_func_t)(struct adgram *d);
+
+struct adgram {
+	struct ioq		*ioq;
+	net_sock_t		sock;
+	neterr_t		error;
+	int			gro;
+
+	/* Send request */
+	adgram_func_t		send_func;
+	struct adgram_pkt	*send_pkts;
+	unsigned int		send_max;
+	unsigned int		send_count;
+	neterr_t		send_error;
+
+	/* Receive request */
+	adgram_func_t		recv_func;
+	struct adgram_pkt	*recv_pkts;
+	unsigned int		recv_max;
+	unsigned int		recv_count;
+	neterr_t		recv_error;
+
+	/* Event wait process */
+	thr_mutex_t		wait_lock;
+	struct ioq_fd		wait_fd;
+	int			wait_ops;
+
+	/* Dispatcher */
+	struct runq_task	dispatch_task;
+	thr_atomic_t		dispatch_queue;
+};
+
+/* Initialize a datagram socket. No system resources are allocated
+ * until the socket is bound.
+ */
+void adgram_init(struct adgram *d, struct ioq *q);
+
+/* Destroy a datagram socket. */
+void adgram_destroy(struct adgram *d);
+
+/* Retrieve the last error from adgram_bind() */
+static inline neterr_t adgram_get_error(const struct adgram *d)
+{
+	return d->error;
+}
+
+/* Obtain the operating system handle for this socket */
+static inline net_sock_t adgram_get_handle(const struct adgram *d)
+{
+	return d->sock;
+}
+
+/* Create a socket of the address's family, and bind it. Use a zero
+ * port to obtain an ephemeral port for sending. If this fails, -1 is
+ * returned, and the error is available via adgram_get_error().
+ */
+int adgram_bind(struct adgram *d, const struct sockaddr *sa,
+		size_t sa_size);
+
+/* Close the socket. All outstanding operations are cancelled and will
+ * complete very soon.
+ */
+void adgram_close(struct adgram *d);
+
+/* Request that the kernel coalesce received datagrams (UDP_GRO). The
+ * buffers supplied to adgram_recv() should then be large enough to
+ * hold several datagrams. Returns 0 on success or -1 if unsupported.
+ */
+int adgram_set_gro(struct adgram *d, int enable);
+
+/* Receive a batch of datagrams into the given array of up to max
+ * descriptors. The operation completes as soon as at least one
+ * datagram is available, and reports the number received. The array
+ * must remain valid until the operation completes.
+ *
+ * As with asock, the transfer is attempted immediately, but the
+ * callback is always invoked via the run queue.
+ */
+void adgram_recv(struct adgram *d, struct adgram_pkt *pkts,
+		 unsigned int max, adgram_func_t func);
+
+static inline neterr_t adgram_get_recv_error(const struct adgram *d)
+{
+	return d->recv_error;
+}
+
+static inline unsigned int adgram_get_recv_count(const struct adgram *d)
+{
+	return d->recv_count;
+}
+
+/* Send a batch of datagrams. It may be the case that not all of them
+ * are sent, in which case the count reports the number of leading
+ * descriptors which were.
+ */
+void adgram_send(struct adgram *d, struct adgram_pkt *pkts,
+		 unsigned int count, adgram_func_t func);
+
+static inline neterr_t adgram_get_send_error(const struct adgram *d)
+{
+	return d->send_error;
+}
+
+static inline unsigned int adgram_get_send_count(const struct adgram *d)
+{
+	return d->send_count;
+}
+
+#endif
@@ -19,3 +19,88 @@
 #else
 #include "afile_posix.c"
 #endif
+
+/************************************************************************
+ * Aligned buffer pool
+ */
+
+#ifdef __Windows__
+#include <malloc.h>
+
+static void *alloc_aligned(size_t size, size_t align)
+{
+	return _aligned_malloc(size, align);
+}
+
+static void free_aligned(void *ptr)
+{
+	_aligned_free(ptr);
+}
+#else
+#include <stdlib.h>
+
+static void *alloc_aligned(size_t size, size_t align)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, align, size))
+		return NULL;
+
+	return ptr;
+}
+
+static void free_aligned(void *ptr)
+{
+	free(ptr);
+}
+#endif
+
+int afile_bufpool_init(struct afile_bufpool *p, size_t buf_size,
+		       unsigned int count, size_t align)
+{
+	unsigned int i;
+
+	/* Each free buffer holds a list node */
+	if (buf_size < sizeof(struct slist_node))
+		buf_size = sizeof(struct slist_node);
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+
+	p->size = (buf_size + align - 1) & ~(align - 1);
+	p->count = count;
+	p->base = alloc_aligned(p->size * count, align);
+	if (!p->base)
+		return -1;
+
+	slist_init(&p->free);
+	for (i = 0; i < count; i++)
+		slist_append(&p->free,
+			     (struct slist_node *)(p->base + i * p->size));
+
+	thr_mutex_init(&p->lock);
+	return 0;
+}
+
+void afile_bufpool_destroy(struct afile_bufpool *p)
+{
+	free_aligned(p->base);
+	thr_mutex_destroy(&p->lock);
+}
+
+uint8_t *afile_bufpool_get(struct afile_bufpool *p)
+{
+	uint8_t *buf;
+
+	thr_mutex_lock(&p->lock);
+	buf = (uint8_t *)slist_pop(&p->free);
+	thr_mutex_unlock(&p->lock);
+
+	return buf;
+}
+
+void afile_bufpool_put(struct afile_bufpool *p, uint8_t *buf)
+{
+	thr_mutex_lock(&p->lock);
+	slist_push(&p->free, (struct slist_node *)buf);
+	thr_mutex_unlock(&p->lock);
+}
@@ -18,10 +18,16 @@
 #define IO_AFILE_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include "syserr.h"
 #include "ioq.h"
 #include "thr.h"
 #include "handle.h"
+#include "slist.h"
+
+#ifndef __Windows__
+#include <sys/uio.h>
+#endif
 
 /* Asynchronous file handle manager. This allows, independently, reads
  * and writes to be started on a file handle. The object may be
@@ -49,6 +55,14 @@ struct afile_op {
 	void			*buffer;
 	size_t			size;
 	syserr_t		error;
+
+	/* Positional operations are run as a task on the I/O pool, and
+	 * then completed via the ioq's run queue.
+	 */
+	uint64_t		offset;
+	const struct iovec	*iov;
+	int			iovcnt;
+	struct runq_task	task;
 };
 
 struct afile {
@@ -57,8 +71,13 @@ struct afile {
 	struct afile_op		read;
 	struct afile_op		write;
 
+	struct runq		*pool;
 	thr_mutex_t		lock;
 	int			flags;
+
+	/* Direct I/O handle and alignment, if enabled */
+	handle_t		direct_fd;
+	size_t			direct_align;
 };
 #endif
 
@@ -99,6 +118,79 @@ static inline void afile_set_handle(struct afile *a, handle_t h)
 }
 #endif
 
+/* Set the thread pool used for positional operations. This is a run
+ * queue with background workers, dedicated to blocking file I/O, and
+ * may be shared by many files. Without one, system calls are made on
+ * the ioq's own run queue, blocking one of its workers.
+ *
+ * On Windows, positional operations are overlapped like any other,
+ * and no pool is needed.
+ */
+#ifdef __Windows__
+static inline void afile_set_pool(struct afile *a, struct runq *pool)
+{
+}
+#else
+static inline void afile_set_pool(struct afile *a, struct runq *pool)
+{
+	a->pool = pool;
+}
+#endif
+
+#ifndef __Windows__
+/* Enable direct (unbuffered) I/O for positional operations. The given
+ * handle must refer to the same file, opened with O_DIRECT, and align
+ * is the alignment it requires of buffers, offsets and lengths (the
+ * logical block size of the device, usually 512 or 4096). Direct I/O
+ * is disabled by passing an alignment of 0. The handle isn't closed
+ * with the file.
+ *
+ * Positional operations then bypass the page cache. Buffers and
+ * offsets which aren't aligned are rejected with EINVAL. For a flat
+ * read or write, a length which isn't a multiple of the alignment is
+ * allowed: the unaligned tail is transferred via the ordinary handle.
+ * Segments of vectored operations and batch extents must be aligned in
+ * both address and length.
+ */
+static inline void afile_set_direct(struct afile *a, handle_t fd,
+				    size_t align)
+{
+	a->direct_fd = fd;
+	a->direct_align = align;
+}
+#endif
+
+/* Aligned buffer pool, for direct I/O. Buffers of a fixed size are
+ * carved from a single aligned allocation, made when the pool is
+ * initialized. A pool may be shared by any number of files, in any
+ * thread.
+ */
+struct afile_bufpool {
+	thr_mutex_t		lock;
+	uint8_t			*base;
+	size_t			size;
+	unsigned int		count;
+	struct slist		free;
+};
+
+/* Initialize a pool of count buffers, each of at least buf_size bytes
+ * and aligned to align, which must be a power of two. Returns -1 if
+ * memory can't be allocated.
+ */
+int afile_bufpool_init(struct afile_bufpool *p, size_t buf_size,
+		       unsigned int count, size_t align);
+void afile_bufpool_destroy(struct afile_bufpool *p);
+
+/* Take a buffer, or return NULL if the pool is exhausted */
+uint8_t *afile_bufpool_get(struct afile_bufpool *p);
+void afile_bufpool_put(struct afile_bufpool *p, uint8_t *buf);
+
+/* Obtain the size of buffers in the pool */
+static inline size_t afile_bufpool_size(const struct afile_bufpool *p)
+{
+	return p->size;
+}
+
 /* Begin an asynchronous write operation */
 void afile_write(struct afile *a, const void *data, size_t len,
 		 afile_func_t func);
@@ -133,6 +225,85 @@ static inline syserr_t afile_read_error(const struct afile *a)
 	return a->read.error;
 }
 
+/* Positional read and write, at the given offset from the start of the
+ * file. These are intended for regular files, for which readiness
+ * notification is meaningless, and they don't move the file pointer.
+ * Results are obtained as for afile_read() and afile_write(), and as
+ * with those, at most one read and one write may be outstanding.
+ */
+void afile_pread(struct afile *a, void *data, size_t len,
+		 uint64_t offset, afile_func_t func);
+void afile_pwrite(struct afile *a, const void *data, size_t len,
+		  uint64_t offset, afile_func_t func);
+
+#ifndef __Windows__
+/* Vectored positional read and write. Each transfers data to or from a
+ * sequence of segments in a single system call. The iovec array and
+ * the memory it describes must remain valid until the operation
+ * completes. The size reported is the total over all segments.
+ */
+void afile_preadv(struct afile *a, const struct iovec *iov, int iovcnt,
+		  uint64_t offset, afile_func_t func);
+void afile_pwritev(struct afile *a, const struct iovec *iov, int iovcnt,
+		   uint64_t offset, afile_func_t func);
+
+/* Batched extent I/O. Any number of extents may be queued on a batch,
+ * each a vectored read or write at its own offset. Submitting the batch
+ * performs every extent in order, in a single pool task, and then
+ * invokes the callback once via the ioq's run queue.
+ *
+ * Extents are caller-supplied, and must remain valid, along with the
+ * memory they describe, until the batch completes. A batch may be
+ * reused once its callback has been invoked.
+ */
+struct afile_extent {
+	struct slist_node	node;
+	uint64_t		offset;
+	const struct iovec	*iov;
+	int			iovcnt;
+	int			is_write;
+
+	/* Result */
+	size_t			size;
+	syserr_t		error;
+};
+
+struct afile_batch;
+typedef void (*afile_batch_func_t)(struct afile_batch *b);
+
+struct afile_batch {
+	struct runq_task	task;
+	afile_batch_func_t	func;
+	struct afile		*file;
+	struct slist		extents;
+	struct slist		running;
+};
+
+void afile_batch_init(struct afile_batch *b, struct afile *a);
+
+/* Queue a read or write. Nothing is done until the batch is submitted. */
+void afile_batch_read(struct afile_batch *b, struct afile_extent *e,
+		      const struct iovec *iov, int iovcnt, uint64_t offset);
+void afile_batch_write(struct afile_batch *b, struct afile_extent *e,
+		       const struct iovec *iov, int iovcnt, uint64_t offset);
+
+/* Perform all queued extents. Batches submitted on the same file may
+ * run concurrently, on different pool workers.
+ */
+void afile_batch_submit(struct afile_batch *b, afile_batch_func_t func);
+
+/* Obtain the result of an extent, once the batch has completed */
+static inline size_t afile_extent_size(const struct afile_extent *e)
+{
+	return e->size;
+}
+
+static inline syserr_t afile_extent_error(const struct afile_extent *e)
+{
+	return e->error;
+}
+#endif
+
 /* Cancel all outstanding operations. The result of any IO operations
  * will be undefined.
  */
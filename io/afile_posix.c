@@ -15,7 +15,9 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include "afile.h"
+#include "containers.h"
 
 #define F_WANT_READ		0x01
 #define F_WANT_WRITE		0x02
@@ -112,11 +114,11 @@ static void ioq_cb(struct ioq_fd *f)
 				a->write.buffer, a->write.size);
 
 			if (r < 0) {
-				a->read.size = 0;
-				a->read.error = syserr_last();
+				a->write.size = 0;
+				a->write.error = syserr_last();
 			} else {
-				a->read.size = r;
-				a->read.error = SYSERR_NONE;
+				a->write.size = r;
+				a->write.error = SYSERR_NONE;
 			}
 		}
 
@@ -127,6 +129,9 @@ static void ioq_cb(struct ioq_fd *f)
 void afile_init(struct afile *a, struct ioq *q, handle_t h)
 {
 	ioq_fd_init(&a->fd, q, h);
+	a->pool = NULL;
+	a->direct_fd = -1;
+	a->direct_align = 0;
 	a->flags = 0;
 	memset(&a->read, 0, sizeof(a->read));
 	memset(&a->write, 0, sizeof(a->write));
@@ -181,3 +186,265 @@ void afile_cancel(struct afile *a)
 	a->flags |= F_WANT_CANCEL;
 	thr_mutex_unlock(&a->lock);
 }
+
+/************************************************************************
+ * Positional operations
+ */
+
+static void read_complete(struct runq_task *t)
+{
+	struct afile *a = container_of(t, struct afile, read.task);
+
+	a->read.func(a);
+}
+
+static void write_complete(struct runq_task *t)
+{
+	struct afile *a = container_of(t, struct afile, write.task);
+
+	a->write.func(a);
+}
+
+/* Record the result of a system call, and pass the operation back to
+ * the ioq for completion.
+ */
+static void op_finish(struct afile *a, struct afile_op *op, ssize_t r,
+		      runq_task_func_t complete)
+{
+	if (r < 0) {
+		op->size = 0;
+		op->error = syserr_last();
+	} else {
+		op->size = r;
+		op->error = SYSERR_NONE;
+	}
+
+	runq_task_init(&op->task, ioq_runq(a->fd.owner));
+	runq_task_exec(&op->task, complete);
+}
+
+static void op_submit(struct afile *a, struct afile_op *op,
+		      runq_task_func_t work)
+{
+	runq_task_init(&op->task, a->pool ? a->pool : ioq_runq(a->fd.owner));
+	runq_task_exec(&op->task, work);
+}
+
+static ssize_t sys_xfer(int fd, int is_write, const struct iovec *iov,
+			int iovcnt, uint64_t offset)
+{
+	ssize_t r;
+
+	do {
+		if (is_write)
+			r = pwritev(fd, iov, iovcnt, offset);
+		else
+			r = preadv(fd, iov, iovcnt, offset);
+	} while (r < 0 && errno == EINTR);
+
+	return r;
+}
+
+/* Transfer via the direct handle, if enabled. If flat is non-zero,
+ * there's a single segment whose length needn't be aligned: the
+ * aligned head is transferred directly, and the tail via the ordinary
+ * handle.
+ */
+static ssize_t xfer(struct afile *a, int is_write, const struct iovec *iov,
+		    int iovcnt, uint64_t offset, int flat)
+{
+	const size_t mask = a->direct_align - 1;
+	struct iovec head;
+	struct iovec tail;
+	ssize_t r = 0;
+	ssize_t t;
+	int i;
+
+	if (!a->direct_align)
+		return sys_xfer(a->fd.fd, is_write, iov, iovcnt, offset);
+
+	if (offset & mask)
+		goto invalid;
+
+	for (i = 0; i < iovcnt; i++)
+		if (((uintptr_t)iov[i].iov_base & mask) ||
+		    (!flat && (iov[i].iov_len & mask)))
+			goto invalid;
+
+	if (!flat)
+		return sys_xfer(a->direct_fd, is_write, iov, iovcnt, offset);
+
+	head.iov_base = iov->iov_base;
+	head.iov_len = iov->iov_len & ~mask;
+	tail.iov_base = (uint8_t *)iov->iov_base + head.iov_len;
+	tail.iov_len = iov->iov_len - head.iov_len;
+
+	if (head.iov_len) {
+		r = sys_xfer(a->direct_fd, is_write, &head, 1, offset);
+		if (r < head.iov_len)
+			return r;
+	}
+
+	if (!tail.iov_len)
+		return r;
+
+	t = sys_xfer(a->fd.fd, is_write, &tail, 1, offset + r);
+	if (t < 0)
+		return r ? r : t;
+
+	return r + t;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+static ssize_t op_xfer(struct afile *a, const struct afile_op *op,
+		       int is_write)
+{
+	struct iovec v;
+
+	if (op->iov)
+		return xfer(a, is_write, op->iov, op->iovcnt, op->offset, 0);
+
+	v.iov_base = op->buffer;
+	v.iov_len = op->size;
+	return xfer(a, is_write, &v, 1, op->offset, 1);
+}
+
+static void pread_work(struct runq_task *t)
+{
+	struct afile *a = container_of(t, struct afile, read.task);
+
+	op_finish(a, &a->read, op_xfer(a, &a->read, 0), read_complete);
+}
+
+static void pwrite_work(struct runq_task *t)
+{
+	struct afile *a = container_of(t, struct afile, write.task);
+
+	op_finish(a, &a->write, op_xfer(a, &a->write, 1), write_complete);
+}
+
+void afile_pread(struct afile *a, void *data, size_t len,
+		 uint64_t offset, afile_func_t func)
+{
+	a->read.buffer = data;
+	a->read.size = len;
+	a->read.offset = offset;
+	a->read.iov = NULL;
+	a->read.func = func;
+
+	op_submit(a, &a->read, pread_work);
+}
+
+void afile_pwrite(struct afile *a, const void *data, size_t len,
+		  uint64_t offset, afile_func_t func)
+{
+	a->write.buffer = (void *)data;
+	a->write.size = len;
+	a->write.offset = offset;
+	a->write.iov = NULL;
+	a->write.func = func;
+
+	op_submit(a, &a->write, pwrite_work);
+}
+
+void afile_preadv(struct afile *a, const struct iovec *iov, int iovcnt,
+		  uint64_t offset, afile_func_t func)
+{
+	a->read.iov = iov;
+	a->read.iovcnt = iovcnt;
+	a->read.offset = offset;
+	a->read.func = func;
+
+	op_submit(a, &a->read, pread_work);
+}
+
+void afile_pwritev(struct afile *a, const struct iovec *iov, int iovcnt,
+		   uint64_t offset, afile_func_t func)
+{
+	a->write.iov = iov;
+	a->write.iovcnt = iovcnt;
+	a->write.offset = offset;
+	a->write.func = func;
+
+	op_submit(a, &a->write, pwrite_work);
+}
+
+/************************************************************************
+ * Batched extents
+ */
+
+void afile_batch_init(struct afile_batch *b, struct afile *a)
+{
+	b->file = a;
+	slist_init(&b->extents);
+	slist_init(&b->running);
+}
+
+static void batch_add(struct afile_batch *b, struct afile_extent *e,
+		      const struct iovec *iov, int iovcnt, uint64_t offset,
+		      int is_write)
+{
+	e->offset = offset;
+	e->iov = iov;
+	e->iovcnt = iovcnt;
+	e->is_write = is_write;
+	e->size = 0;
+	e->error = SYSERR_NONE;
+
+	slist_append(&b->extents, &e->node);
+}
+
+void afile_batch_read(struct afile_batch *b, struct afile_extent *e,
+		      const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+	batch_add(b, e, iov, iovcnt, offset, 0);
+}
+
+void afile_batch_write(struct afile_batch *b, struct afile_extent *e,
+		       const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+	batch_add(b, e, iov, iovcnt, offset, 1);
+}
+
+static void batch_complete(struct runq_task *t)
+{
+	struct afile_batch *b = container_of(t, struct afile_batch, task);
+
+	b->func(b);
+}
+
+static void batch_work(struct runq_task *t)
+{
+	struct afile_batch *b = container_of(t, struct afile_batch, task);
+
+	while (!slist_is_empty(&b->running)) {
+		struct afile_extent *e = container_of(slist_pop(&b->running),
+			struct afile_extent, node);
+		const ssize_t r = xfer(b->file, e->is_write,
+				       e->iov, e->iovcnt, e->offset, 0);
+
+		if (r < 0) {
+			e->size = 0;
+			e->error = syserr_last();
+		} else {
+			e->size = r;
+		}
+	}
+
+	runq_task_init(&b->task, ioq_runq(b->file->fd.owner));
+	runq_task_exec(&b->task, batch_complete);
+}
+
+void afile_batch_submit(struct afile_batch *b, afile_batch_func_t func)
+{
+	struct afile *a = b->file;
+
+	b->func = func;
+	slist_concat(&b->running, &b->extents);
+
+	runq_task_init(&b->task, a->pool ? a->pool : ioq_runq(a->fd.owner));
+	runq_task_exec(&b->task, batch_work);
+}
@@ -43,13 +43,23 @@ static void write_done(struct ioq_ovl *o)
 	a->write.func(a);
 }
 
-void afile_write(struct afile *a, const void *data, size_t len,
-		 afile_func_t func)
+static void set_offset(struct ioq_ovl *o, uint64_t offset)
+{
+	LPOVERLAPPED lpo = ioq_ovl_lpo(o);
+
+	lpo->Offset = offset;
+	lpo->OffsetHigh = offset >> 32;
+}
+
+static void begin_write(struct afile *a, const void *data, size_t len,
+			uint64_t offset, afile_func_t func)
 {
 	a->write.func = func;
 	a->write.error = ERROR_IO_PENDING;
 
 	ioq_ovl_wait(&a->write.ovl, write_done);
+	set_offset(&a->write.ovl, offset);
+
 	if (!WriteFile(a->handle, data, len, &a->write.size,
 		       ioq_ovl_lpo(&a->write.ovl))) {
 		const syserr_t e = GetLastError();
@@ -83,13 +93,15 @@ static void read_done(struct ioq_ovl *o)
 	a->read.func(a);
 }
 
-void afile_read(struct afile *a, void *data, size_t len,
-		afile_func_t func)
+static void begin_read(struct afile *a, void *data, size_t len,
+		       uint64_t offset, afile_func_t func)
 {
 	a->read.func = func;
 	a->read.error = ERROR_IO_PENDING;
 
 	ioq_ovl_wait(&a->read.ovl, read_done);
+	set_offset(&a->read.ovl, offset);
+
 	if (!ReadFile(a->handle, data, len, &a->read.size,
 		      ioq_ovl_lpo(&a->read.ovl))) {
 		const syserr_t e = GetLastError();
@@ -103,3 +115,30 @@ void afile_read(struct afile *a, void *data, size_t len,
 		ioq_ovl_trigger(&a->read.ovl);
 	}
 }
+
+/* The offset is ignored for handles which aren't seekable, such as
+ * pipes.
+ */
+void afile_write(struct afile *a, const void *data, size_t len,
+		 afile_func_t func)
+{
+	begin_write(a, data, len, 0, func);
+}
+
+void afile_read(struct afile *a, void *data, size_t len,
+		afile_func_t func)
+{
+	begin_read(a, data, len, 0, func);
+}
+
+void afile_pwrite(struct afile *a, const void *data, size_t len,
+		  uint64_t offset, afile_func_t func)
+{
+	begin_write(a, data, len, offset, func);
+}
+
+void afile_pread(struct afile *a, void *data, size_t len,
+		 uint64_t offset, afile_func_t func)
+{
+	begin_read(a, data, len, offset, func);
+}
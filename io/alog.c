@@ -0,0 +1,271 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "alog.h"
+#include "containers.h"
+
+static void sync_work(struct runq_task *t);
+static void timer_done(struct waitq_timer *t);
+
+static struct alog_rec *rec_of(struct slist_node *n)
+{
+	return container_of(n, struct alog_rec, task.job_list);
+}
+
+static void rec_complete(struct runq_task *t)
+{
+	struct alog_rec *r = container_of(t, struct alog_rec, task);
+
+	r->func(r);
+}
+
+/* Complete every record in a list with the given error */
+static void complete_list(struct runq *q, struct slist *list, syserr_t err)
+{
+	struct slist_node *n;
+
+	for (n = list->start; n; n = n->next) {
+		struct alog_rec *r = rec_of(n);
+
+		r->error = err;
+		r->task.func = rec_complete;
+	}
+
+	runq_exec_list(q, list);
+}
+
+/************************************************************************
+ * Group scheduling. Called with the lock held.
+ */
+
+static void start_group(struct alog *l)
+{
+	l->busy = 1;
+	slist_concat(&l->group, &l->queue);
+
+	runq_task_init(&l->task, l->pool);
+	runq_task_exec(&l->task, sync_work);
+}
+
+/* Start a group if the batching window has closed, or arm the timer
+ * for the time at which it will.
+ */
+static void check_window(struct alog *l)
+{
+	const clock_ticks_t now = clock_now();
+	clock_ticks_t due;
+
+	if (l->busy || slist_is_empty(&l->queue))
+		return;
+
+	due = l->last_append + l->window_ms;
+	if (due > l->first_append + l->max_delay_ms)
+		due = l->first_append + l->max_delay_ms;
+
+	if (now >= due) {
+		start_group(l);
+	} else if (!l->timer_busy) {
+		l->timer_busy = 1;
+		waitq_timer_wait(&l->timer, due - now, timer_done);
+	}
+}
+
+static void timer_done(struct waitq_timer *t)
+{
+	struct alog *l = container_of(t, struct alog, timer);
+
+	thr_mutex_lock(&l->lock);
+	l->timer_busy = 0;
+	check_window(l);
+	thr_mutex_unlock(&l->lock);
+}
+
+/************************************************************************
+ * Pool task
+ */
+
+/* Write the whole group, starting at the offset of its first record */
+static syserr_t write_group(struct alog *l)
+{
+	struct slist_node *n = l->group.start;
+	uint64_t offset = rec_of(n)->offset;
+	size_t skip = 0;
+
+	while (n) {
+		struct iovec iov[ALOG_IOV];
+		struct slist_node *m = n;
+		size_t total = 0;
+		int count = 0;
+		ssize_t r;
+
+		/* Gather records, less what's already been written */
+		for (; m && count < ALOG_IOV; m = m->next) {
+			const struct alog_rec *rec = rec_of(m);
+
+			iov[count].iov_base =
+				(uint8_t *)rec->data + (count ? 0 : skip);
+			iov[count].iov_len = rec->len - (count ? 0 : skip);
+			total += iov[count].iov_len;
+			count++;
+		}
+
+		do {
+			r = pwritev(l->fd, iov, count, offset);
+		} while (r < 0 && errno == EINTR);
+
+		if (r < 0)
+			return syserr_last();
+
+		/* No progress: shouldn't happen for a regular file */
+		if (!r && total)
+			return EIO;
+
+		offset += r;
+
+		/* Advance past completely written records */
+		r += skip;
+		while (n && r >= rec_of(n)->len) {
+			r -= rec_of(n)->len;
+			n = n->next;
+		}
+
+		skip = r;
+	}
+
+	return SYSERR_NONE;
+}
+
+static void sync_work(struct runq_task *t)
+{
+	struct alog *l = container_of(t, struct alog, task);
+	struct runq *q = ioq_runq(l->ioq);
+	syserr_t err = write_group(l);
+	struct slist group;
+
+	if (!err && fdatasync(l->fd) < 0)
+		err = syserr_last();
+
+	slist_init(&group);
+	slist_concat(&group, &l->group);
+
+	/* Update state before completing anything, so that the log is
+	 * seen to be idle by the time the callbacks run. After that, it
+	 * may have been destroyed.
+	 */
+	thr_mutex_lock(&l->lock);
+	l->busy = 0;
+	l->syncs++;
+
+	if (err && !l->error)
+		l->error = err;
+
+	/* Records queued during the sync have waited long enough */
+	if (l->error)
+		slist_concat(&group, &l->queue);
+	else if (!slist_is_empty(&l->queue))
+		start_group(l);
+
+	err = l->error;
+	thr_mutex_unlock(&l->lock);
+
+	complete_list(q, &group, err);
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+int alog_init(struct alog *l, struct ioq *q, struct runq *pool,
+	      handle_t fd, int window_ms, int max_delay_ms)
+{
+	const off_t end = lseek(fd, 0, SEEK_END);
+
+	if (end < 0)
+		return -1;
+
+	l->ioq = q;
+	l->pool = pool;
+	l->fd = fd;
+	l->window_ms = window_ms;
+	l->max_delay_ms = max_delay_ms;
+
+	thr_mutex_init(&l->lock);
+	slist_init(&l->queue);
+	slist_init(&l->group);
+	l->end = end;
+	l->error = SYSERR_NONE;
+	l->syncs = 0;
+	l->busy = 0;
+
+	waitq_timer_init(&l->timer, ioq_waitq(q));
+	l->timer_busy = 0;
+
+	return 0;
+}
+
+void alog_destroy(struct alog *l)
+{
+	thr_mutex_destroy(&l->lock);
+}
+
+void alog_append(struct alog *l, struct alog_rec *r,
+		 const void *data, size_t len, alog_func_t func)
+{
+	const clock_ticks_t now = clock_now();
+
+	r->func = func;
+	r->data = data;
+	r->len = len;
+	r->error = SYSERR_NONE;
+	runq_task_init(&r->task, ioq_runq(l->ioq));
+
+	thr_mutex_lock(&l->lock);
+
+	if (l->error) {
+		r->offset = l->end;
+		r->error = l->error;
+		runq_task_exec(&r->task, rec_complete);
+		thr_mutex_unlock(&l->lock);
+		return;
+	}
+
+	if (slist_is_empty(&l->queue))
+		l->first_append = now;
+
+	l->last_append = now;
+	r->offset = l->end;
+	l->end += len;
+	slist_append(&l->queue, &r->task.job_list);
+
+	check_window(l);
+	thr_mutex_unlock(&l->lock);
+}
+
+int alog_busy(struct alog *l)
+{
+	int r;
+
+	thr_mutex_lock(&l->lock);
+	r = l->busy || l->timer_busy || !slist_is_empty(&l->queue);
+	thr_mutex_unlock(&l->lock);
+
+	return r;
+}
@@ -0,0 +1,130 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_ALOG_H_
+#define IO_ALOG_H_
+
+#include <stdint.h>
+#include "ioq.h"
+#include "waitq.h"
+#include "syserr.h"
+#include "handle.h"
+
+/* Group-commit append writer. Records appended to the log are queued,
+ * and written with a single vectored write followed by a single
+ * fdatasync(), after which every record in the group is completed.
+ * Records appended while a sync is in progress form the next group,
+ * which is written as soon as the sync finishes, so that commits per
+ * second scale with the number of concurrent writers rather than with
+ * disk latency.
+ *
+ * When the log is idle, the first group is held for a batching window:
+ * until no record has been appended for window_ms, or until the oldest
+ * has waited for max_delay_ms.
+ *
+ * Writes and syncs are performed on a thread pool. This module is
+ * available on POSIX systems only.
+ */
+#define ALOG_IOV		64
+
+struct alog_rec;
+typedef void (*alog_func_t)(struct alog_rec *r);
+
+/* Record. The data is not copied, and must remain valid until the
+ * record completes. The task is used to queue the record while it's
+ * pending.
+ */
+struct alog_rec {
+	/* Callback -- must be first */
+	struct runq_task	task;
+	alog_func_t		func;
+
+	const void		*data;
+	size_t			len;
+
+	/* Result */
+	uint64_t		offset;
+	syserr_t		error;
+};
+
+struct alog {
+	struct ioq		*ioq;
+	struct runq		*pool;
+	handle_t		fd;
+	int			window_ms;
+	int			max_delay_ms;
+
+	/* State: protected by lock */
+	thr_mutex_t		lock;
+	struct slist		queue;
+	clock_ticks_t		first_append;
+	clock_ticks_t		last_append;
+	uint64_t		end;
+	syserr_t		error;
+	unsigned int		syncs;
+
+	struct waitq_timer	timer;
+	int			timer_busy;
+
+	/* Group being written: owned by the pool task while busy */
+	struct runq_task	task;
+	struct slist		group;
+	int			busy;
+};
+
+/* Initialize a log writing to the end of the given file, which must
+ * be open for writing. Writes and syncs are made on the given pool,
+ * which should have background workers. Returns -1 if the end of the
+ * file can't be found.
+ */
+int alog_init(struct alog *l, struct ioq *q, struct runq *pool,
+	      handle_t fd, int window_ms, int max_delay_ms);
+
+/* Destroy a log. It must not be busy. The file isn't closed. */
+void alog_destroy(struct alog *l);
+
+/* Append a record. The callback is invoked via the ioq's run queue once
+ * the record is durable, or the write or sync failed.
+ *
+ * A failure is sticky: since the state of the file is then unknown,
+ * every record subsequently appended fails with the same error.
+ */
+void alog_append(struct alog *l, struct alog_rec *r,
+		 const void *data, size_t len, alog_func_t func);
+
+/* Return non-zero if records are queued or being written */
+int alog_busy(struct alog *l);
+
+/* Obtain the result of a record: the offset in the file at which it
+ * was written, and the error, which is SYSERR_NONE on success.
+ */
+static inline uint64_t alog_rec_offset(const struct alog_rec *r)
+{
+	return r->offset;
+}
+
+static inline syserr_t alog_rec_error(const struct alog_rec *r)
+{
+	return r->error;
+}
+
+/* Count the syncs made so far */
+static inline unsigned int alog_sync_count(const struct alog *l)
+{
+	return l->syncs;
+}
+
+#endif
@@ -0,0 +1,189 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "amap.h"
+#include "containers.h"
+
+#define AHEAD_NONE		0
+#define AHEAD_BUSY		1
+#define AHEAD_READY		2
+
+static void ahead_work(struct runq_task *t);
+
+static void unmap(struct amap_window *w)
+{
+	if (w->data)
+		munmap(w->data, w->size);
+
+	w->data = NULL;
+	w->size = 0;
+}
+
+static void notify_func(struct runq_task *t)
+{
+	struct amap *m = container_of(t, struct amap, task);
+
+	m->func(m);
+}
+
+/************************************************************************
+ * Window preparation. Called with the lock held.
+ */
+
+/* Begin preparing the window ahead. At the end of the file, it's ready
+ * immediately, and empty.
+ */
+static void start_ahead(struct amap *m)
+{
+	struct amap_window *w = &m->ahead;
+
+	w->data = NULL;
+	w->size = 0;
+	w->offset = m->next_offset;
+	w->error = SYSERR_NONE;
+
+	if (m->next_offset >= m->file_size) {
+		m->ahead_state = AHEAD_READY;
+		return;
+	}
+
+	w->size = m->window_size;
+	if (w->size > m->file_size - m->next_offset)
+		w->size = m->file_size - m->next_offset;
+
+	m->next_offset += w->size;
+	m->ahead_state = AHEAD_BUSY;
+	runq_task_exec(&m->ahead_task, ahead_work);
+}
+
+/* Make the window ahead current, if it's ready and wanted */
+static void deliver(struct amap *m)
+{
+	if (!m->waiting || m->ahead_state != AHEAD_READY)
+		return;
+
+	m->cur = m->ahead;
+	m->waiting = 0;
+	start_ahead(m);
+
+	runq_task_exec(&m->task, notify_func);
+}
+
+static void ahead_work(struct runq_task *t)
+{
+	struct amap *m = container_of(t, struct amap, ahead_task);
+	struct amap_window *w = &m->ahead;
+	void *data;
+
+	/* Fault the window in now, rather than on first access */
+	data = mmap(NULL, w->size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+		    m->fd, w->offset);
+
+	if (data == MAP_FAILED) {
+		w->error = syserr_last();
+		w->size = 0;
+	} else {
+		w->data = data;
+		madvise(data, w->size, MADV_SEQUENTIAL);
+	}
+
+	/* Ask for the following window to be read ahead */
+	if (m->next_offset < m->file_size)
+		posix_fadvise(m->fd, m->next_offset, m->window_size,
+			      POSIX_FADV_WILLNEED);
+
+	thr_mutex_lock(&m->lock);
+	m->ahead_state = AHEAD_READY;
+	deliver(m);
+	thr_mutex_unlock(&m->lock);
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+int amap_init(struct amap *m, struct runq *q, struct runq *pool,
+	      handle_t fd, size_t window_size)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	runq_task_init(&m->task, q);
+	runq_task_init(&m->ahead_task, pool);
+	thr_mutex_init(&m->lock);
+
+	m->pool = pool;
+	m->fd = fd;
+	m->file_size = st.st_size;
+	m->window_size = (window_size + page - 1) / page * page;
+	if (!m->window_size)
+		m->window_size = page;
+
+	memset(&m->cur, 0, sizeof(m->cur));
+	memset(&m->ahead, 0, sizeof(m->ahead));
+	m->ahead_state = AHEAD_NONE;
+	m->waiting = 0;
+	m->next_offset = 0;
+
+	/* Hint the whole file for sequential access */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+}
+
+void amap_destroy(struct amap *m)
+{
+	unmap(&m->cur);
+	if (m->ahead_state == AHEAD_READY)
+		unmap(&m->ahead);
+
+	thr_mutex_destroy(&m->lock);
+}
+
+void amap_next(struct amap *m, amap_func_t func)
+{
+	thr_mutex_lock(&m->lock);
+	unmap(&m->cur);
+
+	m->func = func;
+	m->waiting = 1;
+
+	if (m->ahead_state == AHEAD_NONE)
+		start_ahead(m);
+
+	deliver(m);
+	thr_mutex_unlock(&m->lock);
+}
+
+int amap_busy(struct amap *m)
+{
+	int r;
+
+	thr_mutex_lock(&m->lock);
+	r = m->waiting || m->ahead_state == AHEAD_BUSY;
+	thr_mutex_unlock(&m->lock);
+
+	return r;
+}
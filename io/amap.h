@@ -0,0 +1,118 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_AMAP_H_
+#define IO_AMAP_H_
+
+#include <stdint.h>
+#include "runq.h"
+#include "thr.h"
+#include "syserr.h"
+#include "handle.h"
+
+/* Memory-mapped streaming reader. A file is scanned sequentially as a
+ * series of windows, each mapped into memory and handed to the caller
+ * without copying. While the caller consumes one window, the next is
+ * mapped and faulted in on a thread pool, and the one after that is
+ * requested from the kernel with a readahead hint.
+ *
+ * Windows are unmapped as soon as they've been consumed. This module is
+ * available on POSIX systems only.
+ */
+struct amap;
+typedef void (*amap_func_t)(struct amap *m);
+
+/* Mapped window */
+struct amap_window {
+	uint8_t			*data;
+	size_t			size;
+	uint64_t		offset;
+	syserr_t		error;
+};
+
+struct amap {
+	/* Callback -- must be first */
+	struct runq_task	task;
+	amap_func_t		func;
+
+	struct runq		*pool;
+	handle_t		fd;
+	uint64_t		file_size;
+	size_t			window_size;
+
+	/* State: protected by lock */
+	thr_mutex_t		lock;
+	struct amap_window	cur;
+	struct amap_window	ahead;
+	int			ahead_state;
+	int			waiting;
+	uint64_t		next_offset;
+
+	/* Background mapping of the window ahead */
+	struct runq_task	ahead_task;
+};
+
+/* Initialize a reader for the given file, which must be open for
+ * reading and must not change size during the scan. The window size is
+ * rounded up to a multiple of the page size. Mapping is done on the
+ * pool, which should have background workers, and callbacks are
+ * invoked via the given run queue.
+ *
+ * Returns -1 if the file can't be examined. No window is current
+ * until amap_next() completes.
+ */
+int amap_init(struct amap *m, struct runq *q, struct runq *pool,
+	      handle_t fd, size_t window_size);
+
+/* Destroy a reader, unmapping any windows. It must not be waiting for
+ * a window, and must not be busy. The file isn't closed.
+ */
+void amap_destroy(struct amap *m);
+
+/* Release the current window, and advance to the next one. The
+ * callback is invoked via the run queue once it's mapped, which is
+ * immediately if it was prepared in the background already.
+ */
+void amap_next(struct amap *m, amap_func_t func);
+
+/* Return non-zero if a window is being mapped in the background */
+int amap_busy(struct amap *m);
+
+/* Obtain the current window: a pointer to its data, which remains valid
+ * until the next call to amap_next(), its size and its offset in the
+ * file. The size is 0 at the end of the file, or on error.
+ */
+static inline const uint8_t *amap_data(const struct amap *m)
+{
+	return m->cur.data;
+}
+
+static inline size_t amap_size(const struct amap *m)
+{
+	return m->cur.size;
+}
+
+static inline uint64_t amap_offset(const struct amap *m)
+{
+	return m->cur.offset;
+}
+
+static inline syserr_t amap_error(const struct amap *m)
+{
+	return m->cur.error;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ameta.h"
+#include "containers.h"
+
+#define OP_OPEN			0
+#define OP_STAT			1
+#define OP_CLOSE		2
+#define OP_STAT_BATCH		3
+
+static void complete(struct runq_task *t)
+{
+	struct ameta_req *r = container_of(t, struct ameta_req, task);
+
+	r->func(r);
+}
+
+static syserr_t do_stat(int dirfd, const char *path, int flags,
+			struct stat *st)
+{
+	if (fstatat(dirfd, path, st, flags) < 0)
+		return syserr_last();
+
+	return SYSERR_NONE;
+}
+
+static void work(struct runq_task *t)
+{
+	struct ameta_req *r = container_of(t, struct ameta_req, task);
+	unsigned int i;
+
+	r->error = SYSERR_NONE;
+
+	switch (r->op) {
+	case OP_OPEN:
+		do {
+			r->fd = openat(r->dirfd, r->path, r->flags, r->mode);
+		} while (r->fd < 0 && errno == EINTR);
+
+		if (r->fd < 0)
+			r->error = syserr_last();
+		break;
+
+	case OP_STAT:
+		r->error = do_stat(r->dirfd, r->path, r->flags, &r->st);
+		break;
+
+	case OP_CLOSE:
+		/* The handle is released even if interrupted, so
+		 * retrying could close someone else's.
+		 */
+		if (close(r->fd) < 0 && errno != EINTR)
+			r->error = syserr_last();
+
+		r->fd = -1;
+		break;
+
+	case OP_STAT_BATCH:
+		for (i = 0; i < r->count; i++) {
+			struct ameta_stat_ent *e = &r->ents[i];
+
+			e->error = do_stat(r->dirfd, e->path, r->flags,
+					   &e->st);
+		}
+		break;
+	}
+
+	runq_task_init(&r->task, r->runq);
+	runq_task_exec(&r->task, complete);
+}
+
+static void submit(struct ameta_req *r, int op, ameta_func_t func)
+{
+	r->op = op;
+	r->func = func;
+
+	runq_task_init(&r->task, r->pool);
+	runq_task_exec(&r->task, work);
+}
+
+void ameta_req_init(struct ameta_req *r, struct runq *pool,
+		    struct runq *q)
+{
+	memset(r, 0, sizeof(*r));
+	r->pool = pool;
+	r->runq = q;
+	r->fd = -1;
+}
+
+void ameta_open(struct ameta_req *r, int dirfd, const char *path,
+		int flags, mode_t mode, ameta_func_t func)
+{
+	r->dirfd = dirfd;
+	r->path = path;
+	r->flags = flags;
+	r->mode = mode;
+	r->fd = -1;
+
+	submit(r, OP_OPEN, func);
+}
+
+void ameta_stat(struct ameta_req *r, int dirfd, const char *path,
+		int flags, ameta_func_t func)
+{
+	r->dirfd = dirfd;
+	r->path = path;
+	r->flags = flags;
+
+	submit(r, OP_STAT, func);
+}
+
+void ameta_close(struct ameta_req *r, handle_t fd, ameta_func_t func)
+{
+	r->fd = fd;
+
+	submit(r, OP_CLOSE, func);
+}
+
+void ameta_stat_batch(struct ameta_req *r, int dirfd,
+		      struct ameta_stat_ent *ents, unsigned int count,
+		      int flags, ameta_func_t func)
+{
+	r->dirfd = dirfd;
+	r->ents = ents;
+	r->count = count;
+	r->flags = flags;
+
+	submit(r, OP_STAT_BATCH, func);
+}
@@ -0,0 +1,125 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_AMETA_H_
+#define IO_AMETA_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "runq.h"
+#include "syserr.h"
+#include "handle.h"
+
+/* Asynchronous file metadata operations. Opening, closing and
+ * examining files may block for a long time on a slow or busy disk,
+ * and there's no readiness notification for them. Each operation is
+ * instead performed as a task on a thread pool dedicated to blocking
+ * calls, and completed via a separate run queue, so that the workers
+ * of the latter are never stalled on metadata.
+ *
+ * Paths are resolved relative to a directory handle, as for openat(),
+ * which may be AT_FDCWD. Path strings are not copied, and must remain
+ * valid until the operation completes. This module is available on
+ * POSIX systems only.
+ */
+struct ameta_req;
+typedef void (*ameta_func_t)(struct ameta_req *r);
+
+/* Entry for a batched stat */
+struct ameta_stat_ent {
+	const char		*path;
+
+	/* Result */
+	struct stat		st;
+	syserr_t		error;
+};
+
+/* Request. Only one operation may be outstanding on a request at a
+ * time.
+ */
+struct ameta_req {
+	/* Callback -- must be first */
+	struct runq_task	task;
+	ameta_func_t		func;
+
+	struct runq		*pool;
+	struct runq		*runq;
+
+	/* Operation */
+	int			op;
+	int			dirfd;
+	const char		*path;
+	int			flags;
+	mode_t			mode;
+	struct ameta_stat_ent	*ents;
+	unsigned int		count;
+
+	/* Result */
+	handle_t		fd;
+	struct stat		st;
+	syserr_t		error;
+};
+
+/* Initialize a request, with the pool on which to perform operations
+ * and the run queue via which to complete them.
+ */
+void ameta_req_init(struct ameta_req *r, struct runq *pool,
+		    struct runq *q);
+
+/* Open a file, with the same arguments as openat(). On success, the
+ * handle is obtained with ameta_get_fd().
+ */
+void ameta_open(struct ameta_req *r, int dirfd, const char *path,
+		int flags, mode_t mode, ameta_func_t func);
+
+/* Examine a file, with the same arguments as fstatat(). The result is
+ * obtained with ameta_get_stat().
+ */
+void ameta_stat(struct ameta_req *r, int dirfd, const char *path,
+		int flags, ameta_func_t func);
+
+/* Close a handle. The handle is released even if an error is reported,
+ * and must not be used once the operation has begun.
+ */
+void ameta_close(struct ameta_req *r, handle_t fd, ameta_func_t func);
+
+/* Examine many files at once, in a single pool task. Each entry
+ * receives its own result, and the request's error is always
+ * SYSERR_NONE. The entries must remain valid until the operation
+ * completes.
+ */
+void ameta_stat_batch(struct ameta_req *r, int dirfd,
+		      struct ameta_stat_ent *ents, unsigned int count,
+		      int flags, ameta_func_t func);
+
+/* Obtain the results of an operation */
+static inline syserr_t ameta_get_error(const struct ameta_req *r)
+{
+	return r->error;
+}
+
+static inline handle_t ameta_get_fd(const struct ameta_req *r)
+{
+	return r->fd;
+}
+
+static inline const struct stat *ameta_get_stat(const struct ameta_req *r)
+{
+	return &r->st;
+}
+
+#endif
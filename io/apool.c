@@ -0,0 +1,530 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "apool.h"
+#include "containers.h"
+
+#define CONN_FREE		0
+#define CONN_CONNECTING		1
+#define CONN_IDLE		2
+#define CONN_BUSY		3
+
+/************************************************************************
+ * Host table
+ */
+
+struct host_key {
+	const char		*hostname;
+	const char		*service;
+};
+
+static int host_compare(const void *k, const struct rbt_node *n)
+{
+	const struct host_key *key = (const struct host_key *)k;
+	const struct apool_host *h = container_of(n, struct apool_host, node);
+	int r = strcmp(key->hostname, h->hostname);
+
+	if (r)
+		return r;
+
+	return strcmp(key->service, h->service);
+}
+
+void apool_init(struct apool *p, struct ioq *q, struct adns_resolver *r)
+{
+	p->ioq = q;
+	p->resolver = r;
+	thr_mutex_init(&p->lock);
+	rbt_init(&p->hosts, host_compare);
+}
+
+void apool_destroy(struct apool *p)
+{
+	thr_mutex_destroy(&p->lock);
+}
+
+struct apool_host *apool_find(struct apool *p,
+			      const char *hostname, const char *service)
+{
+	struct host_key key;
+	struct rbt_node *n;
+
+	key.hostname = hostname;
+	key.service = service;
+
+	thr_mutex_lock(&p->lock);
+	n = rbt_find(&p->hosts, &key);
+	thr_mutex_unlock(&p->lock);
+
+	if (!n)
+		return NULL;
+
+	return container_of(n, struct apool_host, node);
+}
+
+/************************************************************************
+ * Slot management. Everything in this section is called with the host
+ * lock held. Socket and name lookup operations are begun with the lock
+ * held, which is safe because neither invokes a callback before
+ * returning.
+ */
+
+static void connect_done(struct asock *t);
+static void dns_done(struct adns_request *r);
+static void idle_expire(struct waitq_timer *t);
+
+static void req_task_func(struct runq_task *task)
+{
+	struct apool_req *r = container_of(task, struct apool_req, task);
+
+	r->func(r);
+}
+
+static void complete(struct apool_host *h, struct apool_req *r,
+		     struct apool_conn *c, neterr_t err)
+{
+	list_remove(&r->list);
+	list_init(&r->list);
+	h->n_waiting--;
+
+	r->conn = c;
+	r->error = err;
+	runq_task_exec(&r->task, req_task_func);
+}
+
+static struct apool_req *first_waiter(struct apool_host *h)
+{
+	return container_of(h->waiters.next, struct apool_req, list);
+}
+
+static void make_free(struct apool_conn *c)
+{
+	c->state = CONN_FREE;
+	list_insert(&c->list, &c->host->free);
+}
+
+static void make_idle(struct apool_conn *c)
+{
+	struct apool_host *h = c->host;
+
+	c->state = CONN_IDLE;
+	list_insert(&c->list, h->idle.next);
+	c->idle_since = clock_now();
+
+	if (!c->timer_busy) {
+		c->timer_busy = 1;
+		waitq_timer_wait(&c->timer, h->idle_ms, idle_expire);
+	}
+}
+
+/* Check that an idle connection hasn't been closed by the peer. Data
+ * arriving unsolicited also counts as a failure, since the state of
+ * the protocol is then unknown.
+ */
+#ifdef __Windows__
+static int conn_alive(struct apool_conn *c)
+{
+	struct timeval tv = {0, 0};
+	fd_set rd;
+
+	FD_ZERO(&rd);
+	FD_SET(asock_get_handle(&c->sock), &rd);
+
+	return !select(0, &rd, NULL, NULL, &tv);
+}
+#else
+static int conn_alive(struct apool_conn *c)
+{
+	uint8_t b;
+	const int r = recv(asock_get_handle(&c->sock), &b, 1,
+			   MSG_PEEK | MSG_DONTWAIT);
+
+	return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+#endif
+
+static void start_connect(struct apool_conn *c);
+
+/* Take the most recently returned idle connection which is still
+ * alive. Dead ones are reconnected in the background.
+ */
+static struct apool_conn *take_idle(struct apool_host *h)
+{
+	while (!list_is_empty(&h->idle)) {
+		struct apool_conn *c =
+			container_of(h->idle.next, struct apool_conn, list);
+
+		list_remove(&c->list);
+		if (conn_alive(c)) {
+			c->state = CONN_BUSY;
+			return c;
+		}
+
+		asock_close(&c->sock);
+		start_connect(c);
+	}
+
+	return NULL;
+}
+
+/* Give a connected slot to the first waiter, or leave it idle */
+static void hand_out(struct apool_conn *c)
+{
+	struct apool_host *h = c->host;
+
+	if (list_is_empty(&h->waiters)) {
+		make_idle(c);
+		return;
+	}
+
+	c->state = CONN_BUSY;
+	complete(h, first_waiter(h), c, 0);
+}
+
+static void begin_connect(struct apool_conn *c)
+{
+	struct apool_host *h = c->host;
+
+	memcpy(&c->addr, &h->addr, h->addr_size);
+	c->addr_size = h->addr_size;
+	asock_connect(&c->sock, (const struct sockaddr *)&c->addr,
+		      c->addr_size, connect_done);
+}
+
+static void start_connect(struct apool_conn *c)
+{
+	struct apool_host *h = c->host;
+
+	c->state = CONN_CONNECTING;
+	h->n_connecting++;
+
+	if (h->addr_size) {
+		begin_connect(c);
+		return;
+	}
+
+	list_insert(&c->list, &h->dns_wait);
+	if (!h->dns_busy) {
+		h->dns_busy = 1;
+		adns_request_ask(&h->dns, h->hostname, h->service,
+				 &h->hints, dns_done);
+	}
+}
+
+/* Start as many connections as are needed by waiting requests */
+static void fill_demand(struct apool_host *h)
+{
+	while (!h->closed && h->n_connecting < h->n_waiting &&
+	       !list_is_empty(&h->free)) {
+		struct apool_conn *c =
+			container_of(h->free.next, struct apool_conn, list);
+
+		list_remove(&c->list);
+		start_connect(c);
+	}
+}
+
+/* A connection attempt failed. If it was wanted by a waiting request,
+ * that request fails too. Failed slots aren't retried until there's
+ * new demand.
+ */
+static void connect_failed(struct apool_conn *c, neterr_t err)
+{
+	struct apool_host *h = c->host;
+
+	asock_close(&c->sock);
+	make_free(c);
+
+	if (h->n_waiting > h->n_connecting)
+		complete(h, first_waiter(h), NULL, err);
+}
+
+/************************************************************************
+ * Background events
+ */
+
+static void connect_done(struct asock *t)
+{
+	struct apool_conn *c = container_of(t, struct apool_conn, sock);
+	struct apool_host *h = c->host;
+	const neterr_t err = asock_get_error(t);
+
+	thr_mutex_lock(&h->lock);
+	h->n_connecting--;
+
+	if (h->closed) {
+		asock_close(t);
+		make_free(c);
+	} else if (err) {
+		/* Look the name up again next time */
+		h->addr_size = 0;
+		connect_failed(c, err);
+	} else {
+		const int optval = 1;
+
+		setsockopt(asock_get_handle(t), SOL_SOCKET, SO_KEEPALIVE,
+			   (const char *)&optval, sizeof(optval));
+		hand_out(c);
+	}
+
+	thr_mutex_unlock(&h->lock);
+}
+
+static void dns_done(struct adns_request *r)
+{
+	struct apool_host *h = container_of(r, struct apool_host, dns);
+	const struct addrinfo *res = adns_get_result(r);
+
+	thr_mutex_lock(&h->lock);
+	h->dns_busy = 0;
+
+	if (res && res->ai_addrlen <= sizeof(h->addr)) {
+		memcpy(&h->addr, res->ai_addr, res->ai_addrlen);
+		h->addr_size = res->ai_addrlen;
+	}
+
+	adns_clear_result(r);
+
+	while (!list_is_empty(&h->dns_wait)) {
+		struct apool_conn *c =
+			container_of(h->dns_wait.next, struct apool_conn, list);
+
+		list_remove(&c->list);
+
+		if (h->closed) {
+			h->n_connecting--;
+			make_free(c);
+		} else if (h->addr_size) {
+			begin_connect(c);
+		} else {
+			h->n_connecting--;
+			connect_failed(c, APOOL_ERR_RESOLVE);
+		}
+	}
+
+	thr_mutex_unlock(&h->lock);
+}
+
+static void idle_expire(struct waitq_timer *t)
+{
+	struct apool_conn *c = container_of(t, struct apool_conn, timer);
+	struct apool_host *h = c->host;
+
+	thr_mutex_lock(&h->lock);
+	c->timer_busy = 0;
+
+	if (c->state == CONN_IDLE) {
+		const clock_ticks_t idle = clock_now() - c->idle_since;
+
+		if (idle >= h->idle_ms) {
+			list_remove(&c->list);
+			asock_close(&c->sock);
+			make_free(c);
+		} else {
+			/* Taken and returned since the timer was set */
+			c->timer_busy = 1;
+			waitq_timer_wait(t, h->idle_ms - idle, idle_expire);
+		}
+	}
+
+	thr_mutex_unlock(&h->lock);
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+int apool_host_init(struct apool_host *h, struct apool *p,
+		    const char *hostname, const char *service,
+		    struct apool_conn *conns, unsigned int max_conns,
+		    int idle_ms)
+{
+	struct host_key key;
+	unsigned int i;
+	int r = 0;
+
+	memset(h, 0, sizeof(*h));
+	h->owner = p;
+	h->hostname = hostname;
+	h->service = service;
+	h->idle_ms = idle_ms;
+	h->conns = conns;
+	h->max_conns = max_conns;
+
+	thr_mutex_init(&h->lock);
+	list_init(&h->idle);
+	list_init(&h->free);
+	list_init(&h->waiters);
+	list_init(&h->dns_wait);
+
+	adns_request_init(&h->dns, p->resolver);
+	h->hints.ai_family = AF_UNSPEC;
+	h->hints.ai_socktype = SOCK_STREAM;
+
+	for (i = 0; i < max_conns; i++) {
+		struct apool_conn *c = &conns[i];
+
+		memset(c, 0, sizeof(*c));
+		c->host = h;
+		asock_init(&c->sock, p->ioq);
+		waitq_timer_init(&c->timer, ioq_waitq(p->ioq));
+		make_free(c);
+	}
+
+	key.hostname = hostname;
+	key.service = service;
+
+	thr_mutex_lock(&p->lock);
+	if (rbt_find(&p->hosts, &key))
+		r = -1;
+	else
+		rbt_insert(&p->hosts, &key, &h->node);
+	thr_mutex_unlock(&p->lock);
+
+	if (r < 0)
+		apool_host_destroy(h);
+
+	return r;
+}
+
+void apool_host_close(struct apool_host *h)
+{
+	thr_mutex_lock(&h->lock);
+	h->closed = 1;
+
+	while (!list_is_empty(&h->waiters))
+		complete(h, first_waiter(h), NULL, APOOL_ERR_CLOSED);
+
+	while (!list_is_empty(&h->idle)) {
+		struct apool_conn *c =
+			container_of(h->idle.next, struct apool_conn, list);
+
+		list_remove(&c->list);
+		asock_close(&c->sock);
+		make_free(c);
+
+		if (c->timer_busy)
+			waitq_timer_cancel(&c->timer);
+	}
+
+	if (h->dns_busy)
+		adns_request_cancel(&h->dns);
+
+	thr_mutex_unlock(&h->lock);
+}
+
+int apool_host_busy(struct apool_host *h)
+{
+	unsigned int i;
+	int r;
+
+	thr_mutex_lock(&h->lock);
+	r = h->n_connecting || h->dns_busy;
+
+	for (i = 0; !r && i < h->max_conns; i++)
+		r = h->conns[i].timer_busy;
+
+	thr_mutex_unlock(&h->lock);
+
+	return r;
+}
+
+void apool_host_destroy(struct apool_host *h)
+{
+	struct apool *p = h->owner;
+	struct host_key key;
+	unsigned int i;
+
+	key.hostname = h->hostname;
+	key.service = h->service;
+
+	/* If initialization failed, another host has this key */
+	thr_mutex_lock(&p->lock);
+	if (rbt_find(&p->hosts, &key) == &h->node)
+		rbt_remove(&p->hosts, &h->node);
+	thr_mutex_unlock(&p->lock);
+
+	for (i = 0; i < h->max_conns; i++)
+		asock_destroy(&h->conns[i].sock);
+
+	adns_request_destroy(&h->dns);
+	thr_mutex_destroy(&h->lock);
+}
+
+void apool_get(struct apool_host *h, struct apool_req *r, apool_func_t func)
+{
+	r->func = func;
+	runq_task_init(&r->task, ioq_runq(h->owner->ioq));
+
+	thr_mutex_lock(&h->lock);
+	list_insert(&r->list, &h->waiters);
+	h->n_waiting++;
+
+	if (h->closed) {
+		complete(h, r, NULL, APOOL_ERR_CLOSED);
+	} else {
+		struct apool_conn *c = take_idle(h);
+
+		if (c)
+			complete(h, r, c, 0);
+		else
+			fill_demand(h);
+	}
+
+	thr_mutex_unlock(&h->lock);
+}
+
+void apool_cancel(struct apool_host *h, struct apool_req *r)
+{
+	thr_mutex_lock(&h->lock);
+	if (!list_is_empty(&r->list))
+		complete(h, r, NULL, APOOL_ERR_CLOSED);
+	thr_mutex_unlock(&h->lock);
+}
+
+void apool_put(struct apool_conn *c, int reuse)
+{
+	struct apool_host *h = c->host;
+
+	thr_mutex_lock(&h->lock);
+
+	if (h->closed) {
+		asock_close(&c->sock);
+		make_free(c);
+	} else if (!reuse) {
+		asock_close(&c->sock);
+		start_connect(c);
+	} else {
+		hand_out(c);
+	}
+
+	thr_mutex_unlock(&h->lock);
+}
+
+unsigned int apool_host_idle_count(struct apool_host *h)
+{
+	struct list_node *n;
+	unsigned int count = 0;
+
+	thr_mutex_lock(&h->lock);
+	for (n = h->idle.next; n != &h->idle; n = n->next)
+		count++;
+	thr_mutex_unlock(&h->lock);
+
+	return count;
+}
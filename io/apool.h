@@ -0,0 +1,210 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_APOOL_H_
+#define IO_APOOL_H_
+
+#include "asock.h"
+#include "adns.h"
+#include "waitq.h"
+#include "rbt.h"
+#include "list.h"
+
+/* Client connection pool. Each upstream host has a fixed set of
+ * connection slots, which caps the number of connections made to it.
+ * Connected sockets are handed out on request, and returned to the pool
+ * afterwards, so that consecutive requests to the same host share one
+ * name lookup and one handshake.
+ *
+ * Idle connections are closed after a configurable interval. Slots
+ * whose connections are discarded because of an error are reconnected
+ * in the background.
+ *
+ * Idle connections aren't watched, but each is checked before it's
+ * handed out. If the peer has closed it (or sent data which nobody
+ * asked for), it's discarded and reconnected in the background, and
+ * the next idle connection is tried instead.
+ */
+struct apool {
+	struct ioq		*ioq;
+	struct adns_resolver	*resolver;
+
+	thr_mutex_t		lock;
+	struct rbt		hosts;
+};
+
+/* Initialize/destroy a pool. Hosts must be removed before the pool is
+ * destroyed.
+ */
+void apool_init(struct apool *p, struct ioq *q, struct adns_resolver *r);
+void apool_destroy(struct apool *p);
+
+/* Errors reported for a request which can't be satisfied because the
+ * host name couldn't be resolved, or because the host was closed.
+ */
+#ifdef __Windows__
+#define APOOL_ERR_RESOLVE	WSAEHOSTUNREACH
+#define APOOL_ERR_CLOSED	WSAECANCELLED
+#else
+#define APOOL_ERR_RESOLVE	EHOSTUNREACH
+#define APOOL_ERR_CLOSED	ECANCELED
+#endif
+
+/* Connection slot. The socket may be used freely by whoever obtained
+ * the connection from the pool, but it must have no outstanding
+ * operations when it's returned.
+ */
+struct apool_host;
+
+struct apool_conn {
+	struct asock		sock;
+	struct apool_host	*host;
+
+	/* State: protected by host lock */
+	struct list_node	list;
+	int			state;
+	struct sockaddr_storage	addr;
+	size_t			addr_size;
+
+	/* Idle expiry. The timer isn't cancelled when the connection
+	 * is taken, but checks the idle time on expiry.
+	 */
+	struct waitq_timer	timer;
+	int			timer_busy;
+	clock_ticks_t		idle_since;
+};
+
+/* Request for a connection */
+struct apool_req;
+typedef void (*apool_func_t)(struct apool_req *r);
+
+struct apool_req {
+	/* Callback -- must be first */
+	struct runq_task	task;
+	apool_func_t		func;
+
+	/* Protected by host lock while waiting */
+	struct list_node	list;
+
+	/* Result */
+	struct apool_conn	*conn;
+	neterr_t		error;
+};
+
+/* Upstream host. The host name and service strings are not copied, and
+ * must remain valid for as long as the host is in use.
+ */
+struct apool_host {
+	struct apool		*owner;
+	struct rbt_node		node;
+	const char		*hostname;
+	const char		*service;
+	int			idle_ms;
+
+	thr_mutex_t		lock;
+	int			closed;
+	struct apool_conn	*conns;
+	unsigned int		max_conns;
+
+	/* Slots, by state. Idle connections are reused most recently
+	 * returned first, so that surplus ones expire.
+	 */
+	struct list_node	idle;
+	struct list_node	free;
+	struct list_node	waiters;
+	unsigned int		n_waiting;
+	unsigned int		n_connecting;
+
+	/* Name resolution. The first address found is cached until a
+	 * connection to it fails.
+	 */
+	struct adns_request	dns;
+	struct addrinfo		hints;
+	int			dns_busy;
+	struct list_node	dns_wait;
+	struct sockaddr_storage	addr;
+	size_t			addr_size;
+};
+
+/* Initialize a host with the given array of connection slots, and add
+ * it to the pool. Connections which are idle for longer than idle_ms
+ * are closed. Returns -1 if a host with the same name and service has
+ * already been added.
+ */
+int apool_host_init(struct apool_host *h, struct apool *p,
+		    const char *hostname, const char *service,
+		    struct apool_conn *conns, unsigned int max_conns,
+		    int idle_ms);
+
+/* Look up a host by name and service. Returns NULL if not found. */
+struct apool_host *apool_find(struct apool *p,
+			      const char *hostname, const char *service);
+
+/* Close a host. Idle connections are closed, and waiting requests fail
+ * with APOOL_ERR_CLOSED. Connections subsequently returned are closed.
+ */
+void apool_host_close(struct apool_host *h);
+
+/* Return non-zero if there are background operations (connects, name
+ * lookups or idle timers) in progress for the host.
+ */
+int apool_host_busy(struct apool_host *h);
+
+/* Remove a host from the pool and destroy it. The host must be closed,
+ * all connections must have been returned, and it must not be busy.
+ */
+void apool_host_destroy(struct apool_host *h);
+
+/* Obtain a connection to the host. An idle connection is used if there
+ * is one which is still alive. Otherwise, a new one is made if a slot is
+ * free, or the request waits for a connection to be returned.
+ *
+ * The request completes via the run queue. On failure, the connection
+ * is NULL.
+ */
+void apool_get(struct apool_host *h, struct apool_req *r, apool_func_t func);
+
+static inline struct apool_conn *apool_get_conn(const struct apool_req *r)
+{
+	return r->conn;
+}
+
+static inline neterr_t apool_get_error(const struct apool_req *r)
+{
+	return r->error;
+}
+
+/* Cancel a waiting request. If it hasn't already been satisfied, it
+ * completes with APOOL_ERR_CLOSED.
+ */
+void apool_cancel(struct apool_host *h, struct apool_req *r);
+
+/* Obtain the socket for a connection */
+static inline struct asock *apool_conn_sock(struct apool_conn *c)
+{
+	return &c->sock;
+}
+
+/* Return a connection to the pool. If reuse is zero (because the
+ * connection is broken or its state is unknown), it's closed and the
+ * slot is reconnected in the background.
+ */
+void apool_put(struct apool_conn *c, int reuse);
+
+/* Count the idle connections for a host */
+unsigned int apool_host_idle_count(struct apool_host *h);
+
+#endif
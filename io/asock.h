@@ -21,6 +21,12 @@
 #include "ioq.h"
 #include "handle.h"
 
+#ifndef __Windows__
+#include <sys/uio.h>
+#include "overload.h"
+#include "slab.h"
+#endif
+
 /* Asynchronous socket */
 struct asock;
 typedef void (*asock_func_t)(struct asock *t);
@@ -29,15 +35,20 @@ typedef void (*asock_func_t)(struct asock *t);
 struct asock {
 	struct ioq		*ioq;
 	net_sock_t		sock;
+	int			family;
 
-	/* Connect/accept request */
+	/* Connect/accept request. AcceptEx() needs room for two
+	 * addresses, each with 16 bytes of padding.
+	 */
 	asock_func_t		ca_func;
 	net_sock_t		ca_sock;
 	neterr_t		ca_error;
 	struct ioq_ovl		ca_ovl;
 	struct asock		*ca_client;
-	uint8_t			ca_addr_info[64];
+	uint8_t			ca_addr_info[(sizeof(struct sockaddr_in6) +
+					      16) * 2];
 	net_sock_t		ca_accept_sock;
+	DWORD			ca_sent;
 
 	/* Send request */
 	asock_func_t		send_func;
@@ -60,34 +71,75 @@ struct asock {
 	struct ioq		*ioq;
 	net_sock_t		sock;
 
-	/* Connect/accept request */
+	/* Connect/accept request. An accept fills up to ca_max sockets
+	 * of the ca_client array.
+	 */
 	asock_func_t		ca_func;
 	neterr_t		ca_error;
 	const struct sockaddr	*ca_addr;
 	size_t			ca_size;
 	struct asock		*ca_client;
+	unsigned int		ca_max;
+	unsigned int		ca_count;
+	size_t			ca_sent;
 
-	/* Send request */
+	/* Send request. If send_file is valid, data is sent from the
+	 * file at send_offset. Otherwise, if send_iov is non-NULL, it's
+	 * used instead of send_data.
+	 */
 	asock_func_t		send_func;
 	const uint8_t		*send_data;
 	size_t			send_size;
+	const struct iovec	*send_iov;
+	int			send_iovcnt;
+	handle_t		send_file;
+	off_t			send_offset;
+	handle_t		send_pipe;
 	neterr_t		send_error;
 
-	/* Receive request */
+	/* Zero-copy sends of at least zc_threshold bytes (0 if
+	 * disabled). zc_seq counts zero-copy sends made on this socket,
+	 * and zc_done is the number known to have completed.
+	 */
+	size_t			zc_threshold;
+	uint32_t		zc_seq;
+	uint32_t		zc_done;
+
+	/* Receive request. If recv_pipe is valid, data is spliced into
+	 * it rather than received into memory.
+	 */
 	asock_func_t		recv_func;
 	uint8_t			*recv_data;
 	size_t			recv_size;
+	const struct iovec	*recv_iov;
+	int			recv_iovcnt;
+	handle_t		recv_pipe;
+	struct asock_bufpool	*recv_pool;
 	neterr_t		recv_error;
 
+	/* Relay this socket belongs to, if any (see asock_proxy()) */
+	struct asock_proxy	*proxy;
+
+	/* Queue of posted messages (see asock_post()) */
+	thr_mutex_t		sendq_lock;
+	struct slist		sendq;
+
 	/* Event wait process */
 	thr_mutex_t		wait_lock;
 	struct ioq_fd		wait_fd;
 	int			wait_ops;
 
 	/* Dispatcher */
-	thr_mutex_t		dispatch_lock;
 	struct runq_task	dispatch_task;
-	int			dispatch_queue;
+	thr_atomic_t		dispatch_queue;
+
+	/* Admission control for listeners. The paused flag is
+	 * protected by wait_lock.
+	 */
+	struct overload		*ol;
+	int			ol_mode;
+	struct waitq_timer	ol_timer;
+	int			ol_paused;
 };
 #endif
 
@@ -118,12 +170,27 @@ static inline net_sock_t asock_get_handle(const struct asock *t)
  */
 void asock_close(struct asock *t);
 
-/* Begin listening on the given socket address. If this fails, -1 is
+/* Begin listening on the given socket address. The socket is created
+ * in the address's family, which may be AF_INET or AF_INET6 (or, on
+ * POSIX systems, AF_UNIX, in which case the caller is responsible for
+ * removing any stale socket file beforehand). If this fails, -1 is
  * returned, and the last error is available via asock_get_error().
  */
 int asock_listen(struct asock *t, const struct sockaddr *sa,
 		 size_t sa_size);
 
+/* Listener options, which may be set once listening. TCP Fast Open
+ * allows clients holding a cookie from an earlier connection to send
+ * data with their SYN, and qlen limits the number of such connections
+ * pending. Deferred accept (Linux only) completes accepts only once
+ * the client has sent data, or timeout_s seconds have passed.
+ *
+ * Each returns 0 on success, or -1 if the option isn't supported (the
+ * error is available via asock_get_error()).
+ */
+int asock_set_fastopen(struct asock *t, int qlen);
+int asock_set_defer_accept(struct asock *t, int timeout_s);
+
 /* Wait for, and accept an incoming socket. The given client pointer
  * must point to an already-initialized (but inactive) socket. If
  * successful, there will be no error reported by asock_get_error().
@@ -137,8 +204,62 @@ int asock_listen(struct asock *t, const struct sockaddr *sa,
 void asock_accept(struct asock *t, struct asock *client,
 		  asock_func_t func);
 
-/* Connect to a server. The socket will report no error if
- * successful.
+#ifndef __Windows__
+/* Accept a batch of incoming sockets. The operation completes as soon
+ * as at least one connection is available, after draining as many as
+ * possible from the backlog into the given array of max (at least 1)
+ * initialized (but inactive) sockets. The number accepted is
+ * available via asock_get_accept_count(), and is 0 if the operation
+ * fails or is cancelled.
+ */
+void asock_accept_many(struct asock *t, struct asock *clients,
+		       unsigned int max, asock_func_t func);
+
+static inline unsigned int asock_get_accept_count(const struct asock *t)
+{
+	return t->ca_count;
+}
+
+/* Listen on the same address with a group of n sockets, using
+ * SO_REUSEPORT so that the kernel distributes incoming connections
+ * between them. Each socket must be initialized, and may belong to a
+ * different IO queue. If the address has a zero port, the port chosen
+ * for the first socket is used for the rest.
+ *
+ * Returns 0 on success. On failure, all sockets in the group are
+ * closed, -1 is returned and the error is available via
+ * asock_get_error() on the first socket.
+ */
+int asock_listen_group(struct asock *ts, unsigned int n,
+		       const struct sockaddr *sa, size_t sa_size);
+
+/* Admission control for a listening socket. While the given detector
+ * reports overload, the listener either stops accepting and leaves
+ * new connections in the kernel's backlog (ASOCK_OVERLOAD_PAUSE), or
+ * accepts and immediately resets them (ASOCK_OVERLOAD_SHED). A paused
+ * accept is retried every ASOCK_OVERLOAD_RETRY milliseconds, and shed
+ * connections are never reported to the accept callback.
+ *
+ * Passing a NULL detector disables admission control. This must not be
+ * changed while an accept is outstanding.
+ */
+#define ASOCK_OVERLOAD_PAUSE	0
+#define ASOCK_OVERLOAD_SHED	1
+
+#define ASOCK_OVERLOAD_RETRY	10
+
+static inline void asock_set_overload(struct asock *t, struct overload *o,
+				      int mode)
+{
+	t->ol = o;
+	t->ol_mode = mode;
+}
+#endif
+
+/* Connect to a server. The socket is created in the family of the
+ * given address, as for asock_listen(). It will report no error if
+ * successful. On POSIX systems, an AF_UNIX connection to a listener
+ * whose backlog is full fails immediately with EAGAIN.
  *
  * You may not simultaneously have outstanding accept and connect
  * operations.
@@ -149,11 +270,32 @@ void asock_accept(struct asock *t, struct asock *client,
 void asock_connect(struct asock *t, const struct sockaddr *sa,
 		   size_t sa_size, asock_func_t func);
 
+/* Connect, carrying initial data. The system may take some or all of
+ * the data: it goes with the SYN if a TCP Fast Open cookie is held for
+ * the server, saving a round trip, and otherwise straight after the
+ * handshake. The number of bytes taken is available via
+ * asock_get_connect_sent() once the connection completes, and the
+ * caller should send the rest (on POSIX systems, this may be all of
+ * it). The data must remain valid until the operation completes.
+ */
+void asock_connect_data(struct asock *t, const struct sockaddr *sa,
+			size_t sa_size, const uint8_t *data, size_t len,
+			asock_func_t func);
+
+static inline size_t asock_get_connect_sent(const struct asock *t)
+{
+	return t->ca_sent;
+}
+
 /* Send data on a connected socket. This operation has its own separate
  * result/error codes, and can be performed simultaneously with other
  * operations.
  *
  * It may be the case that not all of the supplied data is sent.
+ *
+ * On POSIX systems, the transfer is attempted immediately, and only
+ * waits for readiness if it would block. The callback is always
+ * invoked via the run queue, never from within this call.
  */
 void asock_send(struct asock *t, const uint8_t *data, size_t len,
 		asock_func_t func);
@@ -168,12 +310,13 @@ static inline size_t asock_get_send_size(const struct asock *t)
 	return t->send_size;
 }
 
-/* Send data on a connected socket. This operation has its own separate
- * result/error codes, and can be performed simultaneously with other
- * operations.
+/* Receive data on a connected socket. This operation has its own
+ * separate result/error codes, and can be performed simultaneously with
+ * other operations.
  *
  * A read on a gracefully closed socket returns 0 bytes, with no error
- * code.
+ * code. As with asock_send(), the transfer is attempted immediately on
+ * POSIX systems.
  */
 void asock_recv(struct asock *t, uint8_t *data, size_t max_size,
 		asock_func_t func);
@@ -188,4 +331,256 @@ static inline size_t asock_get_recv_size(const struct asock *t)
 	return t->recv_size;
 }
 
+#ifndef __Windows__
+/* Vectored (scatter/gather) versions of asock_send() and asock_recv().
+ * Each transfers data to or from a sequence of segments in a single
+ * system call. The iovec array and the memory it describes must remain
+ * valid until the operation completes.
+ *
+ * Results are obtained via the same functions as for the flat versions.
+ * The size reported is the total over all segments.
+ */
+void asock_sendv(struct asock *t, const struct iovec *iov, int iovcnt,
+		 asock_func_t func);
+void asock_recvv(struct asock *t, const struct iovec *iov, int iovcnt,
+		 asock_func_t func);
+
+/* Zero-copy sends. Once enabled on a connected socket, any
+ * asock_send() or asock_sendv() of at least threshold bytes is made
+ * with MSG_ZEROCOPY: the kernel transmits directly from the caller's
+ * memory rather than copying it. Smaller sends are copied as usual,
+ * since below roughly 10 kB the notification overhead outweighs the
+ * copy. A threshold of 0 disables zero-copy sends.
+ *
+ * The send callback for a zero-copy send is invoked only after the
+ * kernel has reported, via the socket's error queue, that it no longer
+ * references the buffer. Until then, the buffer belongs to the kernel
+ * and must not be modified or freed. If the socket is closed before
+ * that, the send completes with ECANCELED, and the buffer may remain
+ * in use until the connection has been torn down.
+ *
+ * Returns 0 on success, or -1 if zero-copy isn't supported (the error
+ * is available via asock_get_error()). The setting applies to the
+ * current connection only.
+ */
+int asock_set_zerocopy(struct asock *t, size_t threshold);
+
+/* Number of zero-copy sends made on the current connection, and the
+ * number of those which the kernel has since released. These are equal
+ * whenever a send callback is invoked, unless the send failed.
+ */
+static inline uint32_t asock_get_zerocopy_sent(const struct asock *t)
+{
+	return t->zc_seq;
+}
+
+static inline uint32_t asock_get_zerocopy_done(const struct asock *t)
+{
+	return t->zc_done;
+}
+
+/* Send up to len bytes from a file, starting at the given offset,
+ * without copying through user memory (via sendfile()). The file's own
+ * position is not changed. The file may be the handle of an afile.
+ *
+ * As with asock_send(), not all of the data may be sent. The number of
+ * bytes transferred is reported by asock_get_send_size(), and the
+ * offset following the last byte sent by asock_get_send_offset(), so a
+ * transfer is continued by calling this function again from the
+ * callback.
+ */
+void asock_sendfile(struct asock *t, handle_t file, off_t offset,
+		    size_t len, asock_func_t func);
+
+static inline off_t asock_get_send_offset(const struct asock *t)
+{
+	return t->send_offset;
+}
+
+/* Receive buffer pool. A pooled receive doesn't hold a buffer while
+ * it waits: one is taken from the pool only when data arrives, and is
+ * handed to the callback, which must return it with
+ * asock_bufpool_put() when done. Memory use therefore scales with the
+ * amount of traffic in flight rather than with the number of idle
+ * connections, and buffers are released back to the system as the
+ * pool drains.
+ *
+ * A pool may be shared by any number of sockets, in any thread. If max
+ * is non-zero, no more than that many buffers are handed out at once,
+ * and a pooled receive which finds the pool exhausted when data
+ * arrives fails with ENOBUFS.
+ */
+struct asock_bufpool {
+	thr_mutex_t		lock;
+	struct slab		slab;
+	size_t			size;
+	unsigned int		count;
+	unsigned int		max;
+};
+
+void asock_bufpool_init(struct asock_bufpool *p, size_t buf_size,
+			unsigned int max);
+void asock_bufpool_destroy(struct asock_bufpool *p);
+
+/* Take a buffer from the pool, or return NULL if none is available */
+uint8_t *asock_bufpool_get(struct asock_bufpool *p);
+
+/* Return a buffer to the pool */
+void asock_bufpool_put(struct asock_bufpool *p, uint8_t *buf);
+
+static inline size_t asock_bufpool_size(const struct asock_bufpool *p)
+{
+	return p->size;
+}
+
+/* Receive into a buffer taken from the given pool. On completion,
+ * asock_get_recv_data() gives the buffer, and asock_get_recv_size()
+ * the number of bytes in it. If nothing was received (end-of-file or
+ * an error), there is no buffer, and the data pointer is NULL.
+ */
+void asock_recv_pooled(struct asock *t, struct asock_bufpool *p,
+		       asock_func_t func);
+
+static inline uint8_t *asock_get_recv_data(const struct asock *t)
+{
+	return t->recv_data;
+}
+
+/* Transfers between a socket and a pipe, via splice(), without
+ * copying through user memory. asock_splice_recv() moves up to len
+ * bytes from the socket into the write end of a pipe, which must have
+ * room for them. asock_splice_send() moves up to len bytes from the
+ * read end of a pipe, which must already hold them. Results are
+ * reported as for asock_recv() and asock_send().
+ */
+void asock_splice_recv(struct asock *t, handle_t pipe, size_t len,
+		       asock_func_t func);
+void asock_splice_send(struct asock *t, handle_t pipe, size_t len,
+		       asock_func_t func);
+
+/* Bidirectional relay between two connected sockets. Data is moved in
+ * each direction through a kernel pipe in chunks of up to
+ * ASOCK_PROXY_CHUNK bytes, and no more is read from one side until the
+ * other has taken what was read before.
+ *
+ * When one side reaches end-of-file, the write half of the other side
+ * is shut down, and the opposite direction continues until it too
+ * finishes. An error in either direction shuts down both sockets
+ * entirely. Once both directions have finished, the callback is
+ * invoked. The sockets are left open, and must not be used for any
+ * other operation while the relay is active.
+ *
+ * Returns 0 if the relay was started, or -1 if the pipes couldn't be
+ * created (in which case the callback is never invoked, and the error
+ * is reported for both directions).
+ */
+#define ASOCK_PROXY_CHUNK	65536
+
+#define ASOCK_PROXY_A_TO_B	0
+#define ASOCK_PROXY_B_TO_A	1
+
+struct asock_proxy;
+typedef void (*asock_proxy_func_t)(struct asock_proxy *p);
+
+struct asock_proxy_dir {
+	struct asock		*from;
+	struct asock		*to;
+	handle_t		pipe[2];
+	size_t			pending;
+	uint64_t		count;
+	neterr_t		error;
+};
+
+struct asock_proxy {
+	struct asock_proxy_dir	dirs[2];
+	asock_proxy_func_t	func;
+	thr_mutex_t		lock;
+	int			active;
+};
+
+int asock_proxy(struct asock_proxy *p, struct asock *a, struct asock *b,
+		asock_proxy_func_t func);
+
+/* Obtain the number of bytes relayed, and the error (if any) which
+ * ended the relay, in the given direction.
+ */
+static inline uint64_t asock_proxy_count(const struct asock_proxy *p,
+					 int dir)
+{
+	return p->dirs[dir].count;
+}
+
+static inline neterr_t asock_proxy_error(const struct asock_proxy *p,
+					 int dir)
+{
+	return p->dirs[dir].error;
+}
+
+/* Locate the resume point after a partial vectored transfer of len
+ * bytes. Returns the index of the first segment which was not entirely
+ * transferred (iovcnt if all were), and sets *offset to the number of
+ * bytes already transferred from that segment.
+ */
+static inline int asock_iov_split(const struct iovec *iov, int iovcnt,
+				  size_t len, size_t *offset)
+{
+	int i;
+
+	for (i = 0; i < iovcnt && len >= iov[i].iov_len; i++)
+		len -= iov[i].iov_len;
+
+	*offset = (i < iovcnt) ? len : 0;
+	return i;
+}
+
+/* Queued sends. Any number of messages may be posted to a connected
+ * socket without waiting for earlier ones to complete. Queued messages
+ * are sent in order, coalesced into a single sendmsg() call of up to
+ * ASOCK_SENDQ_IOV segments wherever possible.
+ *
+ * Each message's callback is invoked, via the run queue, once the
+ * message has been sent completely, or when an error occurs. The
+ * callback may be NULL. Because messages complete in order, setting a
+ * callback on only the last message of a group gives a single
+ * completion for the whole group.
+ *
+ * If the socket is closed or an error occurs, all queued messages are
+ * completed. A cancelled message reports no error, but fewer bytes
+ * sent than its size.
+ *
+ * The message structure and its data must not be modified, reused or
+ * destroyed until it completes. Posted messages and asock_send() form
+ * independent streams, so the two should not be mixed.
+ */
+#define ASOCK_SENDQ_IOV		64
+
+struct asock_msg;
+typedef void (*asock_msg_func_t)(struct asock_msg *m);
+
+struct asock_msg {
+	/* Must be first */
+	struct runq_task	task;
+
+	struct asock		*owner;
+	struct slist_node	queue;
+	const uint8_t		*data;
+	size_t			size;
+	size_t			sent;
+	neterr_t		error;
+};
+
+void asock_post(struct asock *t, struct asock_msg *m,
+		const uint8_t *data, size_t len, asock_msg_func_t func);
+
+static inline size_t asock_msg_sent(const struct asock_msg *m)
+{
+	return m->sent;
+}
+
+static inline neterr_t asock_msg_error(const struct asock_msg *m)
+{
+	return m->error;
+}
+#endif
+
 #endif
@@ -14,8 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 #include "asock.h"
 #include "containers.h"
 
@@ -24,6 +29,8 @@
 #define OP_SEND		0x04
 #define OP_RECV		0x08
 #define OP_CANCEL	0x10
+#define OP_SENDQ	0x20
+#define OP_ZEROCOPY	0x40
 
 /************************************************************************
  * Dispatcher
@@ -32,12 +39,7 @@
 static void dispatch_func(struct runq_task *task)
 {
 	struct asock *t = container_of(task, struct asock, dispatch_task);
-	int ops;
-
-	thr_mutex_lock(&t->dispatch_lock);
-	ops = t->dispatch_queue;
-	t->dispatch_queue = 0;
-	thr_mutex_unlock(&t->dispatch_lock);
+	const int ops = thr_atomic_swap(&t->dispatch_queue, 0);
 
 	if (ops & (OP_CONNECT | OP_ACCEPT))
 		t->ca_func(t);
@@ -49,15 +51,125 @@ static void dispatch_func(struct runq_task *task)
 
 static void dispatch_push(struct asock *t, int ops)
 {
-	int old_queue;
+	/* Only the push which finds the queue empty schedules the task.
+	 * The task claims everything queued so far with a single swap,
+	 * so no event is lost or delivered twice.
+	 */
+	if (!thr_atomic_or(&t->dispatch_queue, ops) && ops)
+		runq_task_exec(&t->dispatch_task, dispatch_func);
+}
 
-	thr_mutex_lock(&t->dispatch_lock);
-	old_queue = t->dispatch_queue;
-	t->dispatch_queue |= ops;
-	thr_mutex_unlock(&t->dispatch_lock);
+/************************************************************************
+ * Send queue
+ */
 
-	if (!old_queue && ops)
-		runq_task_exec(&t->dispatch_task, dispatch_func);
+static void sendq_fail(struct asock *t, neterr_t err)
+{
+	struct slist_node *n;
+	struct slist done;
+
+	slist_init(&done);
+
+	thr_mutex_lock(&t->sendq_lock);
+	while ((n = slist_pop(&t->sendq))) {
+		struct asock_msg *m = container_of(n, struct asock_msg, queue);
+
+		m->error = err;
+		if (m->task.func)
+			slist_append(&done, &m->task.job_list);
+	}
+	thr_mutex_unlock(&t->sendq_lock);
+
+	runq_exec_list(ioq_runq(t->ioq), &done);
+}
+
+/* Retire messages covered by a transfer of len bytes. Returns non-zero
+ * if the queue is now empty. Must be called with the sendq lock held.
+ */
+static int sendq_advance(struct asock *t, size_t len, struct slist *done)
+{
+	while (t->sendq.start) {
+		struct asock_msg *m = container_of(t->sendq.start,
+			struct asock_msg, queue);
+		const size_t rem = m->size - m->sent;
+
+		if (rem > len) {
+			m->sent += len;
+			return 0;
+		}
+
+		len -= rem;
+		m->sent = m->size;
+		m->error = 0;
+		slist_pop(&t->sendq);
+
+		if (m->task.func)
+			slist_append(done, &m->task.job_list);
+	}
+
+	return 1;
+}
+
+/* Send as much of the queue as we can. Only one thread may be flushing
+ * at any time: this is whoever posted to the empty queue, or the wait
+ * process after that. Returns non-zero if the queue has been emptied
+ * (or failed), or 0 if we need to wait for the socket to drain.
+ */
+static int sendq_flush(struct asock *t, int fd)
+{
+	struct iovec iov[ASOCK_SENDQ_IOV];
+	struct slist done;
+	int finished = 0;
+
+	slist_init(&done);
+
+	while (!finished) {
+		struct slist_node *n;
+		struct msghdr msg;
+		size_t total = 0;
+		int count = 0;
+		int r;
+
+		thr_mutex_lock(&t->sendq_lock);
+		for (n = t->sendq.start; n && count < lengthof(iov);
+		     n = n->next) {
+			struct asock_msg *m = container_of(n,
+				struct asock_msg, queue);
+
+			iov[count].iov_base = (void *)(m->data + m->sent);
+			iov[count].iov_len = m->size - m->sent;
+			total += iov[count].iov_len;
+			count++;
+		}
+		thr_mutex_unlock(&t->sendq_lock);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		r = sendmsg(fd, &msg, MSG_DONTWAIT);
+		if (r < 0) {
+			const neterr_t err = errno;
+
+			runq_exec_list(ioq_runq(t->ioq), &done);
+			if (err == EAGAIN)
+				return 0;
+
+			sendq_fail(t, err);
+			return 1;
+		}
+
+		thr_mutex_lock(&t->sendq_lock);
+		finished = sendq_advance(t, r, &done);
+		thr_mutex_unlock(&t->sendq_lock);
+
+		/* A short write means the socket buffer is full */
+		if (r < total)
+			break;
+	}
+
+	runq_exec_list(ioq_runq(t->ioq), &done);
+	return finished;
 }
 
 /************************************************************************
@@ -70,12 +182,16 @@ static ioq_fd_mask_t wait_mask(int ops)
 {
 	ioq_fd_mask_t m = 0;
 
-	if (ops & (OP_CONNECT | OP_SEND))
+	if (ops & (OP_CONNECT | OP_SEND | OP_SENDQ))
 		m |= IOQ_EVENT_OUT;
 
 	if (ops & (OP_CONNECT | OP_ACCEPT | OP_RECV))
 		m |= IOQ_EVENT_IN | IOQ_EVENT_ERR | IOQ_EVENT_HUP;
 
+	/* Zero-copy completions are signalled by an error event */
+	if (ops & OP_ZEROCOPY)
+		m |= IOQ_EVENT_ERR;
+
 	return m;
 }
 
@@ -83,8 +199,8 @@ static int wait_connect(struct asock *t)
 {
 	int r = connect(t->wait_fd.fd, t->ca_addr, t->ca_size);
 
-	if (r < 0) {
-		if (errno == EAGAIN)
+	if (r < 0 && errno != EISCONN) {
+		if (errno == EALREADY)
 			return 0;
 
 		t->ca_error = errno;
@@ -95,42 +211,144 @@ static int wait_connect(struct asock *t)
 	return OP_CONNECT;
 }
 
-static int wait_accept(struct asock *t)
+static void shed_connection(int fd)
 {
-	struct sockaddr_in in;
-	socklen_t len = sizeof(in);
-	int r;
+	struct linger lg;
+
+	/* Reset rather than close gracefully, so that the client gives up
+	 * immediately.
+	 */
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(fd);
+}
 
+/* Drain up to ca_max connections from the backlog. An error is
+ * reported only if nothing was accepted -- otherwise it will recur on
+ * the next attempt.
+ */
+static int wait_accept(struct asock *t)
+{
 	if (!(ioq_fd_ready(&t->wait_fd) &
 		(IOQ_EVENT_IN | IOQ_EVENT_OUT | IOQ_EVENT_ERR)))
 		return 0;
 
-	r = accept(t->wait_fd.fd, (struct sockaddr *)&in, &len);
-	if (r < 0) {
-		if (errno == EAGAIN)
-			return 0;
+	while (t->ca_count < t->ca_max) {
+		struct asock *c = &t->ca_client[t->ca_count];
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		int r;
 
-		t->ca_error = errno;
-	} else {
-		if (t->ca_client->sock >= 0)
-			close(t->ca_client->sock);
+		r = accept4(t->wait_fd.fd, (struct sockaddr *)&ss, &len,
+			    SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (r < 0) {
+			if (errno == EAGAIN || t->ca_count)
+				break;
 
-		t->ca_client->sock = r;
-		t->ca_error = 0;
-		wait_init(t->ca_client);
+			t->ca_error = errno;
+			return OP_ACCEPT;
+		}
+
+		if (t->ol && t->ol_mode == ASOCK_OVERLOAD_SHED &&
+		    overload_check(t->ol)) {
+			shed_connection(r);
+			continue;
+		}
+
+		if (c->sock >= 0)
+			close(c->sock);
+
+		c->sock = r;
+		wait_init(c);
+		t->ca_count++;
 	}
 
+	if (!t->ca_count)
+		return 0;
+
+	t->ca_error = 0;
 	return OP_ACCEPT;
 }
 
-static int wait_send(struct asock *t)
+static int zc_busy(const struct asock *t)
 {
-	int r;
+	return (int32_t)(t->zc_done - t->zc_seq) < 0;
+}
 
-	if (!(ioq_fd_ready(&t->wait_fd) & (IOQ_EVENT_OUT | IOQ_EVENT_ERR)))
-		return 0;
+/* Collect zero-copy completion notifications from the error queue.
+ * Returns non-zero once every zero-copy send has completed.
+ */
+static int zc_reap(struct asock *t, int fd)
+{
+	while (zc_busy(t)) {
+		uint8_t control[128];
+		struct msghdr msg;
+		struct cmsghdr *c;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+			return 0;
+
+		for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			struct sock_extended_err ee;
+
+			memcpy(&ee, CMSG_DATA(c), sizeof(ee));
+			if (ee.ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				t->zc_done = ee.ee_data + 1;
+		}
+	}
+
+	return 1;
+}
+
+static int use_zerocopy(const struct asock *t)
+{
+	return t->zc_threshold && t->send_size >= t->zc_threshold &&
+		!handle_is_valid(t->send_file) &&
+		!handle_is_valid(t->send_pipe);
+}
+
+static int do_send(struct asock *t, int fd)
+{
+	int flags = MSG_DONTWAIT;
+	int zc = 0;
+	ssize_t r;
+
+	if (t->send_iov) {
+		int i;
+
+		/* The size isn't known in advance for vectored sends */
+		t->send_size = 0;
+		for (i = 0; i < t->send_iovcnt; i++)
+			t->send_size += t->send_iov[i].iov_len;
+	}
+
+	if (use_zerocopy(t)) {
+		flags |= MSG_ZEROCOPY;
+		zc = 1;
+	}
+
+	if (handle_is_valid(t->send_file)) {
+		r = sendfile(fd, t->send_file, &t->send_offset,
+			     t->send_size);
+	} else if (handle_is_valid(t->send_pipe)) {
+		r = splice(t->send_pipe, NULL, fd, NULL, t->send_size,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} else if (t->send_iov) {
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)t->send_iov;
+		msg.msg_iovlen = t->send_iovcnt;
+		r = sendmsg(fd, &msg, flags);
+	} else {
+		r = send(fd, t->send_data, t->send_size, flags);
+	}
 
-	r = send(t->wait_fd.fd, t->send_data, t->send_size, 0);
 	if (r < 0) {
 		if (errno == EAGAIN)
 			return 0;
@@ -140,25 +358,105 @@ static int wait_send(struct asock *t)
 	} else {
 		t->send_size = r;
 		t->send_error = 0;
+
+		if (zc && r)
+			t->zc_seq++;
 	}
 
 	return OP_SEND;
 }
 
-static int wait_recv(struct asock *t)
+static int wait_send(struct asock *t)
 {
-	int r;
+	if (!(ioq_fd_ready(&t->wait_fd) & (IOQ_EVENT_OUT | IOQ_EVENT_ERR)))
+		return 0;
 
-	if (ioq_fd_ready(&t->wait_fd) & IOQ_EVENT_HUP) {
-		t->recv_size = 0;
-		t->recv_error = 0;
-		return OP_RECV;
+	if (!do_send(t, t->wait_fd.fd))
+		return 0;
+
+	/* Hold the completion until the kernel releases the buffer */
+	if (zc_busy(t) && !zc_reap(t, t->wait_fd.fd)) {
+		t->wait_ops = (t->wait_ops & ~OP_SEND) | OP_ZEROCOPY;
+		return 0;
 	}
 
-	if (!(ioq_fd_ready(&t->wait_fd) & (IOQ_EVENT_IN | IOQ_EVENT_HUP)))
+	return OP_SEND;
+}
+
+static int wait_zerocopy(struct asock *t)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (!(ioq_fd_ready(&t->wait_fd) & IOQ_EVENT_ERR))
 		return 0;
 
-	r = recv(t->wait_fd.fd, t->recv_data, t->recv_size, 0);
+	if (zc_reap(t, t->wait_fd.fd))
+		return OP_ZEROCOPY;
+
+	/* An error event without a notification is a socket error */
+	getsockopt(t->wait_fd.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (!err)
+		return 0;
+
+	t->send_error = err;
+	t->send_size = 0;
+	return OP_ZEROCOPY;
+}
+
+/* Receive into a pooled buffer. Nothing is taken from the pool until
+ * a peek shows that there's data to read, so that idle sockets never
+ * touch the allocator.
+ */
+static ssize_t recv_pooled(struct asock *t, int fd)
+{
+	uint8_t *buf;
+	uint8_t peek;
+	ssize_t r;
+
+	r = recv(fd, &peek, 1, MSG_DONTWAIT | MSG_PEEK);
+	if (r <= 0)
+		return r;
+
+	buf = asock_bufpool_get(t->recv_pool);
+	if (!buf) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	r = recv(fd, buf, t->recv_pool->size, MSG_DONTWAIT);
+	if (r > 0) {
+		t->recv_data = buf;
+	} else {
+		const int e = errno;
+
+		asock_bufpool_put(t->recv_pool, buf);
+		errno = e;
+	}
+
+	return r;
+}
+
+static int do_recv(struct asock *t, int fd)
+{
+	ssize_t r;
+
+	if (handle_is_valid(t->recv_pipe)) {
+		r = splice(fd, NULL, t->recv_pipe, NULL, t->recv_size,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} else if (t->recv_pool) {
+		r = recv_pooled(t, fd);
+	} else if (t->recv_iov) {
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)t->recv_iov;
+		msg.msg_iovlen = t->recv_iovcnt;
+		r = recvmsg(fd, &msg, MSG_DONTWAIT);
+	} else {
+		r = recv(fd, t->recv_data, t->recv_size, MSG_DONTWAIT);
+	}
+
 	if (r < 0) {
 		if (errno == EAGAIN)
 			return 0;
@@ -173,6 +471,36 @@ static int wait_recv(struct asock *t)
 	return OP_RECV;
 }
 
+static int wait_sendq(struct asock *t)
+{
+	if (!(ioq_fd_ready(&t->wait_fd) & (IOQ_EVENT_OUT | IOQ_EVENT_ERR)))
+		return 0;
+
+	return sendq_flush(t, t->wait_fd.fd) ? OP_SENDQ : 0;
+}
+
+static int wait_recv(struct asock *t)
+{
+	const ioq_fd_mask_t ready = ioq_fd_ready(&t->wait_fd);
+
+	if (!(ready & (IOQ_EVENT_IN | IOQ_EVENT_HUP)))
+		return 0;
+
+	/* Data may arrive together with the hangup, so always try to
+	 * read it first.
+	 */
+	if (do_recv(t, t->wait_fd.fd))
+		return OP_RECV;
+
+	if (ready & IOQ_EVENT_HUP) {
+		t->recv_size = 0;
+		t->recv_error = 0;
+		return OP_RECV;
+	}
+
+	return 0;
+}
+
 static void wait_end(struct ioq_fd *f)
 {
 	struct asock *t = container_of(f, struct asock, wait_fd);
@@ -190,11 +518,19 @@ static void wait_end(struct ioq_fd *f)
 			t->send_error = e;
 		}
 
+		if (t->wait_ops & OP_ZEROCOPY) {
+			t->send_size = 0;
+			t->send_error = e ? e : ECANCELED;
+		}
+
 		if (t->wait_ops & OP_RECV) {
 			t->recv_size = 0;
 			t->recv_error = e;
 		}
 
+		if (t->wait_ops & OP_SENDQ)
+			sendq_fail(t, e);
+
 		if (t->wait_ops & OP_CANCEL)
 			close(t->wait_fd.fd);
 
@@ -210,9 +546,15 @@ static void wait_end(struct ioq_fd *f)
 		if (t->wait_ops & OP_SEND)
 			dispatch_mask |= wait_send(t);
 
+		if (t->wait_ops & OP_ZEROCOPY)
+			dispatch_mask |= wait_zerocopy(t);
+
 		if (t->wait_ops & OP_RECV)
 			dispatch_mask |= wait_recv(t);
 
+		if (t->wait_ops & OP_SENDQ)
+			dispatch_mask |= wait_sendq(t);
+
 		t->wait_ops &= ~dispatch_mask;
 		if (t->wait_ops)
 			ioq_fd_wait(&t->wait_fd,
@@ -220,16 +562,19 @@ static void wait_end(struct ioq_fd *f)
 	}
 	thr_mutex_unlock(&t->wait_lock);
 
+	/* A zero-copy wait completes the send request */
+	if (dispatch_mask & OP_ZEROCOPY)
+		dispatch_mask = (dispatch_mask & ~OP_ZEROCOPY) | OP_SEND;
+
+	/* Queued messages are completed individually */
+	dispatch_mask &= ~OP_SENDQ;
 	if (dispatch_mask)
 		dispatch_push(t, dispatch_mask);
 }
 
-static int wait_begin(struct asock *t, int mask)
+static int wait_begin_nolock(struct asock *t, int mask)
 {
-	int r;
-
-	thr_mutex_lock(&t->wait_lock);
-	r = t->wait_ops;
+	const int r = t->wait_ops;
 
 	if (mask & OP_CANCEL) {
 		if (t->wait_ops) {
@@ -247,6 +592,16 @@ static int wait_begin(struct asock *t, int mask)
 		else
 			ioq_fd_wait(&t->wait_fd, m, wait_end);
 	}
+
+	return r;
+}
+
+static int wait_begin(struct asock *t, int mask)
+{
+	int r;
+
+	thr_mutex_lock(&t->wait_lock);
+	r = wait_begin_nolock(t, mask);
 	thr_mutex_unlock(&t->wait_lock);
 
 	return r;
@@ -258,6 +613,11 @@ static void wait_init(struct asock *t)
 	ioq_fd_init(&t->wait_fd, t->ioq, t->sock);
 	t->wait_ops = 0;
 	thr_mutex_unlock(&t->wait_lock);
+
+	/* Zero-copy state belongs to the connection */
+	t->zc_threshold = 0;
+	t->zc_seq = 0;
+	t->zc_done = 0;
 }
 
 /************************************************************************
@@ -270,10 +630,15 @@ void asock_init(struct asock *t, struct ioq *q)
 
 	t->ioq = q;
 	t->sock = -1;
+	t->send_file = HANDLE_NONE;
+	t->send_pipe = HANDLE_NONE;
+	t->recv_pipe = HANDLE_NONE;
 
 	runq_task_init(&t->dispatch_task, ioq_runq(q));
+	waitq_timer_init(&t->ol_timer, ioq_waitq(q));
 	thr_mutex_init(&t->wait_lock);
-	thr_mutex_init(&t->dispatch_lock);
+	thr_mutex_init(&t->sendq_lock);
+	slist_init(&t->sendq);
 }
 
 void asock_destroy(struct asock *t)
@@ -282,29 +647,37 @@ void asock_destroy(struct asock *t)
 		close(t->sock);
 
 	thr_mutex_destroy(&t->wait_lock);
-	thr_mutex_destroy(&t->dispatch_lock);
+	thr_mutex_destroy(&t->sendq_lock);
 }
 
 void asock_close(struct asock *t)
 {
+	int paused;
+
 	if (t->sock < 0)
 		return;
 
-	if (!wait_begin(t, OP_CANCEL))
+	/* A paused accept owns the socket, and pause_done() closes it */
+	thr_mutex_lock(&t->wait_lock);
+	paused = t->ol_paused;
+	if (!paused && !wait_begin_nolock(t, OP_CANCEL))
 		close(t->sock);
-
 	t->sock = -1;
+	thr_mutex_unlock(&t->wait_lock);
+
+	if (paused)
+		waitq_timer_cancel(&t->ol_timer);
 }
 
-int asock_listen(struct asock *t, const struct sockaddr *sa,
-		 size_t sa_len)
+static int do_listen(struct asock *t, const struct sockaddr *sa,
+		     size_t sa_len, int reuseport)
 {
 	int optval = 1;
 
 	if (t->sock >= 0)
 		close(t->sock);
 
-	t->sock = socket(PF_INET, SOCK_STREAM, 0);
+	t->sock = socket(sa->sa_family, SOCK_STREAM, 0);
 	if (t->sock < 0) {
 		t->ca_error = errno;
 		return -1;
@@ -312,7 +685,15 @@ int asock_listen(struct asock *t, const struct sockaddr *sa,
 
 	wait_init(t);
 
-	if (setsockopt(t->sock, SOL_SOCKET, SO_REUSEADDR,
+	if (sa->sa_family != AF_UNIX &&
+	    setsockopt(t->sock, SOL_SOCKET, SO_REUSEADDR,
+			&optval, sizeof(optval)) < 0) {
+		t->ca_error = errno;
+		return -1;
+	}
+
+	if (reuseport &&
+	    setsockopt(t->sock, SOL_SOCKET, SO_REUSEPORT,
 			&optval, sizeof(optval)) < 0) {
 		t->ca_error = errno;
 		return -1;
@@ -328,13 +709,118 @@ int asock_listen(struct asock *t, const struct sockaddr *sa,
 		return -1;
 	}
 
+	/* Accepts drain the backlog until it would block */
+	fcntl(t->sock, F_SETFL, fcntl(t->sock, F_GETFL) | O_NONBLOCK);
 	return 0;
 }
 
+int asock_listen(struct asock *t, const struct sockaddr *sa,
+		 size_t sa_len)
+{
+	return do_listen(t, sa, sa_len, 0);
+}
+
+int asock_listen_group(struct asock *ts, unsigned int n,
+		       const struct sockaddr *sa, size_t sa_len)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	unsigned int i;
+
+	if (!n)
+		return 0;
+
+	if (do_listen(&ts[0], sa, sa_len, 1) < 0)
+		goto fail;
+
+	/* Bind the rest to the same port, if an ephemeral one was
+	 * requested.
+	 */
+	if (getsockname(ts[0].sock, (struct sockaddr *)&ss, &len) < 0) {
+		ts[0].ca_error = errno;
+		goto fail;
+	}
+
+	for (i = 1; i < n; i++)
+		if (do_listen(&ts[i], (struct sockaddr *)&ss, len, 1) < 0) {
+			ts[0].ca_error = ts[i].ca_error;
+			goto fail;
+		}
+
+	return 0;
+
+fail:
+	for (i = 0; i < n; i++)
+		asock_close(&ts[i]);
+
+	return -1;
+}
+
+static void pause_done(struct waitq_timer *timer);
+
+static int is_overloaded(struct asock *t)
+{
+	return t->ol && t->ol_mode == ASOCK_OVERLOAD_PAUSE &&
+		overload_check(t->ol);
+}
+
+static void begin_accept(struct asock *t)
+{
+	thr_mutex_lock(&t->wait_lock);
+	if (is_overloaded(t)) {
+		t->ol_paused = 1;
+		waitq_timer_wait(&t->ol_timer, ASOCK_OVERLOAD_RETRY,
+				 pause_done);
+	} else {
+		wait_begin_nolock(t, OP_ACCEPT);
+	}
+	thr_mutex_unlock(&t->wait_lock);
+}
+
+/* The paused flag is cleared only once we've decided, under the lock,
+ * whether to resume or finish. A concurrent asock_close() therefore
+ * either sees us paused and leaves the socket to us, or cancels the
+ * accept wait we've started.
+ */
+static void pause_done(struct waitq_timer *timer)
+{
+	struct asock *t = container_of(timer, struct asock, ol_timer);
+	int closed;
+
+	thr_mutex_lock(&t->wait_lock);
+	closed = t->sock < 0;
+	if (closed) {
+		t->ol_paused = 0;
+		close(t->wait_fd.fd);
+	} else if (is_overloaded(t)) {
+		waitq_timer_wait(&t->ol_timer, ASOCK_OVERLOAD_RETRY,
+				 pause_done);
+	} else {
+		t->ol_paused = 0;
+		wait_begin_nolock(t, OP_ACCEPT);
+	}
+	thr_mutex_unlock(&t->wait_lock);
+
+	/* A cancelled accept leaves the client untouched */
+	if (closed) {
+		t->ca_error = 0;
+		t->ca_count = 0;
+		dispatch_push(t, OP_ACCEPT);
+	}
+}
+
 void asock_accept(struct asock *t, struct asock *client,
 		  asock_func_t func)
 {
-	t->ca_client = client;
+	asock_accept_many(t, client, 1, func);
+}
+
+void asock_accept_many(struct asock *t, struct asock *clients,
+		       unsigned int max, asock_func_t func)
+{
+	t->ca_client = clients;
+	t->ca_max = max;
+	t->ca_count = 0;
 	t->ca_func = func;
 
 	if (t->sock < 0) {
@@ -343,20 +829,55 @@ void asock_accept(struct asock *t, struct asock *client,
 		return;
 	}
 
-	wait_begin(t, OP_ACCEPT);
+	begin_accept(t);
 }
 
 void asock_connect(struct asock *t, const struct sockaddr *sa,
 		   size_t sa_len, asock_func_t func)
 {
+	asock_connect_data(t, sa, sa_len, NULL, 0, func);
+}
+
+/* Begin connecting, sending data with the SYN if possible. The result
+ * is as for connect(): a connection in progress is reported as
+ * EINPROGRESS, whether or not any data was sent.
+ */
+static int fastopen_connect(struct asock *t, const struct sockaddr *sa,
+			    size_t sa_len, const uint8_t *data, size_t len)
+{
+#ifdef MSG_FASTOPEN
+	const ssize_t r = sendto(t->sock, data, len,
+				 MSG_DONTWAIT | MSG_FASTOPEN, sa, sa_len);
+
+	if (r >= 0) {
+		t->ca_sent = r;
+		errno = EINPROGRESS;
+		return -1;
+	}
+
+	/* Client-side support is disabled */
+	if (errno != EOPNOTSUPP)
+		return -1;
+#endif
+
+	return connect(t->sock, sa, sa_len);
+}
+
+void asock_connect_data(struct asock *t, const struct sockaddr *sa,
+			size_t sa_len, const uint8_t *data, size_t len,
+			asock_func_t func)
+{
+	int r;
+
 	if (t->sock >= 0)
 		close(t->sock);
 
 	t->ca_func = func;
 	t->ca_addr = sa;
 	t->ca_size = sa_len;
+	t->ca_sent = 0;
 
-	t->sock = socket(PF_INET, SOCK_STREAM, 0);
+	t->sock = socket(sa->sa_family, SOCK_STREAM, 0);
 	if (t->sock < 0) {
 		t->ca_error = errno;
 		dispatch_push(t, OP_CONNECT);
@@ -365,8 +886,22 @@ void asock_connect(struct asock *t, const struct sockaddr *sa,
 
 	wait_init(t);
 
+	/* Local (AF_UNIX) connections usually complete immediately, or
+	 * fail with EAGAIN if the listener's backlog is full. That can't
+	 * be waited for: the unconnected socket polls as writable and
+	 * hung up straight away, so it's reported to the caller.
+	 */
 	fcntl(t->sock, F_SETFL, fcntl(t->sock, F_GETFL) | O_NONBLOCK);
-	connect(t->sock, sa, sa_len);
+	if (len && sa->sa_family != AF_UNIX)
+		r = fastopen_connect(t, sa, sa_len, data, len);
+	else
+		r = connect(t->sock, sa, sa_len);
+
+	if (!r) {
+		t->ca_error = 0;
+		dispatch_push(t, OP_CONNECT);
+		return;
+	}
 
 	if (errno != EINPROGRESS) {
 		t->ca_error = errno;
@@ -377,20 +912,138 @@ void asock_connect(struct asock *t, const struct sockaddr *sa,
 	wait_begin(t, OP_CONNECT);
 }
 
+static void begin_send(struct asock *t)
+{
+	if (t->sock < 0) {
+		t->send_error = EBADF;
+		dispatch_push(t, OP_SEND);
+		return;
+	}
+
+	/* Try optimistically first: usually there's room already */
+	if (do_send(t, t->sock)) {
+		if (zc_busy(t) && !zc_reap(t, t->sock))
+			wait_begin(t, OP_ZEROCOPY);
+		else
+			dispatch_push(t, OP_SEND);
+		return;
+	}
+
+	wait_begin(t, OP_SEND);
+}
+
 void asock_send(struct asock *t, const uint8_t *data, size_t len,
 		asock_func_t func)
 {
 	t->send_data = data;
 	t->send_size = len;
+	t->send_iov = NULL;
+	t->send_file = HANDLE_NONE;
+	t->send_pipe = HANDLE_NONE;
+	t->send_func = func;
+
+	begin_send(t);
+}
+
+void asock_sendv(struct asock *t, const struct iovec *iov, int iovcnt,
+		 asock_func_t func)
+{
+	t->send_size = 0;
+	t->send_iov = iov;
+	t->send_iovcnt = iovcnt;
+	t->send_file = HANDLE_NONE;
+	t->send_pipe = HANDLE_NONE;
 	t->send_func = func;
 
+	begin_send(t);
+}
+
+int asock_set_fastopen(struct asock *t, int qlen)
+{
+#ifdef TCP_FASTOPEN
+	if (setsockopt(t->sock, IPPROTO_TCP, TCP_FASTOPEN,
+		       &qlen, sizeof(qlen)) < 0) {
+		t->ca_error = errno;
+		return -1;
+	}
+
+	return 0;
+#else
+	t->ca_error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+int asock_set_defer_accept(struct asock *t, int timeout_s)
+{
+#ifdef TCP_DEFER_ACCEPT
+	if (setsockopt(t->sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		       &timeout_s, sizeof(timeout_s)) < 0) {
+		t->ca_error = errno;
+		return -1;
+	}
+
+	return 0;
+#else
+	t->ca_error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+int asock_set_zerocopy(struct asock *t, size_t threshold)
+{
+	int optval = 1;
+
+	if (threshold && !t->zc_threshold &&
+	    setsockopt(t->sock, SOL_SOCKET, SO_ZEROCOPY,
+		       &optval, sizeof(optval)) < 0) {
+		t->ca_error = errno;
+		return -1;
+	}
+
+	t->zc_threshold = threshold;
+	return 0;
+}
+
+void asock_sendfile(struct asock *t, handle_t file, off_t offset,
+		    size_t len, asock_func_t func)
+{
+	t->send_size = len;
+	t->send_iov = NULL;
+	t->send_file = file;
+	t->send_offset = offset;
+	t->send_pipe = HANDLE_NONE;
+	t->send_func = func;
+
+	begin_send(t);
+}
+
+void asock_splice_send(struct asock *t, handle_t pipe, size_t len,
+		       asock_func_t func)
+{
+	t->send_size = len;
+	t->send_iov = NULL;
+	t->send_file = HANDLE_NONE;
+	t->send_pipe = pipe;
+	t->send_func = func;
+
+	begin_send(t);
+}
+
+static void begin_recv(struct asock *t)
+{
 	if (t->sock < 0) {
-		t->send_error = EBADF;
-		dispatch_push(t, OP_SEND);
+		t->recv_error = EBADF;
+		dispatch_push(t, OP_RECV);
 		return;
 	}
 
-	wait_begin(t, OP_SEND);
+	if (do_recv(t, t->sock)) {
+		dispatch_push(t, OP_RECV);
+		return;
+	}
+
+	wait_begin(t, OP_RECV);
 }
 
 void asock_recv(struct asock *t, uint8_t *data, size_t max_len,
@@ -398,13 +1051,232 @@ void asock_recv(struct asock *t, uint8_t *data, size_t max_len,
 {
 	t->recv_data = data;
 	t->recv_size = max_len;
+	t->recv_iov = NULL;
+	t->recv_pipe = HANDLE_NONE;
+	t->recv_pool = NULL;
+	t->recv_func = func;
+
+	begin_recv(t);
+}
+
+void asock_recvv(struct asock *t, const struct iovec *iov, int iovcnt,
+		 asock_func_t func)
+{
+	t->recv_size = 0;
+	t->recv_iov = iov;
+	t->recv_iovcnt = iovcnt;
+	t->recv_pipe = HANDLE_NONE;
+	t->recv_pool = NULL;
 	t->recv_func = func;
 
+	begin_recv(t);
+}
+
+void asock_splice_recv(struct asock *t, handle_t pipe, size_t len,
+		       asock_func_t func)
+{
+	t->recv_size = len;
+	t->recv_pipe = pipe;
+	t->recv_pool = NULL;
+	t->recv_func = func;
+
+	begin_recv(t);
+}
+
+void asock_recv_pooled(struct asock *t, struct asock_bufpool *p,
+		       asock_func_t func)
+{
+	t->recv_data = NULL;
+	t->recv_size = 0;
+	t->recv_pipe = HANDLE_NONE;
+	t->recv_pool = p;
+	t->recv_func = func;
+
+	begin_recv(t);
+}
+
+void asock_bufpool_init(struct asock_bufpool *p, size_t buf_size,
+			unsigned int max)
+{
+	thr_mutex_init(&p->lock);
+	slab_init(&p->slab, buf_size);
+	p->size = buf_size;
+	p->count = 0;
+	p->max = max;
+}
+
+void asock_bufpool_destroy(struct asock_bufpool *p)
+{
+	slab_free_all(&p->slab);
+	thr_mutex_destroy(&p->lock);
+}
+
+uint8_t *asock_bufpool_get(struct asock_bufpool *p)
+{
+	uint8_t *buf = NULL;
+
+	thr_mutex_lock(&p->lock);
+	if (!p->max || p->count < p->max) {
+		buf = slab_alloc(&p->slab);
+		if (buf)
+			p->count++;
+	}
+	thr_mutex_unlock(&p->lock);
+
+	return buf;
+}
+
+void asock_bufpool_put(struct asock_bufpool *p, uint8_t *buf)
+{
+	thr_mutex_lock(&p->lock);
+	slab_free(&p->slab, buf);
+	p->count--;
+	thr_mutex_unlock(&p->lock);
+}
+
+void asock_post(struct asock *t, struct asock_msg *m,
+		const uint8_t *data, size_t len, asock_msg_func_t func)
+{
+	int was_empty;
+
+	runq_task_init(&m->task, ioq_runq(t->ioq));
+	m->task.func = (runq_task_func_t)func;
+	m->owner = t;
+	m->data = data;
+	m->size = len;
+	m->sent = 0;
+	m->error = 0;
+
 	if (t->sock < 0) {
-		t->recv_error = EBADF;
-		dispatch_push(t, OP_RECV);
+		m->error = EBADF;
+		if (func)
+			runq_task_exec(&m->task, m->task.func);
 		return;
 	}
 
-	wait_begin(t, OP_RECV);
+	thr_mutex_lock(&t->sendq_lock);
+	was_empty = slist_is_empty(&t->sendq);
+	slist_append(&t->sendq, &m->queue);
+	thr_mutex_unlock(&t->sendq_lock);
+
+	if (was_empty && !sendq_flush(t, t->sock))
+		wait_begin(t, OP_SENDQ);
+}
+
+/************************************************************************
+ * Proxy
+ */
+
+static void proxy_recv_done(struct asock *t);
+static void proxy_send_done(struct asock *t);
+
+static void proxy_pump(struct asock_proxy_dir *d)
+{
+	if (d->pending)
+		asock_splice_send(d->to, d->pipe[0], d->pending,
+				  proxy_send_done);
+	else
+		asock_splice_recv(d->from, d->pipe[1], ASOCK_PROXY_CHUNK,
+				  proxy_recv_done);
+}
+
+static void proxy_finish(struct asock_proxy *p, struct asock_proxy_dir *d,
+			 neterr_t err)
+{
+	int remaining;
+	int i;
+
+	d->error = err;
+
+	if (err) {
+		/* Wake the other direction, so that it finishes too */
+		shutdown(d->from->sock, SHUT_RDWR);
+		shutdown(d->to->sock, SHUT_RDWR);
+	} else {
+		shutdown(d->to->sock, SHUT_WR);
+	}
+
+	thr_mutex_lock(&p->lock);
+	remaining = --p->active;
+	thr_mutex_unlock(&p->lock);
+
+	if (remaining)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		close(p->dirs[i].pipe[0]);
+		close(p->dirs[i].pipe[1]);
+	}
+
+	p->dirs[0].from->proxy = NULL;
+	p->dirs[0].to->proxy = NULL;
+	thr_mutex_destroy(&p->lock);
+	p->func(p);
+}
+
+static void proxy_recv_done(struct asock *t)
+{
+	struct asock_proxy *p = t->proxy;
+	struct asock_proxy_dir *d = &p->dirs[t == p->dirs[0].from ? 0 : 1];
+
+	if (t->recv_error || !t->recv_size) {
+		proxy_finish(p, d, t->recv_error);
+		return;
+	}
+
+	d->pending = t->recv_size;
+	proxy_pump(d);
+}
+
+static void proxy_send_done(struct asock *t)
+{
+	struct asock_proxy *p = t->proxy;
+	struct asock_proxy_dir *d = &p->dirs[t == p->dirs[0].to ? 0 : 1];
+
+	if (t->send_error) {
+		proxy_finish(p, d, t->send_error);
+		return;
+	}
+
+	d->pending -= t->send_size;
+	d->count += t->send_size;
+	proxy_pump(d);
+}
+
+int asock_proxy(struct asock_proxy *p, struct asock *a, struct asock *b,
+		asock_proxy_func_t func)
+{
+	int i;
+
+	memset(p, 0, sizeof(*p));
+
+	p->dirs[0].from = a;
+	p->dirs[0].to = b;
+	p->dirs[1].from = b;
+	p->dirs[1].to = a;
+
+	for (i = 0; i < 2; i++)
+		if (pipe2(p->dirs[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			const neterr_t e = errno;
+
+			while (i--) {
+				close(p->dirs[i].pipe[0]);
+				close(p->dirs[i].pipe[1]);
+			}
+
+			p->dirs[0].error = e;
+			p->dirs[1].error = e;
+			return -1;
+		}
+
+	p->func = func;
+	p->active = 2;
+	thr_mutex_init(&p->lock);
+
+	a->proxy = p;
+	b->proxy = p;
+
+	proxy_pump(&p->dirs[0]);
+	proxy_pump(&p->dirs[1]);
+	return 0;
 }
@@ -50,7 +50,8 @@ int asock_listen(struct asock *t, const struct sockaddr *sa,
 	if (net_sock_is_valid(t->sock))
 		closesocket(t->sock);
 
-	t->sock = WSASocket(AF_INET, SOCK_STREAM, 0,
+	t->family = sa->sa_family;
+	t->sock = WSASocket(sa->sa_family, SOCK_STREAM, 0,
 			    NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (!net_sock_is_valid(t->sock)) {
 		t->ca_error = neterr_last();
@@ -75,6 +76,31 @@ int asock_listen(struct asock *t, const struct sockaddr *sa,
 	return 0;
 }
 
+int asock_set_fastopen(struct asock *t, int qlen)
+{
+#ifdef TCP_FASTOPEN
+	/* Windows has no queue limit: the option is just a switch */
+	DWORD optval = qlen > 0;
+
+	if (setsockopt(t->sock, IPPROTO_TCP, TCP_FASTOPEN,
+		       (const char *)&optval, sizeof(optval)) < 0) {
+		t->ca_error = neterr_last();
+		return -1;
+	}
+
+	return 0;
+#else
+	t->ca_error = WSAEOPNOTSUPP;
+	return -1;
+#endif
+}
+
+int asock_set_defer_accept(struct asock *t, int timeout_s)
+{
+	t->ca_error = WSAEOPNOTSUPP;
+	return -1;
+}
+
 static void accept_done(struct ioq_ovl *o)
 {
 	struct asock *t = container_of(o, struct asock, ca_ovl);
@@ -113,7 +139,7 @@ void asock_accept(struct asock *t, struct asock *client,
 
 	ioq_ovl_wait(&t->ca_ovl, accept_done);
 
-	t->ca_accept_sock = WSASocket(AF_INET, SOCK_STREAM, 0,
+	t->ca_accept_sock = WSASocket(t->family, SOCK_STREAM, 0,
 				      NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (!net_sock_is_valid(t->ca_accept_sock)) {
 		t->ca_error = neterr_last();
@@ -144,13 +170,12 @@ void asock_accept(struct asock *t, struct asock *client,
 static void connect_done(struct ioq_ovl *o)
 {
 	struct asock *t = container_of(o, struct asock, ca_ovl);
-	DWORD count;
 	DWORD flags;
 
 	if (t->ca_error == WSA_IO_PENDING) {
 		if (WSAGetOverlappedResult(t->ca_sock,
 			    ioq_ovl_lpo(&t->ca_ovl),
-			    &count, FALSE, &flags))
+			    &t->ca_sent, FALSE, &flags))
 			t->ca_error = 0;
 		else
 			t->ca_error = neterr_last();
@@ -162,13 +187,22 @@ static void connect_done(struct ioq_ovl *o)
 void asock_connect(struct asock *t, const struct sockaddr *sa,
 		   size_t sa_size, asock_func_t func)
 {
-	DWORD count;
-	struct sockaddr_in local;
+	asock_connect_data(t, sa, sa_size, NULL, 0, func);
+}
+
+void asock_connect_data(struct asock *t, const struct sockaddr *sa,
+			size_t sa_size, const uint8_t *data, size_t len,
+			asock_func_t func)
+{
+	struct sockaddr_storage local;
 
 	if (net_sock_is_valid(t->sock))
 		closesocket(t->sock);
 
-	t->sock = WSASocket(AF_INET, SOCK_STREAM, 0,
+	t->ca_sent = 0;
+
+	t->family = sa->sa_family;
+	t->sock = WSASocket(sa->sa_family, SOCK_STREAM, 0,
 			    NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (!net_sock_is_valid(t->sock)) {
 		t->ca_error = neterr_last();
@@ -182,22 +216,36 @@ void asock_connect(struct asock *t, const struct sockaddr *sa,
 		return;
 	}
 
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = INADDR_ANY;
-	local.sin_port = 0;
-	if (bind(t->sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+	/* ConnectEx() requires a bound socket. An all-zero address of
+	 * either family is the wildcard address with an ephemeral port.
+	 */
+	memset(&local, 0, sizeof(local));
+	local.ss_family = sa->sa_family;
+	if (bind(t->sock, (struct sockaddr *)&local, sa_size) < 0) {
 		t->ca_error = neterr_last();
 		ioq_ovl_trigger(&t->ca_ovl);
 		return;
 	}
 
+#ifdef TCP_FASTOPEN
+	/* Must be set before connecting. Failure isn't an error: the data
+	 * is then just sent after the handshake.
+	 */
+	if (len) {
+		DWORD optval = 1;
+
+		setsockopt(t->sock, IPPROTO_TCP, TCP_FASTOPEN,
+			   (const char *)&optval, sizeof(optval));
+	}
+#endif
+
 	t->ca_sock = t->sock;
 	t->ca_func = func;
 	t->ca_error = WSA_IO_PENDING;
 	ioq_ovl_wait(&t->ca_ovl, connect_done);
 
-	if (!net_ConnectEx(t->sock, sa, sa_size, NULL, 0,
-		      &count, ioq_ovl_lpo(&t->ca_ovl))) {
+	if (!net_ConnectEx(t->sock, sa, sa_size, (PVOID)data, len,
+		      &t->ca_sent, ioq_ovl_lpo(&t->ca_ovl))) {
 		const neterr_t e = WSAGetLastError();
 
 		if (e != WSA_IO_PENDING) {
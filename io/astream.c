@@ -0,0 +1,400 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "astream.h"
+#include "containers.h"
+#include "bytes.h"
+
+#define READ_EXACT		0
+#define READ_DELIM		1
+#define READ_FRAME		2
+
+/************************************************************************
+ * Read-ahead
+ *
+ * The socket operations are begun with the side's lock held. That's
+ * safe, because asock never invokes a callback before returning.
+ */
+
+static void recv_done(struct asock *t);
+
+/* Receive into all free space, if there is any, and if no receive is
+ * already in progress.
+ */
+static void rx_fill(struct astream *s)
+{
+	const size_t avail = cbuf_avail(&s->rx);
+
+	if (s->rx_busy || s->rx_eof || s->rx_error || !avail)
+		return;
+
+	s->rx_busy = 1;
+
+#ifdef __Windows__
+	asock_recv(&s->sock, cbuf_tail_data(&s->rx),
+		   cbuf_tail_size(&s->rx), recv_done);
+#else
+	/* Free space is contiguous, modulo the capacity */
+	s->rx_iov[0].iov_base = cbuf_tail_data(&s->rx);
+	s->rx_iov[0].iov_len = cbuf_tail_size(&s->rx);
+	s->rx_iov[1].iov_base = s->rx.data;
+	s->rx_iov[1].iov_len = avail - s->rx_iov[0].iov_len;
+
+	asock_recvv(&s->sock, s->rx_iov, s->rx_iov[1].iov_len ? 2 : 1,
+		    recv_done);
+#endif
+}
+
+static int read_exact(struct astream *s, size_t len)
+{
+	s->read_size += cbuf_move_out(&s->rx, s->read_data + s->read_size,
+				      len - s->read_size);
+	return s->read_size >= len;
+}
+
+static int read_delim(struct astream *s)
+{
+	while (cbuf_used(&s->rx) && s->read_size < s->read_max) {
+		const uint8_t *src = cbuf_head_data(&s->rx);
+		size_t len = cbuf_head_size(&s->rx);
+		const uint8_t *end;
+
+		if (len > s->read_max - s->read_size)
+			len = s->read_max - s->read_size;
+
+		end = memchr(src, s->read_delim, len);
+		if (end)
+			len = end - src + 1;
+
+		memcpy(s->read_data + s->read_size, src, len);
+		s->read_size += len;
+		cbuf_head_advance(&s->rx, len);
+
+		if (end)
+			return 1;
+	}
+
+	if (s->read_size < s->read_max)
+		return 0;
+
+	s->read_error = ASTREAM_ERR_TOO_BIG;
+	return 1;
+}
+
+static int read_frame(struct astream *s)
+{
+	if (s->read_header_size < ASTREAM_FRAME_HEADER) {
+		uint32_t len;
+
+		s->read_header_size += cbuf_move_out(&s->rx,
+			s->read_header + s->read_header_size,
+			ASTREAM_FRAME_HEADER - s->read_header_size);
+		if (s->read_header_size < ASTREAM_FRAME_HEADER)
+			return 0;
+
+		len = bytes_r32net(s->read_header);
+		if (len > s->read_max) {
+			s->read_error = ASTREAM_ERR_TOO_BIG;
+			return 1;
+		}
+
+		s->read_max = len;
+	}
+
+	return read_exact(s, s->read_max);
+}
+
+/* Consume as much as possible of the current unit from the read-ahead
+ * buffer. Returns non-zero if the read has finished, successfully or
+ * otherwise.
+ */
+static int read_progress(struct astream *s)
+{
+	int done = 0;
+
+	switch (s->read_mode) {
+	case READ_EXACT:
+		done = read_exact(s, s->read_max);
+		break;
+
+	case READ_DELIM:
+		done = read_delim(s);
+		break;
+
+	case READ_FRAME:
+		done = read_frame(s);
+		break;
+	}
+
+	if (done)
+		return 1;
+
+	if (s->rx_error) {
+		s->read_error = s->rx_error;
+		return 1;
+	}
+
+	if (s->rx_eof) {
+		if (s->read_size || s->read_header_size)
+			s->read_error = ASTREAM_ERR_TRUNCATED;
+		else
+			s->read_eof = 1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void recv_done(struct asock *t)
+{
+	struct astream *s = container_of(t, struct astream, sock);
+	const neterr_t err = asock_get_recv_error(t);
+	const size_t len = asock_get_recv_size(t);
+	int done = 0;
+
+	thr_mutex_lock(&s->rx_lock);
+	s->rx_busy = 0;
+
+	if (err)
+		s->rx_error = err;
+	else if (!len)
+		s->rx_eof = 1;
+	else
+		cbuf_tail_advance(&s->rx, len);
+
+	if (s->read_pending && read_progress(s)) {
+		s->read_pending = 0;
+		done = 1;
+	}
+
+	rx_fill(s);
+	thr_mutex_unlock(&s->rx_lock);
+
+	if (done)
+		s->read_func(s);
+}
+
+static void read_task_func(struct runq_task *task)
+{
+	struct astream *s = container_of(task, struct astream, read_task);
+
+	s->read_func(s);
+}
+
+static void begin_read(struct astream *s, int mode, uint8_t *data,
+		       size_t max_len, astream_func_t func)
+{
+	int done;
+
+	thr_mutex_lock(&s->rx_lock);
+	s->read_func = func;
+	s->read_mode = mode;
+	s->read_data = data;
+	s->read_max = max_len;
+	s->read_size = 0;
+	s->read_header_size = 0;
+	s->read_error = 0;
+	s->read_eof = 0;
+
+	done = read_progress(s);
+	s->read_pending = !done;
+
+	rx_fill(s);
+	thr_mutex_unlock(&s->rx_lock);
+
+	if (done)
+		runq_task_exec(&s->read_task, read_task_func);
+}
+
+void astream_read(struct astream *s, uint8_t *data, size_t len,
+		  astream_func_t func)
+{
+	begin_read(s, READ_EXACT, data, len, func);
+}
+
+void astream_read_until(struct astream *s, uint8_t *data, size_t max_len,
+			uint8_t delim, astream_func_t func)
+{
+	s->read_delim = delim;
+	begin_read(s, READ_DELIM, data, max_len, func);
+}
+
+void astream_read_frame(struct astream *s, uint8_t *data, size_t max_len,
+			astream_func_t func)
+{
+	begin_read(s, READ_FRAME, data, max_len, func);
+}
+
+/************************************************************************
+ * Write buffering
+ */
+
+static void send_done(struct asock *t);
+
+/* Send everything buffered, unless a send is already in progress.
+ * Returns non-zero if a send is in progress on return.
+ */
+static int tx_drain(struct astream *s)
+{
+	const size_t head = cbuf_head_size(&s->tx);
+
+	if (s->tx_busy)
+		return 1;
+
+	if (s->tx_error || !cbuf_used(&s->tx))
+		return 0;
+
+	s->tx_busy = 1;
+
+#ifdef __Windows__
+	asock_send(&s->sock, cbuf_head_data(&s->tx), head, send_done);
+#else
+	s->tx_iov[0].iov_base = cbuf_head_data(&s->tx);
+	s->tx_iov[0].iov_len = head;
+	s->tx_iov[1].iov_base = s->tx.data;
+	s->tx_iov[1].iov_len = cbuf_used(&s->tx) - head;
+
+	asock_sendv(&s->sock, s->tx_iov, s->tx_iov[1].iov_len ? 2 : 1,
+		    send_done);
+#endif
+	return 1;
+}
+
+static void send_done(struct asock *t)
+{
+	struct astream *s = container_of(t, struct astream, sock);
+	const neterr_t err = asock_get_send_error(t);
+	int done = 0;
+
+	thr_mutex_lock(&s->tx_lock);
+	s->tx_busy = 0;
+
+	if (err) {
+		s->tx_error = err;
+		cbuf_clear(&s->tx);
+	} else {
+		cbuf_head_advance(&s->tx, asock_get_send_size(t));
+	}
+
+	if (!tx_drain(s) && s->flush_pending) {
+		s->flush_pending = 0;
+		done = 1;
+	}
+	thr_mutex_unlock(&s->tx_lock);
+
+	if (done)
+		s->flush_func(s);
+}
+
+size_t astream_write(struct astream *s, const uint8_t *data, size_t len)
+{
+	size_t r = 0;
+
+	thr_mutex_lock(&s->tx_lock);
+	if (!s->tx_error) {
+		r = cbuf_move_in(&s->tx, data, len);
+		tx_drain(s);
+	}
+	thr_mutex_unlock(&s->tx_lock);
+
+	return r;
+}
+
+int astream_write_frame(struct astream *s, const uint8_t *data, size_t len)
+{
+	uint8_t header[ASTREAM_FRAME_HEADER];
+	int r = -1;
+
+	bytes_w32net(header, len);
+
+	thr_mutex_lock(&s->tx_lock);
+	if (!s->tx_error &&
+	    cbuf_avail(&s->tx) >= sizeof(header) + len) {
+		cbuf_move_in(&s->tx, header, sizeof(header));
+		cbuf_move_in(&s->tx, data, len);
+		tx_drain(s);
+		r = 0;
+	}
+	thr_mutex_unlock(&s->tx_lock);
+
+	return r;
+}
+
+size_t astream_write_avail(struct astream *s)
+{
+	size_t r;
+
+	thr_mutex_lock(&s->tx_lock);
+	r = cbuf_avail(&s->tx);
+	thr_mutex_unlock(&s->tx_lock);
+
+	return r;
+}
+
+static void flush_task_func(struct runq_task *task)
+{
+	struct astream *s = container_of(task, struct astream, flush_task);
+
+	s->flush_func(s);
+}
+
+void astream_flush(struct astream *s, astream_func_t func)
+{
+	int done;
+
+	thr_mutex_lock(&s->tx_lock);
+	s->flush_func = func;
+	done = !s->tx_busy;
+	s->flush_pending = !done;
+	thr_mutex_unlock(&s->tx_lock);
+
+	if (done)
+		runq_task_exec(&s->flush_task, flush_task_func);
+}
+
+/************************************************************************
+ * Setup/teardown
+ */
+
+void astream_init(struct astream *s, struct ioq *q,
+		  uint8_t *rx_buf, size_t rx_size,
+		  uint8_t *tx_buf, size_t tx_size)
+{
+	memset(s, 0, sizeof(*s));
+
+	asock_init(&s->sock, q);
+
+	thr_mutex_init(&s->rx_lock);
+	cbuf_init(&s->rx, rx_buf, rx_size);
+	runq_task_init(&s->read_task, ioq_runq(q));
+
+	thr_mutex_init(&s->tx_lock);
+	cbuf_init(&s->tx, tx_buf, tx_size);
+	runq_task_init(&s->flush_task, ioq_runq(q));
+}
+
+void astream_destroy(struct astream *s)
+{
+	asock_destroy(&s->sock);
+	thr_mutex_destroy(&s->rx_lock);
+	thr_mutex_destroy(&s->tx_lock);
+}
+
+void astream_close(struct astream *s)
+{
+	asock_close(&s->sock);
+}
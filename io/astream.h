@@ -0,0 +1,189 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_ASTREAM_H_
+#define IO_ASTREAM_H_
+
+#include "asock.h"
+#include "cbuf.h"
+
+/* Buffered stream over an asynchronous socket. Incoming data is read
+ * ahead into a circular buffer, and reads complete only when a whole
+ * unit (a fixed number of bytes, a delimited record or a length-prefixed
+ * frame) is available. Writes are copied into a second circular buffer,
+ * and everything written while a send is in progress goes out together
+ * in the next one.
+ *
+ * On POSIX systems, each transfer covers both segments of the buffer in
+ * a single vectored system call.
+ *
+ * The read and write sides may be driven from different threads, but
+ * only one read and one flush may be outstanding at any time. As with
+ * asock, callbacks are always invoked via the run queue.
+ */
+struct astream;
+typedef void (*astream_func_t)(struct astream *s);
+
+/* Errors reported for a unit which exceeds the caller's buffer, or
+ * which was cut short by the end of the stream.
+ */
+#ifdef __Windows__
+#define ASTREAM_ERR_TOO_BIG	WSAEMSGSIZE
+#define ASTREAM_ERR_TRUNCATED	WSAEDISCON
+#else
+#define ASTREAM_ERR_TOO_BIG	EMSGSIZE
+#define ASTREAM_ERR_TRUNCATED	EPIPE
+#endif
+
+/* Size of the frame length prefix (32-bit, network byte order) */
+#define ASTREAM_FRAME_HEADER	4
+
+struct astream {
+	/* This socket is connected or accepted by the caller */
+	struct asock		sock;
+
+	/* Read-ahead buffer. The receive error and end-of-stream flag
+	 * are sticky.
+	 */
+	thr_mutex_t		rx_lock;
+	struct cbuf		rx;
+	int			rx_busy;
+	int			rx_eof;
+	neterr_t		rx_error;
+
+	/* Current read request */
+	int			read_pending;
+	astream_func_t		read_func;
+	struct runq_task	read_task;
+	int			read_mode;
+	uint8_t			*read_data;
+	size_t			read_max;
+	size_t			read_size;
+	int			read_delim;
+	uint8_t			read_header[ASTREAM_FRAME_HEADER];
+	unsigned int		read_header_size;
+	neterr_t		read_error;
+	int			read_eof;
+
+	/* Write buffer. Once a send fails, the error is sticky and
+	 * further writes are discarded.
+	 */
+	thr_mutex_t		tx_lock;
+	struct cbuf		tx;
+	int			tx_busy;
+	neterr_t		tx_error;
+
+	/* Flush request */
+	int			flush_pending;
+	astream_func_t		flush_func;
+	struct runq_task	flush_task;
+
+#ifndef __Windows__
+	struct iovec		rx_iov[2];
+	struct iovec		tx_iov[2];
+#endif
+};
+
+/* Initialize a stream, with the given buffers for read-ahead and
+ * writing. No connection is made: use astream_sock() to connect or
+ * accept.
+ */
+void astream_init(struct astream *s, struct ioq *q,
+		  uint8_t *rx_buf, size_t rx_size,
+		  uint8_t *tx_buf, size_t tx_size);
+
+/* Destroy a stream. */
+void astream_destroy(struct astream *s);
+
+/* Obtain the underlying socket */
+static inline struct asock *astream_sock(struct astream *s)
+{
+	return &s->sock;
+}
+
+/* Close the socket. Outstanding operations complete very soon with an
+ * error.
+ */
+void astream_close(struct astream *s);
+
+/* Read exactly len bytes into the given buffer. */
+void astream_read(struct astream *s, uint8_t *data, size_t len,
+		  astream_func_t func);
+
+/* Read up to and including the next occurrence of the delimiter. If it
+ * isn't found within max_len bytes, the read fails with
+ * ASTREAM_ERR_TOO_BIG, and the bytes examined are consumed.
+ */
+void astream_read_until(struct astream *s, uint8_t *data, size_t max_len,
+			uint8_t delim, astream_func_t func);
+
+/* Read a frame consisting of a 32-bit length in network byte order,
+ * followed by that many bytes, which are placed in the buffer. If the
+ * frame is longer than max_len, the read fails with ASTREAM_ERR_TOO_BIG
+ * and the stream can't be resynchronized.
+ */
+void astream_read_frame(struct astream *s, uint8_t *data, size_t max_len,
+			astream_func_t func);
+
+/* Retrieve the result of a read. The size is the length of the unit
+ * (the payload, for a frame). If the stream ends cleanly between units,
+ * the read completes with no error and a size of 0, and
+ * astream_get_read_eof() returns non-zero. If it ends part way through
+ * one, the error is ASTREAM_ERR_TRUNCATED.
+ */
+static inline size_t astream_get_read_size(const struct astream *s)
+{
+	return s->read_size;
+}
+
+static inline neterr_t astream_get_read_error(const struct astream *s)
+{
+	return s->read_error;
+}
+
+static inline int astream_get_read_eof(const struct astream *s)
+{
+	return s->read_eof;
+}
+
+/* Copy data into the write buffer, and begin sending it unless a send
+ * is already in progress. Returns the number of bytes accepted, which
+ * is less than len if the buffer is full.
+ */
+size_t astream_write(struct astream *s, const uint8_t *data, size_t len);
+
+/* Write a whole frame, with a length prefix as read by
+ * astream_read_frame(). Returns 0 on success, or -1 if there isn't
+ * room for it in the write buffer, or a send has failed (in either
+ * case, nothing is written).
+ */
+int astream_write_frame(struct astream *s, const uint8_t *data, size_t len);
+
+/* Return the amount of room left in the write buffer */
+size_t astream_write_avail(struct astream *s);
+
+/* Wait until everything written has been sent, or until an error
+ * occurs. This can also be used to wait for room in the write buffer.
+ */
+void astream_flush(struct astream *s, astream_func_t func);
+
+/* Retrieve the sticky write error, if any */
+static inline neterr_t astream_get_write_error(const struct astream *s)
+{
+	return s->tx_error;
+}
+
+#endif
@@ -45,12 +45,17 @@ void ioq_destroy(struct ioq *q);
  *             ioq_iterate(&my_queue);
  *     ioq_destroy(&my_queue);
  *
+ * Several threads may call ioq_iterate() on the same queue at once.
+ * One of them waits for and demultiplexes IO events while the others
+ * execute ready tasks, and the role is handed over as soon as event
+ * demultiplexing is done.
+ *
  * Returns 0 on success or -1 if some critical error occurs.
  */
 int ioq_iterate(struct ioq *q);
 
 /* Interrupt an IO queue waiter. This causes ioq_iterate() to return 0
- * if it's currently being called.
+ * in every thread which is currently calling it.
  */
 void ioq_notify(struct ioq *q);
 
@@ -16,9 +16,14 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/timerfd.h>
 #include "ioq.h"
 #include "containers.h"
 
+/* Bounds for the size of the epoll event buffer */
+#define MIN_EVENTS		32
+#define MAX_EVENTS		4096
+
 void ioq_notify(struct ioq *q)
 {
 	int old_state;
@@ -26,6 +31,7 @@ void ioq_notify(struct ioq *q)
 	thr_mutex_lock(&q->lock);
 	old_state = q->intr_state;
 	q->intr_state = 1;
+	q->intr_gen++;
 	thr_mutex_unlock(&q->lock);
 
 	if (!old_state)
@@ -43,6 +49,17 @@ static void intr_ack(struct ioq *q)
 	thr_mutex_unlock(&q->lock);
 }
 
+static unsigned int intr_gen(struct ioq *q)
+{
+	unsigned int gen;
+
+	thr_mutex_lock(&q->lock);
+	gen = q->intr_gen;
+	thr_mutex_unlock(&q->lock);
+
+	return gen;
+}
+
 static void wakeup_runq(struct runq *q)
 {
 	ioq_notify(container_of(q, struct ioq, run));
@@ -70,6 +87,8 @@ int ioq_init(struct ioq *q, unsigned int bg_threads)
 	q->wait.wakeup = wakeup_waitq;
 
 	thr_mutex_init(&q->lock);
+	thr_mutex_init(&q->poll_lock);
+	thr_mutex_init(&q->timer_lock);
 	slist_init(&q->mod_list);
 
 	if (pipe(q->intr) < 0) {
@@ -80,6 +99,8 @@ int ioq_init(struct ioq *q, unsigned int bg_threads)
 	fcntl(q->intr[0], F_SETFL, fcntl(q->intr[0], F_GETFL) | O_NONBLOCK);
 
 	q->intr_state = 0;
+	q->intr_gen = 0;
+	q->timer_fd = -1;
 
 	q->epoll_fd = epoll_create(64);
 	if (q->epoll_fd < 0) {
@@ -94,6 +115,13 @@ int ioq_init(struct ioq *q, unsigned int bg_threads)
 		goto fail_ctl;
 	}
 
+	q->evts_size = MIN_EVENTS;
+	q->evts = malloc(sizeof(q->evts[0]) * q->evts_size);
+	if (!q->evts) {
+		err = ENOMEM;
+		goto fail_ctl;
+	}
+
 	return 0;
 
 fail_ctl:
@@ -102,6 +130,8 @@ fail_epoll:
 	close(q->intr[0]);
 	close(q->intr[1]);
 fail_pipe:
+	thr_mutex_destroy(&q->timer_lock);
+	thr_mutex_destroy(&q->poll_lock);
 	thr_mutex_destroy(&q->lock);
 	waitq_destroy(&q->wait);
 	runq_destroy(&q->run);
@@ -115,11 +145,84 @@ void ioq_destroy(struct ioq *q)
 	runq_destroy(&q->run);
 	waitq_destroy(&q->wait);
 
+	thr_mutex_destroy(&q->timer_lock);
+	thr_mutex_destroy(&q->poll_lock);
 	thr_mutex_destroy(&q->lock);
 
+	if (q->timer_fd >= 0)
+		close(q->timer_fd);
+
 	close(q->intr[0]);
 	close(q->intr[1]);
 	close(q->epoll_fd);
+	free(q->evts);
+}
+
+/* Re-arm the timerfd for the head of the wait queue. This is
+ * serialized so that a stale deadline can never overwrite a newer
+ * one.
+ */
+static void timer_rearm(struct ioq *q)
+{
+	struct itimerspec its;
+	clock_ticks_t deadline;
+
+	memset(&its, 0, sizeof(its));
+
+	thr_mutex_lock(&q->timer_lock);
+	if (!waitq_first_deadline(&q->wait, &deadline)) {
+		/* clock_now() counts CLOCK_MONOTONIC milliseconds, so the
+		 * deadline can be used directly as an absolute time. A
+		 * zero it_value would disarm the timer.
+		 */
+		its.it_value.tv_sec = deadline / 1000;
+		its.it_value.tv_nsec = (deadline % 1000) * 1000000LL;
+		if (!deadline)
+			its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(q->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	thr_mutex_unlock(&q->timer_lock);
+}
+
+static void wakeup_timerfd(struct waitq *q)
+{
+	timer_rearm(container_of(q, struct ioq, wait));
+}
+
+static void timer_ack(struct ioq *q)
+{
+	uint64_t count;
+
+	read(q->timer_fd, &count, sizeof(count));
+	waitq_dispatch(&q->wait, 0);
+	timer_rearm(q);
+}
+
+int ioq_use_timerfd(struct ioq *q)
+{
+	struct epoll_event evt;
+	syserr_t err;
+
+	q->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (q->timer_fd < 0)
+		return -1;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events = EPOLLIN;
+	evt.data.ptr = q;
+	if (epoll_ctl(q->epoll_fd, EPOLL_CTL_ADD, q->timer_fd, &evt) < 0) {
+		err = syserr_last();
+		close(q->timer_fd);
+		q->timer_fd = -1;
+		syserr_set(err);
+		return -1;
+	}
+
+	q->wait.wakeup = wakeup_timerfd;
+	timer_rearm(q);
+	return 0;
 }
 
 static int mod_enqueue_nolock(struct ioq *q, struct ioq_fd *f)
@@ -154,15 +257,38 @@ static struct ioq_fd *mod_dequeue(struct ioq *q, int *flags,
 	return r;
 }
 
-static int do_wait(struct ioq *q)
+static void grow_events(struct ioq *q)
 {
-	struct epoll_event evts[32];
-	const int timeout = waitq_next_deadline(&q->wait);
+	struct epoll_event *n;
+
+	if (q->evts_size >= MAX_EVENTS)
+		return;
+
+	n = realloc(q->evts, sizeof(q->evts[0]) * q->evts_size * 2);
+	if (!n)
+		return;
+
+	q->evts = n;
+	q->evts_size *= 2;
+}
+
+static int do_wait(struct ioq *q, unsigned int gen)
+{
+	struct slist ready;
+	int timer_fired = 0;
+	int timeout = -1;
 	int ret;
 	int i;
 
+	if (q->timer_fd < 0)
+		timeout = waitq_next_deadline(&q->wait);
+
+	/* Don't block if we were notified while waiting for our turn */
+	if (intr_gen(q) != gen)
+		timeout = 0;
+
 	/* This can't fail for any reason but signal interruption */
-	ret = epoll_wait(q->epoll_fd, evts, lengthof(evts), timeout);
+	ret = epoll_wait(q->epoll_fd, q->evts, q->evts_size, timeout);
 	if (ret < 0) {
 		if (syserr_last() == EINTR)
 			return 0;
@@ -171,27 +297,87 @@ static int do_wait(struct ioq *q)
 
 	intr_ack(q);
 
+	/* Update the whole batch under a single lock. Completed waits
+	 * go straight to the run queue, unless a modification is
+	 * already pending, in which case dispatch_mods() finishes them.
+	 */
+	slist_init(&ready);
+
+	thr_mutex_lock(&q->lock);
 	for (i = 0; i < ret; i++) {
-		const struct epoll_event *e = &evts[i];
+		const struct epoll_event *e = &q->evts[i];
 		struct ioq_fd *f = e->data.ptr;
 
 		if (!f)
 			continue;
 
-		epoll_ctl(q->epoll_fd, EPOLL_CTL_DEL, f->fd, NULL);
+		if (e->data.ptr == q) {
+			timer_fired = 1;
+			continue;
+		}
+
 		f->ready = e->events;
+		f->flags &= ~IOQ_FLAG_WAITING;
 
-		thr_mutex_lock(&q->lock);
-		f->flags &= ~(IOQ_FLAG_EPOLL | IOQ_FLAG_WAITING);
-		mod_enqueue_nolock(q, f);
-		thr_mutex_unlock(&q->lock);
+		if (!(f->flags & IOQ_FLAG_MOD_LIST))
+			slist_append(&ready, &f->task.job_list);
 	}
+	thr_mutex_unlock(&q->lock);
+
+	runq_exec_list(&q->run, &ready);
+
+	if (timer_fired)
+		timer_ack(q);
+
+	if (ret == q->evts_size)
+		grow_events(q);
 
 	return 0;
 }
 
+static int arm_fd(struct ioq *q, struct ioq_fd *f, int flags,
+		  ioq_fd_mask_t requested)
+{
+	struct epoll_event evt;
+	int op = (flags & IOQ_FLAG_EPOLL) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events = requested | EPOLLONESHOT;
+	evt.data.ptr = f;
+
+	if (!epoll_ctl(q->epoll_fd, op, f->fd, &evt))
+		return 0;
+
+	/* Our idea of whether the descriptor is registered may be stale
+	 * if it was closed, reused or changed since the last wait.
+	 */
+	if (errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else if (errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else
+		return -1;
+
+	return epoll_ctl(q->epoll_fd, op, f->fd, &evt);
+}
+
+static int rearm_fd(struct ioq *q, struct ioq_fd *f)
+{
+	struct epoll_event evt;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events = f->requested | EPOLLONESHOT;
+	evt.data.ptr = f;
+
+	return epoll_ctl(q->epoll_fd, EPOLL_CTL_MOD, f->fd, &evt);
+}
+
 static void dispatch_mods(struct ioq *q)
 {
+	struct slist ready;
+
+	slist_init(&ready);
+
 	for (;;) {
 		ioq_fd_mask_t requested;
 		int flags;
@@ -201,7 +387,7 @@ static void dispatch_mods(struct ioq *q)
 			break;
 
 		if (!(flags & IOQ_FLAG_WAITING)) {
-			runq_task_exec(&f->task, f->task.func);
+			slist_append(&ready, &f->task.job_list);
 		} else if (!requested) {
 			if (flags & IOQ_FLAG_EPOLL)
 				epoll_ctl(q->epoll_fd, EPOLL_CTL_DEL,
@@ -213,39 +399,40 @@ static void dispatch_mods(struct ioq *q)
 			f->flags &= ~(IOQ_FLAG_EPOLL | IOQ_FLAG_WAITING);
 			mod_enqueue_nolock(q, f);
 			thr_mutex_unlock(&q->lock);
+		} else if (arm_fd(q, f, flags, requested) < 0) {
+			f->err = syserr_last();
+
+			thr_mutex_lock(&q->lock);
+			f->requested = 0;
+			mod_enqueue_nolock(q, f);
+			thr_mutex_unlock(&q->lock);
 		} else {
-			struct epoll_event evt;
-
-			memset(&evt, 0, sizeof(evt));
-			evt.events = requested;
-			evt.data.ptr = f;
-
-			if (epoll_ctl(q->epoll_fd,
-				(flags & IOQ_FLAG_EPOLL) ?
-					EPOLL_CTL_MOD : EPOLL_CTL_ADD,
-				    f->fd, &evt) < 0) {
-				f->err = syserr_last();
-
-				thr_mutex_lock(&q->lock);
-				f->requested = 0;
-				mod_enqueue_nolock(q, f);
-				thr_mutex_unlock(&q->lock);
-			} else {
-				thr_mutex_lock(&q->lock);
-				f->flags |= IOQ_FLAG_EPOLL;
-				thr_mutex_unlock(&q->lock);
-			}
+			thr_mutex_lock(&q->lock);
+			f->flags |= IOQ_FLAG_EPOLL;
+			thr_mutex_unlock(&q->lock);
 		}
 	}
+
+	runq_exec_list(&q->run, &ready);
 }
 
 int ioq_iterate(struct ioq *q)
 {
-	if (do_wait(q) < 0)
+	const unsigned int gen = intr_gen(q);
+	int r;
+
+	thr_mutex_lock(&q->poll_lock);
+	r = do_wait(q, gen);
+	if (r >= 0)
+		dispatch_mods(q);
+	thr_mutex_unlock(&q->poll_lock);
+
+	if (r < 0)
 		return -1;
 
-	dispatch_mods(q);
-	waitq_dispatch(&q->wait, 0);
+	if (q->timer_fd < 0)
+		waitq_dispatch(&q->wait, 0);
+
 	runq_dispatch(&q->run, 0);
 
 	return 0;
@@ -273,15 +460,27 @@ void ioq_fd_wait(struct ioq_fd *f, ioq_fd_mask_t set, ioq_fd_func_t func)
 	f->requested = set;
 	f->ready = 0;
 	f->err = 0;
-	f->flags = IOQ_FLAG_WAITING;
+	f->flags = (f->flags & IOQ_FLAG_EPOLL) | IOQ_FLAG_WAITING;
 
 	if (!set) {
 		runq_task_exec(&f->task, (runq_task_func_t)func);
 		return;
 	}
 
+	/* A registered descriptor is disarmed once its last wait has
+	 * completed, so no thread can be touching it. We can re-arm it
+	 * ourselves, without involving the poll lock holder.
+	 */
+	if ((f->flags & (IOQ_FLAG_EPOLL | IOQ_FLAG_MOD_LIST)) ==
+	    IOQ_FLAG_EPOLL && !rearm_fd(q, f))
+		return;
+
+	/* If that failed, a cancellation may have raced with us and
+	 * already completed the wait.
+	 */
 	thr_mutex_lock(&q->lock);
-	need_wakeup = mod_enqueue_nolock(q, f);
+	if (f->flags & IOQ_FLAG_WAITING)
+		need_wakeup = mod_enqueue_nolock(q, f);
 	thr_mutex_unlock(&q->lock);
 
 	if (need_wakeup)
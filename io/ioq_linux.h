@@ -26,16 +26,51 @@ struct ioq {
 	thr_mutex_t		lock;
 	struct slist		mod_list;
 
-	/* Wakeup pipe */
+	/* Wakeup pipe. The generation count is bumped by every call to
+	 * ioq_notify(), so that threads waiting for their turn to poll
+	 * can tell that they've been interrupted.
+	 */
 	int			intr[2];
 	int			intr_state;
+	unsigned int		intr_gen;
+
+	/* Any number of threads may be in ioq_iterate() at once, but
+	 * only the holder of this lock waits on the epoll set and
+	 * applies changes from the mod_list. The others run tasks, and
+	 * queue up to take over as soon as the leader has finished
+	 * demultiplexing events.
+	 */
+	thr_mutex_t		poll_lock;
+
+	/* Optional timerfd, armed for the earliest waitq deadline. This
+	 * is -1 unless ioq_use_timerfd() has been called.
+	 */
+	thr_mutex_t		timer_lock;
+	int			timer_fd;
 
-	/* epoll file descriptor */
+	/* epoll file descriptor, and the event buffer used by the
+	 * current poll lock holder. The buffer grows while epoll_wait()
+	 * keeps returning full batches.
+	 */
 	int			epoll_fd;
+	struct epoll_event	*evts;
+	unsigned int		evts_size;
 };
 
+/* Deliver timer expiry through a timerfd in the epoll set, rather than
+ * via the epoll_wait() timeout. The timerfd is re-armed only when the
+ * head of the timer set changes, so the loop doesn't have to inspect
+ * the wait queue and clock on every iteration, and expiry wakeups are
+ * exact.
+ *
+ * This should be called after ioq_init(), before any timers are
+ * started. Returns 0 on success or -1 if an error occurs.
+ */
+int ioq_use_timerfd(struct ioq *q);
+
 /* This is the set of POSIX file descriptor events which can be waited
- * for. These are level-triggered events.
+ * for. These are level-triggered events, but each wait reports at most
+ * once.
  */
 typedef uint32_t ioq_fd_mask_t;
 
@@ -76,6 +111,9 @@ struct ioq_fd {
 	 *
 	 * The flags field tells us which data structures this ioq_fd
 	 * belongs to (mod_list and kernel's internal epoll structures).
+	 * Registrations are one-shot, and are left in place (disarmed)
+	 * after an event, so that the next wait costs only a single
+	 * EPOLL_CTL_MOD, made directly by the waiting thread.
 	 */
 	int			flags;
 	struct slist_node	mod_list;
@@ -35,6 +35,7 @@ int ioq_init(struct ioq *q, unsigned int bg_threads)
 
 	q->run.wakeup = wakeup_runq;
 	q->wait.wakeup = wakeup_waitq;
+	q->waiters = 0;
 
 	q->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
 	if (!q->iocp) {
@@ -63,8 +64,10 @@ int ioq_iterate(struct ioq *q)
 	ULONG_PTR comp_key;
 	LPOVERLAPPED overlapped = NULL;
 
+	InterlockedIncrement(&q->waiters);
 	GetQueuedCompletionStatus(q->iocp, &number_of_bytes, &comp_key,
 		    &overlapped, (timeout < 0) ? INFINITE : timeout);
+	InterlockedDecrement(&q->waiters);
 
 	if (overlapped) {
 		struct ioq_ovl *h = container_of(overlapped,
@@ -81,7 +84,12 @@ int ioq_iterate(struct ioq *q)
 
 void ioq_notify(struct ioq *q)
 {
-	PostQueuedCompletionStatus(q->iocp, 0, 0, NULL);
+	LONG n = q->waiters;
+
+	/* Each packet wakes only one thread */
+	do
+		PostQueuedCompletionStatus(q->iocp, 0, 0, NULL);
+	while (--n > 0);
 }
 
 void ioq_ovl_wait(struct ioq_ovl *h, ioq_ovl_func_t f)
@@ -24,6 +24,9 @@ struct ioq {
 
 	/* IO completion port */
 	HANDLE			iocp;
+
+	/* Number of threads currently blocked in ioq_iterate() */
+	volatile LONG		waiters;
 };
 
 /* If you want to perform IO on a handle and use the IO queue for
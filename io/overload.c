@@ -0,0 +1,57 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "overload.h"
+
+void overload_init(struct overload *o, struct runq *r,
+		   unsigned int max_depth, clock_ticks_t max_delay)
+{
+	o->run = r;
+	o->max_depth = max_depth;
+	o->max_delay = max_delay;
+	o->active = 0;
+	thr_mutex_init(&o->lock);
+
+	if (max_delay)
+		runq_track_delay(r);
+}
+
+void overload_destroy(struct overload *o)
+{
+	thr_mutex_destroy(&o->lock);
+}
+
+int overload_check(struct overload *o)
+{
+	const unsigned int depth = runq_depth(o->run);
+	const clock_ticks_t delay = o->max_delay ? runq_delay(o->run) : 0;
+	int r;
+
+	thr_mutex_lock(&o->lock);
+	if (o->active) {
+		if ((!o->max_depth || depth <= o->max_depth / 2) &&
+		    (!o->max_delay || delay <= o->max_delay / 2))
+			o->active = 0;
+	} else {
+		if ((o->max_depth && depth > o->max_depth) ||
+		    (o->max_delay && delay > o->max_delay))
+			o->active = 1;
+	}
+	r = o->active;
+	thr_mutex_unlock(&o->lock);
+
+	return r;
+}
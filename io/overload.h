@@ -0,0 +1,59 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IO_OVERLOAD_H_
+#define IO_OVERLOAD_H_
+
+#include "runq.h"
+#include "clock.h"
+#include "thr.h"
+
+/* Overload detector. This watches a run queue's depth and queueing
+ * delay, and reports whether either has crossed a configured limit.
+ * It can be used for admission control: when the queue is overloaded,
+ * stop taking on new work until it drains.
+ *
+ * To avoid flapping, the detector has hysteresis. Once a limit has
+ * been crossed, the overload state persists until both measures have
+ * fallen to half of their limits.
+ */
+struct overload {
+	struct runq		*run;
+	unsigned int		max_depth;
+	clock_ticks_t		max_delay;
+
+	thr_mutex_t		lock;
+	int			active;
+};
+
+/* Initialize an overload detector for the given run queue. Either
+ * limit may be 0 to disable it. Specifying a delay limit turns on delay
+ * tracking in the run queue. This may be done while the queue is in
+ * use: tasks already waiting are measured from the time the detector
+ * was initialized.
+ */
+void overload_init(struct overload *o, struct runq *r,
+		   unsigned int max_depth, clock_ticks_t max_delay);
+
+/* Destroy an overload detector. */
+void overload_destroy(struct overload *o);
+
+/* Sample the run queue and return non-zero if it's overloaded. This
+ * function may be called from any thread.
+ */
+int overload_check(struct overload *o);
+
+#endif
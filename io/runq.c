@@ -30,6 +30,8 @@ static int run_one(struct runq *r)
 	}
 
 	n = slist_pop(&r->job_list);
+	if (n)
+		r->depth--;
 	thr_mutex_unlock(&r->lock);
 
 	if (!n)
@@ -95,6 +97,9 @@ int runq_init(struct runq *r, unsigned int bg_workers)
 	r->wakeup = NULL;
 	r->num_workers = bg_workers;
 	r->quit_request = 0;
+	r->depth = 0;
+	r->track_delay = 0;
+	r->track_since = 0;
 	slist_init(&r->job_list);
 	thr_mutex_init(&r->lock);
 
@@ -159,6 +164,63 @@ unsigned int runq_dispatch(struct runq *r, unsigned int limit)
 	return count;
 }
 
+unsigned int runq_depth(struct runq *r)
+{
+	unsigned int depth;
+
+	thr_mutex_lock(&r->lock);
+	depth = r->depth;
+	thr_mutex_unlock(&r->lock);
+
+	return depth;
+}
+
+void runq_track_delay(struct runq *r)
+{
+	thr_mutex_lock(&r->lock);
+	if (!r->track_delay) {
+		r->track_since = clock_now();
+		r->track_delay = 1;
+	}
+	thr_mutex_unlock(&r->lock);
+}
+
+clock_ticks_t runq_delay(struct runq *r)
+{
+	clock_ticks_t queued = 0;
+	clock_ticks_t now;
+	int found = 0;
+
+	thr_mutex_lock(&r->lock);
+	if (r->track_delay && r->job_list.start) {
+		queued = container_of(r->job_list.start,
+			struct runq_task, job_list)->queued;
+		found = 1;
+
+		/* Tasks queued before tracking began weren't stamped */
+		if (queued < r->track_since)
+			queued = r->track_since;
+	}
+	thr_mutex_unlock(&r->lock);
+
+	if (!found)
+		return 0;
+
+	now = clock_now();
+	return (now > queued) ? now - queued : 0;
+}
+
+static void wakeup_all(struct runq *r)
+{
+	int i;
+
+	for (i = 0; i < r->num_workers; i++)
+		thr_event_raise(&r->workers[i].wakeup);
+
+	if (r->wakeup)
+		r->wakeup(r);
+}
+
 void runq_task_exec(struct runq_task *t, runq_task_func_t func)
 {
 	struct runq *r = t->owner;
@@ -167,17 +229,44 @@ void runq_task_exec(struct runq_task *t, runq_task_func_t func)
 	t->func = func;
 
 	thr_mutex_lock(&r->lock);
+	if (r->track_delay)
+		t->queued = clock_now();
+
 	was_empty = slist_is_empty(&r->job_list);
 	slist_append(&r->job_list, &t->job_list);
+	r->depth++;
 	thr_mutex_unlock(&r->lock);
 
-	if (was_empty) {
-		int i;
+	if (was_empty)
+		wakeup_all(r);
+}
 
-		for (i = 0; i < r->num_workers; i++)
-			thr_event_raise(&r->workers[i].wakeup);
+void runq_exec_list(struct runq *r, struct slist *tasks)
+{
+	unsigned int count = 0;
+	struct slist_node *n;
+	int was_empty;
+
+	if (slist_is_empty(tasks))
+		return;
 
-		if (r->wakeup)
-			r->wakeup(r);
+	for (n = tasks->start; n; n = n->next)
+		count++;
+
+	thr_mutex_lock(&r->lock);
+	if (r->track_delay) {
+		const clock_ticks_t now = clock_now();
+
+		for (n = tasks->start; n; n = n->next)
+			container_of(n, struct runq_task, job_list)->queued =
+				now;
 	}
+
+	was_empty = slist_is_empty(&r->job_list);
+	slist_concat(&r->job_list, tasks);
+	r->depth += count;
+	thr_mutex_unlock(&r->lock);
+
+	if (was_empty)
+		wakeup_all(r);
 }
@@ -19,6 +19,7 @@
 
 #include "thr.h"
 #include "slist.h"
+#include "clock.h"
 
 /* Asynchronous run-queue. This object manages a pool of worker threads,
  * to which tasks (functions) may be submitted for execution.
@@ -45,6 +46,11 @@ struct runq {
 	thr_mutex_t		lock;
 	struct slist		job_list;
 	int			quit_request;
+
+	/* Load statistics, protected by the lock */
+	unsigned int		depth;
+	int			track_delay;
+	clock_ticks_t		track_since;
 };
 
 /* Initialize a run-queue, specifying the number of background workers.
@@ -63,6 +69,22 @@ void runq_destroy(struct runq *r);
  */
 unsigned int runq_dispatch(struct runq *r, unsigned int limit);
 
+/* Enable measurement of queueing delay. Each submitted task is then
+ * timestamped with clock_now(). This may be called at any time: tasks
+ * already waiting are treated as having been queued when tracking was
+ * enabled.
+ */
+void runq_track_delay(struct runq *r);
+
+/* Obtain the number of tasks waiting to be executed. */
+unsigned int runq_depth(struct runq *r);
+
+/* Obtain the time, in milliseconds, for which the oldest waiting task
+ * has been queued. This is 0 if the queue is empty, or if delay
+ * tracking isn't enabled.
+ */
+clock_ticks_t runq_delay(struct runq *r);
+
 /* A submittable job is represented by the following structure. */
 struct runq_task;
 typedef void (*runq_task_func_t)(struct runq_task *t);
@@ -71,6 +93,7 @@ struct runq_task {
 	struct slist_node	job_list;
 	runq_task_func_t	func;
 	struct runq		*owner;
+	clock_ticks_t		queued;
 };
 
 /* Initialize a task by associating it with a run-queue. */
@@ -92,4 +115,13 @@ static inline void runq_task_init(struct runq_task *t, struct runq *q)
  */
 void runq_task_exec(struct runq_task *t, runq_task_func_t func);
 
+/* Submit a batch of tasks at once. The tasks must be linked via their
+ * job_list nodes, must all belong to the given run-queue, and must
+ * each have their func field set already. The list is left empty.
+ *
+ * This is equivalent to calling runq_task_exec() for each task in
+ * order, but takes the queue lock and wakes workers only once.
+ */
+void runq_exec_list(struct runq *r, struct slist *tasks);
+
 #endif
@@ -96,6 +96,21 @@ static inline int thr_event_wait_timeout(thr_event_t *e, int timeout_ms)
 {
 	return WaitForSingleObject(*e, timeout_ms);
 }
+
+/* Atomic integers. Each operation returns the previous value and acts
+ * as a full memory barrier.
+ */
+typedef volatile LONG thr_atomic_t;
+
+static inline int thr_atomic_or(thr_atomic_t *a, int v)
+{
+	return InterlockedOr(a, v);
+}
+
+static inline int thr_atomic_swap(thr_atomic_t *a, int v)
+{
+	return InterlockedExchange(a, v);
+}
 #else
 #include <pthread.h>
 
@@ -150,6 +165,27 @@ void thr_event_raise(thr_event_t *e);
 void thr_event_clear(thr_event_t *e);
 void thr_event_wait(thr_event_t *e);
 int thr_event_wait_timeout(thr_event_t *e, int timeout_ms);
+
+/* Atomic integers. Each operation returns the previous value and acts
+ * as a full memory barrier.
+ */
+typedef volatile int thr_atomic_t;
+
+static inline int thr_atomic_or(thr_atomic_t *a, int v)
+{
+	return __sync_fetch_and_or(a, v);
+}
+
+static inline int thr_atomic_swap(thr_atomic_t *a, int v)
+{
+	int old = *a;
+	int prev;
+
+	while ((prev = __sync_val_compare_and_swap(a, old, v)) != old)
+		old = prev;
+
+	return old;
+}
 #endif
 
 #endif
@@ -68,20 +68,26 @@ void waitq_destroy(struct waitq *wq)
 	thr_mutex_destroy(&wq->lock);
 }
 
-int waitq_next_deadline(struct waitq *wq)
+int waitq_first_deadline(struct waitq *wq, clock_ticks_t *deadline)
 {
 	struct rbt_node *n;
-	clock_ticks_t now = clock_now();
-	clock_ticks_t deadline;
 
 	thr_mutex_lock(&wq->lock);
 	n = rbt_iter_first(&wq->waiting_set);
 	if (n)
-		deadline = container_of(n, struct waitq_timer,
+		*deadline = container_of(n, struct waitq_timer,
 			waiting_set)->deadline;
 	thr_mutex_unlock(&wq->lock);
 
-	if (!n)
+	return n ? 0 : -1;
+}
+
+int waitq_next_deadline(struct waitq *wq)
+{
+	clock_ticks_t now = clock_now();
+	clock_ticks_t deadline;
+
+	if (waitq_first_deadline(wq, &deadline) < 0)
 		return -1;
 	if (deadline < now)
 		return 0;
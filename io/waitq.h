@@ -52,6 +52,12 @@ void waitq_destroy(struct waitq *wq);
  */
 int waitq_next_deadline(struct waitq *wq);
 
+/* Find the absolute deadline of the next timer to expire, without
+ * consulting the clock. Returns 0 if there is one, or -1 if there are
+ * no timers in the set.
+ */
+int waitq_first_deadline(struct waitq *wq, clock_ticks_t *deadline);
+
 /* For each timer which has expired, enqueue the completion handler in
  * the linked run queue. A limit may be specified (0 means no limit).
  */
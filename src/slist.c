@@ -31,6 +31,20 @@ void slist_push(struct slist *s, struct slist_node *n)
 		s->end = n;
 }
 
+void slist_concat(struct slist *dst, struct slist *src)
+{
+	if (!src->start)
+		return;
+
+	if (dst->end)
+		dst->end->next = src->start;
+	else
+		dst->start = src->start;
+
+	dst->end = src->end;
+	slist_init(src);
+}
+
 struct slist_node *slist_pop(struct slist *s)
 {
 	struct slist_node *r = s->start;
@@ -50,4 +50,9 @@ struct slist_node *slist_pop(struct slist *s);
 /* Add an item to the end of a list. */
 void slist_append(struct slist *s, struct slist_node *n);
 
+/* Move all items from one list to the end of another. The source list
+ * is left empty.
+ */
+void slist_concat(struct slist *dst, struct slist *src);
+
 #endif
@@ -0,0 +1,295 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "aconnect.h"
+#include "clock.h"
+
+#define N_SLOTS		2
+#define DELAY_MS	50
+
+/* Never completes: it's longer than the test takes to run */
+#define LONG_DELAY	60000
+
+static struct ioq q;
+static struct aconnect conn;
+static struct aconnect_slot slots[N_SLOTS];
+static int is_done;
+
+/************************************************************************
+ * Addresses
+ *
+ * The black hole is a listener whose backlog is full. Linux drops
+ * further SYNs, so connections to it neither succeed nor fail.
+ */
+
+#define ADDR_GOOD	0
+#define ADDR_REFUSED	1
+#define ADDR_HOLE	2
+#define N_ADDR		3
+
+static struct sockaddr_in addrs[N_ADDR];
+static struct addrinfo infos[8];
+
+static struct asock listener;
+static struct asock accepted;
+static net_sock_t hole;
+static net_sock_t hole_client;
+
+static net_sock_t bound_socket(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	net_sock_t s = socket(AF_INET, SOCK_STREAM, 0);
+	int r;
+
+	assert(s >= 0);
+
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr->sin_port = 0;
+
+	r = bind(s, (struct sockaddr *)addr, sizeof(*addr));
+	assert(r >= 0);
+
+	r = getsockname(s, (struct sockaddr *)addr, &len);
+	assert(r >= 0);
+
+	return s;
+}
+
+static void addrs_init(void)
+{
+	socklen_t len = sizeof(addrs[ADDR_GOOD]);
+	net_sock_t s;
+	int r;
+
+	/* Good: an ordinary listener */
+	addrs[ADDR_GOOD].sin_family = AF_INET;
+	addrs[ADDR_GOOD].sin_addr.s_addr = inet_addr("127.0.0.1");
+	addrs[ADDR_GOOD].sin_port = 0;
+
+	r = asock_listen(&listener, (struct sockaddr *)&addrs[ADDR_GOOD],
+			 sizeof(addrs[ADDR_GOOD]));
+	assert(r >= 0);
+
+	r = getsockname(asock_get_handle(&listener),
+			(struct sockaddr *)&addrs[ADDR_GOOD], &len);
+	assert(r >= 0);
+
+	/* Refused: a port which was bound, but is no longer */
+	s = bound_socket(&addrs[ADDR_REFUSED]);
+	close(s);
+
+	/* Black hole: a backlog of 0 is filled by one connection */
+	hole = bound_socket(&addrs[ADDR_HOLE]);
+	r = listen(hole, 0);
+	assert(r >= 0);
+
+	hole_client = socket(AF_INET, SOCK_STREAM, 0);
+	assert(hole_client >= 0);
+	r = connect(hole_client, (struct sockaddr *)&addrs[ADDR_HOLE],
+		    sizeof(addrs[ADDR_HOLE]));
+	assert(r >= 0);
+}
+
+static void addrs_exit(void)
+{
+	close(hole_client);
+	close(hole);
+}
+
+/* Build a list of addresses, in the given order */
+static const struct addrinfo *make_list(const int *which, int n)
+{
+	int i;
+
+	assert(n <= sizeof(infos) / sizeof(infos[0]));
+
+	for (i = 0; i < n; i++) {
+		struct addrinfo *ai = &infos[i];
+
+		memset(ai, 0, sizeof(*ai));
+		ai->ai_family = AF_INET;
+		ai->ai_socktype = SOCK_STREAM;
+		ai->ai_addr = (struct sockaddr *)&addrs[which[i]];
+		ai->ai_addrlen = sizeof(addrs[which[i]]);
+		ai->ai_next = (i + 1 < n) ? &infos[i + 1] : NULL;
+	}
+
+	return n ? infos : NULL;
+}
+
+/************************************************************************
+ * Tests
+ */
+
+static void connect_done(struct aconnect *c)
+{
+	is_done = 1;
+}
+
+static clock_ticks_t run(const int *which, int n, int delay)
+{
+	const clock_ticks_t start = clock_now();
+
+	is_done = 0;
+	aconnect_start(&conn, make_list(which, n), delay, connect_done);
+
+	while (!is_done) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+
+	return clock_now() - start;
+}
+
+static int accepts;
+
+static void accept_done(struct asock *t)
+{
+	assert(!asock_get_error(t));
+	accepts++;
+	asock_close(&accepted);
+}
+
+static void expect_good(clock_ticks_t elapsed, clock_ticks_t max)
+{
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	int r;
+
+	printf("    %" CLOCK_PRI_TICKS " ms\n", elapsed);
+	assert(!aconnect_get_error(&conn));
+	assert(aconnect_get_sock(&conn));
+	assert(elapsed < max);
+
+	r = getpeername(asock_get_handle(aconnect_get_sock(&conn)),
+			(struct sockaddr *)&peer, &len);
+	assert(r >= 0);
+	assert(peer.sin_port == addrs[ADDR_GOOD].sin_port);
+
+	asock_accept(&listener, &accepted, accept_done);
+	while (!accepts) {
+		r = ioq_iterate(&q);
+		assert(r >= 0);
+	}
+
+	accepts = 0;
+}
+
+/* A black-holed first address costs only the stagger delay */
+static void test_hole(void)
+{
+	const int which[] = {ADDR_HOLE, ADDR_GOOD};
+	clock_ticks_t elapsed;
+
+	printf("Black hole first:\n");
+	elapsed = run(which, 2, DELAY_MS);
+	assert(elapsed >= DELAY_MS);
+	expect_good(elapsed, 1000);
+}
+
+/* A refused address is followed by the next without waiting */
+static void test_refused(void)
+{
+	const int which[] = {ADDR_REFUSED, ADDR_GOOD};
+
+	printf("Refused first:\n");
+	expect_good(run(which, 2, LONG_DELAY), 1000);
+}
+
+/* More addresses than slots: the hole occupies one slot throughout */
+static void test_slots(void)
+{
+	const int which[] = {ADDR_HOLE, ADDR_REFUSED, ADDR_REFUSED,
+			     ADDR_GOOD};
+
+	printf("Slot reuse:\n");
+	expect_good(run(which, 4, DELAY_MS), 1000);
+}
+
+static void test_fail(void)
+{
+	const int which[] = {ADDR_REFUSED, ADDR_REFUSED};
+
+	printf("All refused:\n");
+	run(which, 2, LONG_DELAY);
+	assert(!aconnect_get_sock(&conn));
+	assert(aconnect_get_error(&conn) == ECONNREFUSED);
+
+	printf("Empty list:\n");
+	run(which, 0, LONG_DELAY);
+	assert(!aconnect_get_sock(&conn));
+	assert(aconnect_get_error(&conn) == ACONNECT_ERR_NOADDR);
+}
+
+static void test_cancel(void)
+{
+	const int which[] = {ADDR_HOLE};
+
+	printf("Cancel:\n");
+	is_done = 0;
+	aconnect_start(&conn, make_list(which, 1), DELAY_MS, connect_done);
+	aconnect_cancel(&conn);
+
+	while (!is_done) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+
+	assert(!aconnect_get_sock(&conn));
+	assert(aconnect_get_error(&conn) == ACONNECT_ERR_CANCELLED);
+}
+
+/************************************************************************
+ * Main thread/test
+ */
+
+int main(void)
+{
+	int r;
+
+	r = net_start();
+	assert(!r);
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	asock_init(&listener, &q);
+	asock_init(&accepted, &q);
+	aconnect_init(&conn, &q, slots, N_SLOTS);
+
+	addrs_init();
+	test_hole();
+	test_refused();
+	test_slots();
+	test_fail();
+	test_cancel();
+	addrs_exit();
+
+	asock_close(&listener);
+	aconnect_destroy(&conn);
+	asock_destroy(&accepted);
+	asock_destroy(&listener);
+	ioq_destroy(&q);
+	net_stop();
+	return 0;
+}
@@ -0,0 +1,220 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include "adgram.h"
+
+#define N_DGRAMS	1024
+#define SEND_BATCH	32
+#define RECV_BATCH	16
+#define DGRAM_SIZE	64
+
+static struct adgram receiver;
+static struct adgram sender;
+
+static struct sockaddr_in recv_addr;
+static struct sockaddr_in send_addr;
+
+static int is_done;
+
+static void fill_dgram(uint8_t *buf, unsigned int seq)
+{
+	int i;
+
+	for (i = 0; i < DGRAM_SIZE; i++)
+		buf[i] = seq * 7 + i;
+}
+
+/************************************************************************
+ * Receiver
+ */
+
+static uint8_t recv_buf[RECV_BATCH][DGRAM_SIZE * 2];
+static struct adgram_pkt recv_pkts[RECV_BATCH];
+static unsigned int recv_seq;
+
+static void recv_done(struct adgram *d)
+{
+	const unsigned int n = adgram_get_recv_count(d);
+	unsigned int i;
+
+	assert(!adgram_get_recv_error(d));
+	assert(n > 0 && n <= RECV_BATCH);
+
+	printf("receiver: %d datagrams\n", n);
+
+	for (i = 0; i < n; i++) {
+		const struct adgram_pkt *p = &recv_pkts[i];
+		const struct sockaddr_in *from =
+			(const struct sockaddr_in *)&p->addr;
+		uint8_t expect[DGRAM_SIZE];
+
+		assert(p->len == DGRAM_SIZE);
+		assert(p->addr_len == sizeof(*from));
+		assert(from->sin_port == send_addr.sin_port);
+
+		fill_dgram(expect, recv_seq++);
+		assert(!memcmp(expect, p->data, DGRAM_SIZE));
+	}
+
+	if (recv_seq >= N_DGRAMS) {
+		printf("receiver: done\n");
+		is_done = 1;
+		return;
+	}
+
+	adgram_recv(d, recv_pkts, RECV_BATCH, recv_done);
+}
+
+static void receiver_init(struct ioq *q)
+{
+	socklen_t len = sizeof(recv_addr);
+	int i;
+
+	adgram_init(&receiver, q);
+
+	recv_addr.sin_family = AF_INET;
+	recv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	recv_addr.sin_port = 0;
+
+	i = adgram_bind(&receiver, (struct sockaddr *)&recv_addr,
+			sizeof(recv_addr));
+	assert(i >= 0);
+
+	i = getsockname(adgram_get_handle(&receiver),
+			(struct sockaddr *)&recv_addr, &len);
+	assert(i >= 0);
+
+	for (i = 0; i < RECV_BATCH; i++) {
+		recv_pkts[i].data = recv_buf[i];
+		recv_pkts[i].size = sizeof(recv_buf[i]);
+	}
+
+	adgram_recv(&receiver, recv_pkts, RECV_BATCH, recv_done);
+}
+
+/************************************************************************
+ * Sender
+ */
+
+static uint8_t send_buf[SEND_BATCH][DGRAM_SIZE];
+static struct adgram_pkt send_pkts[SEND_BATCH];
+static unsigned int send_seq;
+static unsigned int send_ptr;
+static unsigned int send_count;
+
+static void begin_send(void);
+
+static void send_done(struct adgram *d)
+{
+	const unsigned int n = adgram_get_send_count(d);
+
+	assert(!adgram_get_send_error(d));
+	assert(n > 0);
+
+	printf("sender: sent %d datagrams\n", n);
+	send_ptr += n;
+	begin_send();
+}
+
+static void begin_send(void)
+{
+	unsigned int i;
+
+	if (send_ptr < send_count) {
+		adgram_send(&sender, send_pkts + send_ptr,
+			    send_count - send_ptr, send_done);
+		return;
+	}
+
+	/* Keep no more than one batch in flight, so that nothing is
+	 * dropped by the loopback interface.
+	 */
+	if (send_seq >= N_DGRAMS || recv_seq < send_seq)
+		return;
+
+	for (i = 0; i < SEND_BATCH; i++) {
+		struct adgram_pkt *p = &send_pkts[i];
+
+		fill_dgram(send_buf[i], send_seq++);
+		p->data = send_buf[i];
+		p->len = DGRAM_SIZE;
+		memcpy(&p->addr, &recv_addr, sizeof(recv_addr));
+		p->addr_len = sizeof(recv_addr);
+	}
+
+	send_ptr = 0;
+	send_count = SEND_BATCH;
+	adgram_send(&sender, send_pkts, send_count, send_done);
+}
+
+static void sender_init(struct ioq *q)
+{
+	socklen_t len = sizeof(send_addr);
+	int i;
+
+	adgram_init(&sender, q);
+
+	send_addr.sin_family = AF_INET;
+	send_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	send_addr.sin_port = 0;
+
+	i = adgram_bind(&sender, (struct sockaddr *)&send_addr,
+			sizeof(send_addr));
+	assert(i >= 0);
+
+	i = getsockname(adgram_get_handle(&sender),
+			(struct sockaddr *)&send_addr, &len);
+	assert(i >= 0);
+
+	begin_send();
+}
+
+/************************************************************************
+ * Main thread/test
+ */
+
+int main(void)
+{
+	struct ioq q;
+	int r;
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	receiver_init(&q);
+	sender_init(&q);
+
+	while (!is_done) {
+		r = ioq_iterate(&q);
+		assert(r >= 0);
+
+		/* Release the next batch once the last has arrived */
+		if (send_ptr >= send_count)
+			begin_send();
+	}
+
+	adgram_close(&receiver);
+	adgram_close(&sender);
+
+	adgram_destroy(&receiver);
+	adgram_destroy(&sender);
+	ioq_destroy(&q);
+	return 0;
+}
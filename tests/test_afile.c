@@ -14,14 +14,23 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "ioq.h"
 #include "containers.h"
 #include "afile.h"
 #include "prng.h"
 
+#ifndef __Windows__
+#include <fcntl.h>
+#endif
+
 #define N		65536
 #define MAX_WRITE	8192
 #define MAX_READ	3172
@@ -193,6 +202,339 @@ static void init_pipe(handle_t *pfd, struct ioq *q)
 }
 #endif
 
+/************************************************************************
+ * Positional operations: several handles share one file, and each
+ * transfers a disjoint chunk.
+ */
+
+#define N_CHUNK		8
+#define CHUNK_SIZE	(N / N_CHUNK)
+#define POOL_WORKERS	4
+
+static struct afile chunks[N_CHUNK];
+static int chunks_done;
+
+#ifdef __Windows__
+static handle_t open_temp(struct ioq *q)
+{
+	char dir[MAX_PATH];
+	char path[MAX_PATH];
+	handle_t h;
+	int r;
+
+	r = GetTempPath(sizeof(dir), dir);
+	assert(r);
+	r = GetTempFileName(dir, "afi", 0, path);
+	assert(r);
+
+	h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		       CREATE_ALWAYS,
+		       FILE_FLAG_OVERLAPPED | FILE_FLAG_DELETE_ON_CLOSE,
+		       NULL);
+	assert(h != INVALID_HANDLE_VALUE);
+
+	r = ioq_bind(q, h);
+	assert(!r);
+
+	return h;
+}
+#else
+static handle_t open_temp(struct ioq *q)
+{
+	char path[] = "/tmp/test_afile.XXXXXX";
+	const int fd = mkstemp(path);
+
+	assert(fd >= 0);
+	unlink(path);
+	return fd;
+}
+#endif
+
+static void chunk_write_done(struct afile *a)
+{
+	assert(!afile_write_error(a));
+	assert(afile_write_size(a) == CHUNK_SIZE);
+	chunks_done++;
+}
+
+static void chunk_read_done(struct afile *a)
+{
+	assert(!afile_read_error(a));
+	assert(afile_read_size(a) == CHUNK_SIZE);
+	chunks_done++;
+}
+
+static void run_chunks(struct ioq *q)
+{
+	while (chunks_done < N_CHUNK) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+}
+
+static void test_positional(struct ioq *q)
+{
+	struct runq pool;
+	handle_t h;
+	int i;
+	int r;
+
+	printf("Positional:\n");
+
+	r = runq_init(&pool, POOL_WORKERS);
+	assert(r >= 0);
+
+	h = open_temp(q);
+	for (i = 0; i < N_CHUNK; i++) {
+		afile_init(&chunks[i], q, h);
+		afile_set_pool(&chunks[i], &pool);
+	}
+
+	/* Write in reverse order, so that the file is extended by the
+	 * first write.
+	 */
+	chunks_done = 0;
+	for (i = N_CHUNK - 1; i >= 0; i--)
+		afile_pwrite(&chunks[i], pattern + i * CHUNK_SIZE, CHUNK_SIZE,
+			     i * CHUNK_SIZE, chunk_write_done);
+	run_chunks(q);
+
+	memset(out, 0, sizeof(out));
+	chunks_done = 0;
+	for (i = 0; i < N_CHUNK; i++)
+		afile_pread(&chunks[i], out + i * CHUNK_SIZE, CHUNK_SIZE,
+			    i * CHUNK_SIZE, chunk_read_done);
+	run_chunks(q);
+
+	assert(!memcmp(pattern, out, N));
+
+	for (i = 0; i < N_CHUNK; i++)
+		afile_destroy(&chunks[i]);
+
+	handle_close(h);
+	runq_destroy(&pool);
+}
+
+#ifndef __Windows__
+/************************************************************************
+ * Vectored and batched operations: records are written as several
+ * pieces, and read back as a batch of extents.
+ */
+
+#define N_RECORD	16
+#define RECORD_SIZE	(N / N_RECORD)
+#define HEADER_SIZE	16
+
+static struct afile vec_file;
+static struct afile_batch batch;
+static struct afile_extent extents[N_RECORD];
+static struct iovec iovs[N_RECORD][2];
+static int vec_done;
+
+static void vec_write_done(struct afile *a)
+{
+	assert(!afile_write_error(a));
+	assert(afile_write_size(a) == RECORD_SIZE);
+	vec_done++;
+}
+
+static void batch_done(struct afile_batch *b)
+{
+	vec_done++;
+}
+
+static void run_vec(struct ioq *q, int want)
+{
+	while (vec_done < want) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+}
+
+/* Split a record into a header and body */
+static const struct iovec *record_iov(uint8_t *base, int i)
+{
+	struct iovec *v = iovs[i];
+
+	v[0].iov_base = base + i * RECORD_SIZE;
+	v[0].iov_len = HEADER_SIZE;
+	v[1].iov_base = base + i * RECORD_SIZE + HEADER_SIZE;
+	v[1].iov_len = RECORD_SIZE - HEADER_SIZE;
+
+	return v;
+}
+
+static void test_vectored(struct ioq *q)
+{
+	struct runq pool;
+	handle_t h;
+	int i;
+	int r;
+
+	printf("Vectored:\n");
+
+	r = runq_init(&pool, POOL_WORKERS);
+	assert(r >= 0);
+
+	h = open_temp(q);
+	afile_init(&vec_file, q, h);
+	afile_set_pool(&vec_file, &pool);
+	afile_batch_init(&batch, &vec_file);
+
+	/* Write records one at a time, each with a single system call */
+	vec_done = 0;
+	for (i = 0; i < N_RECORD; i++) {
+		afile_pwritev(&vec_file, record_iov(pattern, i), 2,
+			      i * RECORD_SIZE, vec_write_done);
+		run_vec(q, i + 1);
+	}
+
+	/* Read every record back as one batch, in reverse order, plus one
+	 * extent past the end of the file.
+	 */
+	memset(out, 0, sizeof(out));
+	for (i = 0; i < N_RECORD - 1; i++) {
+		const int k = N_RECORD - 1 - i;
+
+		afile_batch_read(&batch, &extents[i], record_iov(out, k), 2,
+				 k * RECORD_SIZE);
+	}
+
+	afile_batch_read(&batch, &extents[N_RECORD - 1], record_iov(out, 0),
+			 2, N);
+
+	vec_done = 0;
+	afile_batch_submit(&batch, batch_done);
+	run_vec(q, 1);
+
+	for (i = 0; i < N_RECORD - 1; i++) {
+		assert(!afile_extent_error(&extents[i]));
+		assert(afile_extent_size(&extents[i]) == RECORD_SIZE);
+	}
+
+	assert(!afile_extent_error(&extents[N_RECORD - 1]));
+	assert(!afile_extent_size(&extents[N_RECORD - 1]));
+	assert(!memcmp(pattern + RECORD_SIZE, out + RECORD_SIZE,
+		       N - RECORD_SIZE));
+
+	/* The batch is reusable */
+	afile_batch_read(&batch, &extents[0], record_iov(out, 0), 2, 0);
+	vec_done = 0;
+	afile_batch_submit(&batch, batch_done);
+	run_vec(q, 1);
+	assert(afile_extent_size(&extents[0]) == RECORD_SIZE);
+	assert(!memcmp(pattern, out, N));
+
+	afile_destroy(&vec_file);
+	handle_close(h);
+	runq_destroy(&pool);
+}
+
+/************************************************************************
+ * Direct I/O. If the temporary filesystem doesn't support O_DIRECT, an
+ * ordinary handle stands in, which still exercises alignment checks
+ * and tail handling.
+ */
+
+#define ALIGN		4096
+#define DIRECT_SIZE	(ALIGN * 3 + 100)
+
+static struct afile direct_file;
+
+static void direct_done(struct afile *a)
+{
+	vec_done++;
+}
+
+static void test_direct(struct ioq *q)
+{
+	char path[] = "/tmp/test_afile.XXXXXX";
+	struct afile_bufpool bufs;
+	struct runq pool;
+	struct iovec v;
+	uint8_t *wbuf;
+	uint8_t *rbuf;
+	int fd;
+	int dfd;
+	int r;
+
+	printf("Direct:\n");
+
+	r = runq_init(&pool, 1);
+	assert(r >= 0);
+
+	r = afile_bufpool_init(&bufs, DIRECT_SIZE, 2, ALIGN);
+	assert(!r);
+	assert(afile_bufpool_size(&bufs) == ALIGN * 4);
+
+	wbuf = afile_bufpool_get(&bufs);
+	rbuf = afile_bufpool_get(&bufs);
+	assert(wbuf && rbuf);
+	assert(!((uintptr_t)wbuf & (ALIGN - 1)));
+	assert(!((uintptr_t)rbuf & (ALIGN - 1)));
+	assert(!afile_bufpool_get(&bufs));
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+
+	dfd = open(path, O_RDWR | O_DIRECT);
+	if (dfd < 0) {
+		printf("    O_DIRECT not supported\n");
+		dfd = dup(fd);
+		assert(dfd >= 0);
+	}
+
+	unlink(path);
+
+	afile_init(&direct_file, q, fd);
+	afile_set_pool(&direct_file, &pool);
+	afile_set_direct(&direct_file, dfd, ALIGN);
+
+	/* An unaligned tail is written via the ordinary handle */
+	memcpy(wbuf, pattern, DIRECT_SIZE);
+	vec_done = 0;
+	afile_pwrite(&direct_file, wbuf, DIRECT_SIZE, 0, direct_done);
+	run_vec(q, 1);
+	assert(!afile_write_error(&direct_file));
+	assert(afile_write_size(&direct_file) == DIRECT_SIZE);
+
+	/* Reads stop at the end of the file */
+	memset(rbuf, 0, afile_bufpool_size(&bufs));
+	afile_pread(&direct_file, rbuf, afile_bufpool_size(&bufs), 0,
+		    direct_done);
+	run_vec(q, 2);
+	assert(!afile_read_error(&direct_file));
+	assert(afile_read_size(&direct_file) == DIRECT_SIZE);
+	assert(!memcmp(rbuf, pattern, DIRECT_SIZE));
+
+	/* Unaligned offsets, buffers and segments are rejected */
+	afile_pread(&direct_file, rbuf, ALIGN, 100, direct_done);
+	run_vec(q, 3);
+	assert(afile_read_error(&direct_file) == EINVAL);
+
+	afile_pwrite(&direct_file, wbuf + 1, ALIGN, 0, direct_done);
+	run_vec(q, 4);
+	assert(afile_write_error(&direct_file) == EINVAL);
+
+	v.iov_base = rbuf;
+	v.iov_len = 100;
+	afile_preadv(&direct_file, &v, 1, 0, direct_done);
+	run_vec(q, 5);
+	assert(afile_read_error(&direct_file) == EINVAL);
+
+	afile_bufpool_put(&bufs, wbuf);
+	afile_bufpool_put(&bufs, rbuf);
+	afile_bufpool_destroy(&bufs);
+
+	afile_destroy(&direct_file);
+	close(dfd);
+	close(fd);
+	runq_destroy(&pool);
+}
+#endif
+
 int main(void)
 {
 	struct ioq ioq;
@@ -216,8 +558,13 @@ int main(void)
 		assert(r >= 0);
 	}
 
-	ioq_destroy(&ioq);
-
 	assert(!memcmp(pattern, out, N));
+
+	test_positional(&ioq);
+#ifndef __Windows__
+	test_vectored(&ioq);
+	test_direct(&ioq);
+#endif
+	ioq_destroy(&ioq);
 	return 0;
 }
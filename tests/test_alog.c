@@ -0,0 +1,185 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "alog.h"
+#include "prng.h"
+
+#define N_REC		200
+#define MAX_REC		300
+#define WINDOW_MS	5
+#define MAX_DELAY_MS	20
+
+static struct ioq q;
+static struct runq pool;
+
+static uint8_t pattern[N_REC * MAX_REC];
+static struct alog_rec recs[N_REC];
+static int done;
+
+static void rec_done(struct alog_rec *r)
+{
+	done++;
+}
+
+static void run_until(int want)
+{
+	while (done < want) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+}
+
+static void init_pattern(void)
+{
+	prng_t prng;
+	int i;
+
+	prng_init(&prng, 1);
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = prng_next(&prng);
+}
+
+static int open_temp(char *path)
+{
+	const int fd = mkstemp(path);
+
+	assert(fd >= 0);
+	return fd;
+}
+
+/* Many concurrent appends share few syncs, and land in order */
+static void test_group(void)
+{
+	char path[] = "/tmp/test_alog.XXXXXX";
+	const int fd = open_temp(path);
+	static uint8_t check[sizeof(pattern)];
+	struct alog log;
+	size_t total = 0;
+	int i;
+	int r;
+
+	printf("Group commit:\n");
+
+	/* Existing content is preserved */
+	r = write(fd, "head", 4);
+	assert(r == 4);
+
+	r = alog_init(&log, &q, &pool, fd, WINDOW_MS, MAX_DELAY_MS);
+	assert(!r);
+
+	done = 0;
+	for (i = 0; i < N_REC; i++) {
+		const size_t len = i % MAX_REC;
+
+		alog_append(&log, &recs[i], pattern + total, len, rec_done);
+		total += len;
+	}
+
+	run_until(N_REC);
+	printf("    %d records, %u syncs\n", N_REC, alog_sync_count(&log));
+	assert(alog_sync_count(&log) < 4);
+
+	total = 0;
+	for (i = 0; i < N_REC; i++) {
+		assert(!alog_rec_error(&recs[i]));
+		assert(alog_rec_offset(&recs[i]) == 4 + total);
+		total += i % MAX_REC;
+	}
+
+	r = pread(fd, check, sizeof(check), 4);
+	assert(r == total);
+	assert(!memcmp(check, pattern, total));
+
+	/* Records appended one at a time are each synced */
+	printf("Sequential:\n");
+	done = 0;
+	for (i = 0; i < 4; i++) {
+		alog_append(&log, &recs[i], pattern, 16, rec_done);
+		run_until(i + 1);
+		assert(!alog_rec_error(&recs[i]));
+		assert(alog_rec_offset(&recs[i]) == 4 + total + i * 16);
+	}
+
+	while (alog_busy(&log))
+		ioq_iterate(&q);
+
+	alog_destroy(&log);
+	close(fd);
+	unlink(path);
+}
+
+/* A failed write fails the group, and everything after it */
+static void test_error(void)
+{
+	char path[] = "/tmp/test_alog.XXXXXX";
+	const int fd = open_temp(path);
+	const int ro = open(path, O_RDONLY);
+	struct alog log;
+	int i;
+	int r;
+
+	printf("Error:\n");
+	assert(ro >= 0);
+
+	r = alog_init(&log, &q, &pool, ro, WINDOW_MS, MAX_DELAY_MS);
+	assert(!r);
+
+	done = 0;
+	for (i = 0; i < 4; i++)
+		alog_append(&log, &recs[i], pattern, 16, rec_done);
+	run_until(4);
+
+	alog_append(&log, &recs[4], pattern, 16, rec_done);
+	run_until(5);
+
+	for (i = 0; i < 5; i++)
+		assert(alog_rec_error(&recs[i]) == EBADF);
+
+	while (alog_busy(&log))
+		ioq_iterate(&q);
+
+	alog_destroy(&log);
+	close(ro);
+	close(fd);
+	unlink(path);
+}
+
+int main(void)
+{
+	int r;
+
+	init_pattern();
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	r = runq_init(&pool, 1);
+	assert(r >= 0);
+
+	test_group();
+	test_error();
+
+	runq_destroy(&pool);
+	ioq_destroy(&q);
+	return 0;
+}
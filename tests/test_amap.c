@@ -0,0 +1,143 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "amap.h"
+#include "prng.h"
+
+#define WINDOW		16384
+#define FILE_SIZE	(WINDOW * 3 + 1234)
+
+static struct runq q;
+static struct runq pool;
+static struct amap map;
+static int done;
+
+static uint8_t pattern[FILE_SIZE];
+
+static void next_done(struct amap *m)
+{
+	done = 1;
+}
+
+static void next(void)
+{
+	done = 0;
+	amap_next(&map, next_done);
+
+	while (!done)
+		runq_dispatch(&q, 0);
+}
+
+static int make_file(char *path, size_t size)
+{
+	const int fd = mkstemp(path);
+	int r;
+
+	assert(fd >= 0);
+	unlink(path);
+
+	r = write(fd, pattern, size);
+	assert(r == size);
+
+	return fd;
+}
+
+static void test_scan(void)
+{
+	char path[] = "/tmp/test_amap.XXXXXX";
+	const int fd = make_file(path, FILE_SIZE);
+	uint64_t total = 0;
+	int windows = 0;
+	int r;
+
+	printf("Scan:\n");
+	r = amap_init(&map, &q, &pool, fd, WINDOW - 100);
+	assert(!r);
+
+	for (;;) {
+		next();
+		assert(!amap_error(&map));
+		if (!amap_size(&map))
+			break;
+
+		printf("    %d bytes at %d\n",
+		       (int)amap_size(&map), (int)amap_offset(&map));
+		assert(amap_offset(&map) == total);
+		assert(!memcmp(amap_data(&map), pattern + total,
+			       amap_size(&map)));
+		total += amap_size(&map);
+		windows++;
+	}
+
+	assert(total == FILE_SIZE);
+	assert(windows == 4);
+
+	/* The end of the file is sticky */
+	next();
+	assert(!amap_size(&map));
+
+	while (amap_busy(&map))
+		runq_dispatch(&q, 0);
+
+	amap_destroy(&map);
+	close(fd);
+}
+
+static void test_empty(void)
+{
+	char path[] = "/tmp/test_amap.XXXXXX";
+	const int fd = make_file(path, 0);
+	int r;
+
+	printf("Empty:\n");
+	r = amap_init(&map, &q, &pool, fd, WINDOW);
+	assert(!r);
+
+	next();
+	assert(!amap_error(&map));
+	assert(!amap_size(&map));
+
+	amap_destroy(&map);
+	close(fd);
+}
+
+int main(void)
+{
+	prng_t prng;
+	int i;
+
+	prng_init(&prng, 1);
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = prng_next(&prng);
+
+	i = runq_init(&q, 0);
+	assert(i >= 0);
+
+	i = runq_init(&pool, 1);
+	assert(i >= 0);
+
+	test_scan();
+	test_empty();
+
+	runq_destroy(&pool);
+	runq_destroy(&q);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ameta.h"
+
+static struct runq q;
+static struct runq pool;
+static struct ameta_req req;
+static int done;
+
+static void req_done(struct ameta_req *r)
+{
+	done = 1;
+}
+
+static void run(void)
+{
+	while (!done)
+		runq_dispatch(&q, 0);
+
+	done = 0;
+}
+
+static void test_file(int dir)
+{
+	handle_t fd;
+	int r;
+
+	printf("Open/stat/close:\n");
+
+	/* A missing file can't be opened */
+	ameta_open(&req, dir, "data", O_RDONLY, 0, req_done);
+	run();
+	assert(ameta_get_error(&req) == ENOENT);
+	assert(ameta_get_fd(&req) < 0);
+
+	ameta_open(&req, dir, "data", O_RDWR | O_CREAT, 0600, req_done);
+	run();
+	assert(!ameta_get_error(&req));
+	fd = ameta_get_fd(&req);
+	assert(fd >= 0);
+
+	r = write(fd, "hello", 5);
+	assert(r == 5);
+
+	ameta_stat(&req, dir, "data", 0, req_done);
+	run();
+	assert(!ameta_get_error(&req));
+	assert(S_ISREG(ameta_get_stat(&req)->st_mode));
+	assert(ameta_get_stat(&req)->st_size == 5);
+
+	ameta_close(&req, fd, req_done);
+	run();
+	assert(!ameta_get_error(&req));
+
+	/* The handle is gone */
+	ameta_close(&req, fd, req_done);
+	run();
+	assert(ameta_get_error(&req) == EBADF);
+}
+
+static void test_batch(int dir)
+{
+	struct ameta_stat_ent ents[3];
+
+	printf("Batch:\n");
+	memset(ents, 0, sizeof(ents));
+	ents[0].path = "data";
+	ents[1].path = "missing";
+	ents[2].path = ".";
+
+	ameta_stat_batch(&req, dir, ents, 3, 0, req_done);
+	run();
+	assert(!ameta_get_error(&req));
+
+	assert(!ents[0].error);
+	assert(S_ISREG(ents[0].st.st_mode));
+	assert(ents[0].st.st_size == 5);
+
+	assert(ents[1].error == ENOENT);
+
+	assert(!ents[2].error);
+	assert(S_ISDIR(ents[2].st.st_mode));
+}
+
+int main(void)
+{
+	char path[] = "/tmp/test_ameta.XXXXXX";
+	int dir;
+	int r;
+
+	r = runq_init(&q, 0);
+	assert(r >= 0);
+
+	r = runq_init(&pool, 1);
+	assert(r >= 0);
+
+	assert(mkdtemp(path));
+	dir = open(path, O_RDONLY | O_DIRECTORY);
+	assert(dir >= 0);
+
+	ameta_req_init(&req, &pool, &q);
+	test_file(dir);
+	test_batch(dir);
+
+	r = unlinkat(dir, "data", 0);
+	assert(!r);
+	close(dir);
+	r = rmdir(path);
+	assert(!r);
+
+	runq_destroy(&pool);
+	runq_destroy(&q);
+	return 0;
+}
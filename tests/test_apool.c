@@ -0,0 +1,279 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include "apool.h"
+
+#define MAX_CONNS	2
+#define IDLE_MS		50
+#define N_SERVER	8
+
+static struct ioq q;
+
+/************************************************************************
+ * Server: counts connections and disconnections
+ */
+
+static struct asock listener;
+static struct asock server[N_SERVER];
+static uint8_t server_buf[N_SERVER];
+static int accepts;
+static int closes;
+static int closing;
+
+static void server_recv_done(struct asock *t)
+{
+	assert(!asock_get_recv_size(t));
+	closes++;
+	asock_close(t);
+}
+
+static void accept_done(struct asock *t)
+{
+	int i;
+
+	/* A cancelled accept needn't report an error */
+	if (asock_get_error(t) || closing)
+		return;
+
+	i = accepts++;
+	assert(accepts < N_SERVER);
+
+	asock_recv(&server[i], &server_buf[i], 1, server_recv_done);
+	asock_accept(&listener, &server[accepts], accept_done);
+}
+
+/************************************************************************
+ * Client
+ */
+
+static struct adns_resolver resolver;
+static struct apool pool;
+static struct apool_host host;
+static struct apool_conn conns[MAX_CONNS];
+static char service[16];
+
+static struct apool_req reqs[4];
+static int got;
+
+static void got_conn(struct apool_req *r)
+{
+	got++;
+}
+
+static void run_until(int *count, int want)
+{
+	while (*count < want) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+}
+
+static int iterate_timed_out;
+
+static void iterate_timeout(struct waitq_timer *t)
+{
+	iterate_timed_out = 1;
+}
+
+static void iterate_for(int ms)
+{
+	struct waitq_timer timer;
+
+	waitq_timer_init(&timer, ioq_waitq(&q));
+	waitq_timer_wait(&timer, ms, iterate_timeout);
+
+	iterate_timed_out = 0;
+	while (!iterate_timed_out) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+}
+
+/* Check that the server hasn't closed a connection */
+static int conn_alive(struct apool_conn *c)
+{
+	uint8_t b;
+	const int r = recv(asock_get_handle(apool_conn_sock(c)), &b, 1,
+			   MSG_PEEK | MSG_DONTWAIT);
+
+	return r < 0 && errno == EAGAIN;
+}
+
+static struct apool_conn *get(struct apool_req *r)
+{
+	const int want = got + 1;
+
+	apool_get(&host, r, got_conn);
+	run_until(&got, want);
+
+	assert(!apool_get_error(r));
+	assert(apool_get_conn(r));
+	return apool_get_conn(r);
+}
+
+static void test_pool(void)
+{
+	struct apool_conn *a;
+	struct apool_conn *b;
+	struct apool_conn *c;
+	int i;
+
+	i = apool_host_init(&host, &pool, "127.0.0.1", service,
+			    conns, MAX_CONNS, IDLE_MS);
+	assert(!i);
+	assert(apool_find(&pool, "127.0.0.1", service) == &host);
+	assert(!apool_find(&pool, "127.0.0.1", "1"));
+
+	/* A returned connection is reused */
+	printf("Reuse\n");
+	a = get(&reqs[0]);
+	run_until(&accepts, 1);
+	apool_put(a, 1);
+	assert(apool_host_idle_count(&host) == 1);
+
+	b = get(&reqs[0]);
+	assert(b == a);
+	assert(!apool_host_idle_count(&host));
+
+	/* Requests beyond the per-host limit wait for a connection */
+	printf("Limit\n");
+	c = get(&reqs[1]);
+	assert(c != b);
+	run_until(&accepts, 2);
+
+	apool_get(&host, &reqs[2], got_conn);
+	iterate_for(IDLE_MS);
+	assert(got == 3);
+
+	apool_put(c, 1);
+	run_until(&got, 4);
+	assert(apool_get_conn(&reqs[2]) == c);
+	assert(accepts == 2);
+
+	/* A broken connection is reconnected in the background */
+	printf("Reconnect\n");
+	apool_put(b, 0);
+	run_until(&accepts, 3);
+	run_until(&closes, 1);
+	while (apool_host_idle_count(&host) < 1)
+		ioq_iterate(&q);
+
+	/* Idle connections expire */
+	printf("Expiry\n");
+	apool_put(c, 1);
+	assert(apool_host_idle_count(&host) == 2);
+	run_until(&closes, 3);
+	assert(!apool_host_idle_count(&host));
+
+	/* An idle connection closed by the server is replaced */
+	printf("Dead idle connection\n");
+	a = get(&reqs[0]);
+	run_until(&accepts, 4);
+	apool_put(a, 1);
+
+	asock_close(&server[3]);
+	run_until(&closes, 4);
+	iterate_for(IDLE_MS / 5);
+	assert(apool_host_idle_count(&host) == 1);
+
+	b = get(&reqs[0]);
+	iterate_for(IDLE_MS / 5);
+	assert(accepts == 5);
+	assert(conn_alive(b));
+	apool_put(b, 1);
+
+	/* Closing fails waiting requests */
+	printf("Close\n");
+	a = get(&reqs[0]);
+	b = get(&reqs[1]);
+	apool_get(&host, &reqs[2], got_conn);
+	apool_get(&host, &reqs[3], got_conn);
+	apool_cancel(&host, &reqs[3]);
+	apool_host_close(&host);
+	run_until(&got, got + 2);
+	assert(apool_get_error(&reqs[2]) == APOOL_ERR_CLOSED);
+	assert(apool_get_error(&reqs[3]) == APOOL_ERR_CLOSED);
+	assert(!apool_get_conn(&reqs[2]));
+
+	apool_put(a, 1);
+	apool_put(b, 1);
+	run_until(&closes, 6);
+
+	while (apool_host_busy(&host))
+		ioq_iterate(&q);
+
+	apool_host_destroy(&host);
+	assert(!apool_find(&pool, "127.0.0.1", service));
+}
+
+/************************************************************************
+ * Main thread/test
+ */
+
+int main(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int i;
+
+	i = net_start();
+	assert(!i);
+
+	i = ioq_init(&q, 0);
+	assert(i >= 0);
+
+	i = adns_resolver_init(&resolver, ioq_runq(&q));
+	assert(i >= 0);
+
+	apool_init(&pool, &q, &resolver);
+	asock_init(&listener, &q);
+	for (i = 0; i < N_SERVER; i++)
+		asock_init(&server[i], &q);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	i = asock_listen(&listener, (struct sockaddr *)&addr, sizeof(addr));
+	assert(i >= 0);
+
+	i = getsockname(asock_get_handle(&listener),
+			(struct sockaddr *)&addr, &len);
+	assert(i >= 0);
+	snprintf(service, sizeof(service), "%d", ntohs(addr.sin_port));
+
+	asock_accept(&listener, &server[0], accept_done);
+	test_pool();
+
+	closing = 1;
+	asock_close(&listener);
+	iterate_for(20);
+
+	asock_destroy(&listener);
+	for (i = 0; i < N_SERVER; i++)
+		asock_destroy(&server[i]);
+
+	apool_destroy(&pool);
+	adns_resolver_destroy(&resolver);
+	ioq_destroy(&q);
+	net_stop();
+	return 0;
+}
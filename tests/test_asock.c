@@ -17,14 +17,21 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/un.h>
 #include "prng.h"
 #include "asock.h"
 
 #define N		65535
 #define MAX_WRITE	8192
 #define MAX_READ	3172
+#define N_POST		64
+#define POST_SIZE	256
 
 static uint8_t pattern[N];
+static FILE *pattern_file;
 static int is_done;
 
 /************************************************************************
@@ -34,17 +41,34 @@ static int is_done;
 static struct asock server;
 static struct asock reader;
 static int read_ptr;
+static int read_count;
 static uint8_t read_buf[MAX_READ];
+static struct iovec read_iov[2];
+static struct asock_bufpool read_pool;
+static int read_pooled;
+static uint8_t *read_held;
 
 static void do_receive(void);
 
+static void exhausted_done(struct asock *a)
+{
+	assert(asock_get_recv_error(a) == ENOBUFS);
+	assert(!asock_get_recv_data(a));
+	printf("server: pool exhausted\n");
+
+	asock_bufpool_put(&read_pool, read_held);
+	do_receive();
+}
+
 static void recv_done(struct asock *a)
 {
 	const int len = asock_get_recv_size(&reader);
+	uint8_t *data = read_pooled ? asock_get_recv_data(&reader) : read_buf;
 
 	assert(!asock_get_recv_error(&reader));
 
 	if (!len) {
+		assert(!read_pooled || !data);
 		printf("server: EOF\n");
 		assert(read_ptr == N);
 		asock_close(&reader);
@@ -55,15 +79,42 @@ static void recv_done(struct asock *a)
 	printf("server: read %d bytes\n", len);
 
 	assert(len <= N - read_ptr);
-	assert(!memcmp(pattern + read_ptr, read_buf, len));
+	assert(!memcmp(pattern + read_ptr, data, len));
 	read_ptr += len;
 
+	/* Hold the first pooled buffer while asking for more, so that
+	 * the next receive finds the pool exhausted.
+	 */
+	if (read_pooled && !read_held) {
+		read_held = data;
+		asock_recv_pooled(&reader, &read_pool, exhausted_done);
+		return;
+	}
+
+	if (read_pooled)
+		asock_bufpool_put(&read_pool, data);
+
 	do_receive();
 }
 
 static void do_receive(void)
 {
-	asock_recv(&reader, read_buf, sizeof(read_buf), recv_done);
+	/* Cycle through flat, vectored and pooled reads */
+	const int mode = read_count++ % 3;
+
+	read_pooled = (mode == 2);
+
+	if (read_pooled) {
+		asock_recv_pooled(&reader, &read_pool, recv_done);
+	} else if (mode == 1) {
+		read_iov[0].iov_base = read_buf;
+		read_iov[0].iov_len = 1000;
+		read_iov[1].iov_base = read_buf + 1000;
+		read_iov[1].iov_len = sizeof(read_buf) - 1000;
+		asock_recvv(&reader, read_iov, 2, recv_done);
+	} else {
+		asock_recv(&reader, read_buf, sizeof(read_buf), recv_done);
+	}
 }
 
 static void accept_done(struct asock *a)
@@ -73,19 +124,20 @@ static void accept_done(struct asock *a)
 	do_receive();
 }
 
-static void reader_init(struct ioq *q)
+static void reader_init(struct ioq *q, const struct sockaddr *sa,
+			size_t sa_len)
 {
-	struct sockaddr_in addr;
 	int i;
 
+	read_ptr = 0;
+	read_count = 0;
+	read_held = NULL;
+	is_done = 0;
+
 	asock_init(&server, q);
 	asock_init(&reader, q);
 
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons(50999);
-
-	i = asock_listen(&server, (struct sockaddr *)&addr, sizeof(addr));
+	i = asock_listen(&server, sa, sa_len);
 	assert(i >= 0);
 
 	printf("server: Accepting...\n");
@@ -104,7 +156,11 @@ static void reader_exit(void)
 
 static struct asock writer;
 static int write_ptr;
-static struct sockaddr_in peer;
+static int write_count;
+static int write_vectored;
+static int write_req;
+static struct iovec write_iov[3];
+static struct asock_msg posts[N_POST];
 
 static void begin_write(void);
 
@@ -115,6 +171,25 @@ static void write_done(struct asock *a)
 	assert(!asock_get_send_error(&writer));
 
 	printf("client: Sent %d bytes\n", len);
+	assert(len <= write_req);
+
+	/* Zero-copy sends complete only once the kernel is done */
+	assert(asock_get_zerocopy_done(&writer) ==
+	       asock_get_zerocopy_sent(&writer));
+
+	if (write_vectored) {
+		size_t offset;
+		int i = asock_iov_split(write_iov, 3, len, &offset);
+		size_t total = offset;
+
+		while (i > 0)
+			total += write_iov[--i].iov_len;
+
+		assert(total == len);
+	} else if (write_count % 3 == 2) {
+		assert(asock_get_send_offset(&writer) == write_ptr + len);
+	}
+
 	write_ptr += len;
 	begin_write();
 }
@@ -128,34 +203,88 @@ static void begin_write(void)
 
 	assert(len >= 0);
 
-	if (len) {
+	write_count++;
+	write_vectored = len >= 3 && (write_count % 3 == 1);
+
+	/* A file send follows each vectored send, and is shorter, so
+	 * that nothing can be carried over from the previous request.
+	 */
+	if (len && write_count % 3 == 2) {
+		if (len > 1)
+			len /= 2;
+
+		write_req = len;
+		printf("client: Sending %d bytes from file\n", len);
+		asock_sendfile(&writer, fileno(pattern_file), write_ptr, len,
+			       write_done);
+	} else if (write_vectored) {
+		const int seg = len / 3;
+
+		write_req = len;
+		printf("client: Sending %d bytes in 3 segments\n", len);
+		write_iov[0].iov_base = pattern + write_ptr;
+		write_iov[0].iov_len = seg;
+		write_iov[1].iov_base = pattern + write_ptr + seg;
+		write_iov[1].iov_len = seg;
+		write_iov[2].iov_base = pattern + write_ptr + seg * 2;
+		write_iov[2].iov_len = len - seg * 2;
+		asock_sendv(&writer, write_iov, 3, write_done);
+	} else if (len) {
+		write_req = len;
 		printf("client: Sending %d bytes\n", len);
 		asock_send(&writer, pattern + write_ptr, len, write_done);
 	} else {
-		printf("client: Close\n");
+		printf("client: Close (%d zero-copy sends)\n",
+		       (int)asock_get_zerocopy_sent(&writer));
 		asock_close(&writer);
 	}
 }
 
+static void post_done(struct asock_msg *m)
+{
+	int i;
+
+	assert(m == &posts[N_POST - 1]);
+
+	for (i = 0; i < N_POST; i++) {
+		assert(!asock_msg_error(&posts[i]));
+		assert(asock_msg_sent(&posts[i]) == POST_SIZE);
+	}
+
+	printf("client: Posted %d messages\n", N_POST);
+	write_ptr += N_POST * POST_SIZE;
+	begin_write();
+}
+
 static void connect_done(struct asock *a)
 {
+	int i;
+
 	assert(!asock_get_error(&writer));
 	printf("client: Connected\n");
 
-	begin_write();
+	/* Large writes go via zero-copy, where supported */
+	if (asock_set_zerocopy(&writer, 4096) < 0)
+		printf("client: zero-copy not supported\n");
+
+	/* Queue many small messages, and ask for notification only on
+	 * the last.
+	 */
+	for (i = 0; i < N_POST; i++)
+		asock_post(&writer, &posts[i], pattern + i * POST_SIZE,
+			   POST_SIZE, i == N_POST - 1 ? post_done : NULL);
 }
 
-static void writer_init(struct ioq *q)
+static void writer_init(struct ioq *q, const struct sockaddr *sa,
+			size_t sa_len)
 {
+	write_ptr = 0;
+	write_count = 0;
+
 	asock_init(&writer, q);
 	printf("client: Connecting...\n");
 
-	peer.sin_family = AF_INET;
-	peer.sin_addr.s_addr = inet_addr("127.0.0.1");
-	peer.sin_port = htons(50999);
-
-	asock_connect(&writer, (struct sockaddr *)&peer, sizeof(peer),
-		      connect_done);
+	asock_connect(&writer, sa, sa_len, connect_done);
 }
 
 static void writer_exit(void)
@@ -164,44 +293,1144 @@ static void writer_exit(void)
 }
 
 /************************************************************************
- * Main thread/test
+ * Multi-accept with a listener group
  */
 
-static void init_pattern(void)
+#define N_LISTENERS	2
+#define N_CLIENTS	8
+
+static struct asock listeners[N_LISTENERS];
+static struct asock accepted[N_LISTENERS][N_CLIENTS];
+static struct asock clients[N_CLIENTS];
+static int accept_total;
+static int connect_total;
+
+static void group_accept_done(struct asock *a)
 {
+	const int n = asock_get_accept_count(a);
+	const int k = a - listeners;
 	int i;
-	prng_t prng;
 
-	prng_init(&prng, 1);
-	for (i = 0; i < sizeof(pattern); i++)
-		pattern[i] = prng_next(&prng);
+	assert(!asock_get_error(a));
+	assert(n > 0);
+
+	printf("listener %d: accepted %d\n", k, n);
+
+	for (i = 0; i < n; i++)
+		asock_close(&accepted[k][i]);
+
+	accept_total += n;
+	if (accept_total < N_CLIENTS)
+		asock_accept_many(a, accepted[k], N_CLIENTS, group_accept_done);
 }
 
-int main(void)
+static void group_connect_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	connect_total++;
+}
+
+static void test_group(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct ioq q;
+	int i, j;
+
+	printf("Listener group:\n");
+
+	i = ioq_init(&q, 0);
+	assert(i >= 0);
+
+	for (i = 0; i < N_LISTENERS; i++) {
+		asock_init(&listeners[i], &q);
+		for (j = 0; j < N_CLIENTS; j++)
+			asock_init(&accepted[i][j], &q);
+	}
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	i = asock_listen_group(listeners, N_LISTENERS,
+			       (struct sockaddr *)&addr, sizeof(addr));
+	assert(i >= 0);
+
+	i = getsockname(asock_get_handle(&listeners[0]),
+			(struct sockaddr *)&addr, &len);
+	assert(i >= 0);
+
+	for (i = 0; i < N_LISTENERS; i++)
+		asock_accept_many(&listeners[i], accepted[i], N_CLIENTS,
+				  group_accept_done);
+
+	for (i = 0; i < N_CLIENTS; i++) {
+		asock_init(&clients[i], &q);
+		asock_connect(&clients[i], (struct sockaddr *)&addr,
+			      sizeof(addr), group_connect_done);
+	}
+
+	while (accept_total < N_CLIENTS || connect_total < N_CLIENTS) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+
+	assert(accept_total == N_CLIENTS);
+
+	for (i = 0; i < N_CLIENTS; i++)
+		asock_destroy(&clients[i]);
+
+	for (i = 0; i < N_LISTENERS; i++) {
+		for (j = 0; j < N_CLIENTS; j++)
+			asock_destroy(&accepted[i][j]);
+		asock_destroy(&listeners[i]);
+	}
+
+	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * Relay through a splice proxy
+ */
+
+static struct asock px_listener;
+static struct asock px_client;
+static struct asock px_server;
+static struct asock px_a;
+static struct asock px_b;
+static struct asock_proxy proxy;
+static int px_events;
+static int px_sent;
+static int px_received;
+static int px_replied;
+static int px_reply_received;
+static uint8_t px_reply_buf[MAX_READ];
+static int proxy_done_flag;
+
+static void px_event(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	px_events++;
+}
+
+static void px_reply_recv_done(struct asock *a)
+{
+	const int len = asock_get_recv_size(a);
+
+	assert(!asock_get_recv_error(a));
+
+	if (!len) {
+		printf("proxy: client EOF after %d bytes\n",
+		       px_reply_received);
+		assert(px_reply_received == N);
+		asock_close(a);
+		return;
+	}
+
+	assert(px_reply_received + len <= N);
+	assert(!memcmp(pattern + px_reply_received, px_reply_buf, len));
+	px_reply_received += len;
+
+	asock_recv(a, px_reply_buf, sizeof(px_reply_buf),
+		   px_reply_recv_done);
+}
+
+static void px_send_done(struct asock *a)
+{
+	assert(!asock_get_send_error(a));
+	px_sent += asock_get_send_size(a);
+
+	if (px_sent < N) {
+		asock_send(a, pattern + px_sent, N - px_sent, px_send_done);
+		return;
+	}
+
+	/* Half-close, and wait for the reply */
+	shutdown(asock_get_handle(a), SHUT_WR);
+	asock_recv(a, px_reply_buf, sizeof(px_reply_buf),
+		   px_reply_recv_done);
+}
+
+static void px_reply_done(struct asock *a)
+{
+	assert(!asock_get_send_error(a));
+	px_replied += asock_get_send_size(a);
+
+	/* The last of the reply arrives at the proxy with the FIN */
+	if (px_replied < N)
+		asock_send(a, pattern + px_replied, N - px_replied,
+			   px_reply_done);
+	else
+		asock_close(a);
+}
+
+static void px_recv_done(struct asock *a)
+{
+	const int len = asock_get_recv_size(a);
+
+	assert(!asock_get_recv_error(a));
+
+	if (!len) {
+		printf("proxy: server EOF after %d bytes\n", px_received);
+		assert(px_received == N);
+		asock_send(a, pattern, N, px_reply_done);
+		return;
+	}
+
+	assert(px_received + len <= N);
+	assert(!memcmp(pattern + px_received, read_buf, len));
+	px_received += len;
+
+	asock_recv(a, read_buf, sizeof(read_buf), px_recv_done);
+}
+
+static void proxy_done(struct asock_proxy *p)
+{
+	printf("proxy: done, %d/%d bytes relayed\n",
+	       (int)asock_proxy_count(p, ASOCK_PROXY_A_TO_B),
+	       (int)asock_proxy_count(p, ASOCK_PROXY_B_TO_A));
+
+	assert(!asock_proxy_error(p, ASOCK_PROXY_A_TO_B));
+	assert(!asock_proxy_error(p, ASOCK_PROXY_B_TO_A));
+	assert(asock_proxy_count(p, ASOCK_PROXY_A_TO_B) == N);
+	assert(asock_proxy_count(p, ASOCK_PROXY_B_TO_A) == N);
+
+	asock_close(&px_a);
+	asock_close(&px_b);
+	proxy_done_flag = 1;
+}
+
+static void px_wait(struct ioq *q, int events)
+{
+	while (px_events < events) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+}
+
+static void test_proxy(void)
 {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
 	struct ioq q;
 	int r;
 
-	init_pattern();
+	printf("Proxy:\n");
 
-	r = net_start();
+	r = ioq_init(&q, 0);
 	assert(r >= 0);
 
-	r = ioq_init(&q, 0);
+	asock_init(&px_listener, &q);
+	asock_init(&px_client, &q);
+	asock_init(&px_server, &q);
+	asock_init(&px_a, &q);
+	asock_init(&px_b, &q);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	r = asock_listen(&px_listener, (struct sockaddr *)&addr,
+			 sizeof(addr));
 	assert(r >= 0);
 
-	reader_init(&q);
-	writer_init(&q);
+	r = getsockname(asock_get_handle(&px_listener),
+			(struct sockaddr *)&addr, &len);
+	assert(r >= 0);
 
-	while (!is_done) {
-		const int r = ioq_iterate(&q);
+	/* client <-> a, then b <-> server */
+	asock_accept(&px_listener, &px_a, px_event);
+	asock_connect(&px_client, (struct sockaddr *)&addr, sizeof(addr),
+		      px_event);
+	px_wait(&q, 2);
+
+	asock_accept(&px_listener, &px_server, px_event);
+	asock_connect(&px_b, (struct sockaddr *)&addr, sizeof(addr),
+		      px_event);
+	px_wait(&q, 4);
+
+	r = asock_proxy(&proxy, &px_a, &px_b, proxy_done);
+	assert(r >= 0);
 
+	asock_send(&px_client, pattern, N, px_send_done);
+	asock_recv(&px_server, read_buf, sizeof(read_buf), px_recv_done);
+
+	while (!proxy_done_flag || asock_get_handle(&px_server) >= 0 ||
+	       asock_get_handle(&px_client) >= 0) {
+		r = ioq_iterate(&q);
 		assert(r >= 0);
 	}
 
-	writer_exit();
-	reader_exit();
+	assert(px_received == N);
+	assert(px_reply_received == N);
+
+	asock_destroy(&px_listener);
+	asock_destroy(&px_client);
+	asock_destroy(&px_server);
+	asock_destroy(&px_a);
+	asock_destroy(&px_b);
 	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * Iterate for a fixed time
+ */
+
+static int iterate_timed_out;
+
+static void iterate_timeout(struct waitq_timer *t)
+{
+	iterate_timed_out = 1;
+}
+
+static void iterate_for(struct ioq *q, int ms)
+{
+	struct waitq_timer timer;
+
+	waitq_timer_init(&timer, ioq_waitq(q));
+	waitq_timer_wait(&timer, ms, iterate_timeout);
+
+	iterate_timed_out = 0;
+	while (!iterate_timed_out) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+}
+
+/************************************************************************
+ * Admission control
+ */
+
+#define N_LOAD		2
+
+static struct runq ol_queue;
+static struct runq_task ol_tasks[N_LOAD];
+static struct overload ol_detector;
+static struct asock ol_listener;
+static struct asock ol_accepted;
+static struct asock ol_client;
+static uint8_t ol_buf[16];
+static int ol_accepts;
+static int ol_connects;
+static int ol_resets;
+
+static void ol_task(struct runq_task *t)
+{
+}
+
+/* The detector watches a private run queue, which is loaded or drained
+ * by the test.
+ */
+static void ol_load(void)
+{
+	int i;
+
+	for (i = 0; i < N_LOAD; i++)
+		runq_task_exec(&ol_tasks[i], ol_task);
+
+	assert(overload_check(&ol_detector));
+}
+
+static void ol_drain(void)
+{
+	runq_dispatch(&ol_queue, 0);
+	assert(!overload_check(&ol_detector));
+}
+
+static void ol_accept_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	ol_accepts++;
+}
+
+static void ol_connect_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	ol_connects++;
+}
+
+static void ol_recv_done(struct asock *a)
+{
+	assert(asock_get_recv_error(a) == ECONNRESET);
+	ol_resets++;
+}
+
+/* Depending on timing, the reset may be seen by the connect or by the
+ * first receive.
+ */
+static void ol_shed_connect_done(struct asock *a)
+{
+	if (asock_get_error(a)) {
+		assert(asock_get_error(a) == ECONNRESET);
+		ol_resets++;
+		return;
+	}
+
+	asock_recv(a, ol_buf, sizeof(ol_buf), ol_recv_done);
+}
+
+static void ol_start(struct ioq *q, struct sockaddr_in *addr, int mode)
+{
+	socklen_t len = sizeof(*addr);
+	int r;
+
+	asock_init(&ol_listener, q);
+	asock_init(&ol_accepted, q);
+	asock_init(&ol_client, q);
+	ol_accepts = 0;
+	ol_connects = 0;
+	ol_resets = 0;
+
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr->sin_port = 0;
+
+	r = asock_listen(&ol_listener, (struct sockaddr *)addr,
+			 sizeof(*addr));
+	assert(r >= 0);
+
+	r = getsockname(asock_get_handle(&ol_listener),
+			(struct sockaddr *)addr, &len);
+	assert(r >= 0);
+
+	asock_set_overload(&ol_listener, &ol_detector, mode);
+}
+
+static void ol_finish(struct ioq *q)
+{
+	asock_close(&ol_listener);
+	asock_close(&ol_accepted);
+	asock_close(&ol_client);
+	iterate_for(q, 20);
+
+	asock_destroy(&ol_listener);
+	asock_destroy(&ol_accepted);
+	asock_destroy(&ol_client);
+}
+
+/* A paused listener leaves the connection in the backlog, and picks it
+ * up once the overload clears.
+ */
+static void test_overload_pause(struct ioq *q)
+{
+	struct sockaddr_in addr;
+
+	printf("Overload (pause):\n");
+	ol_start(q, &addr, ASOCK_OVERLOAD_PAUSE);
+	ol_load();
+
+	asock_accept(&ol_listener, &ol_accepted, ol_accept_done);
+	asock_connect(&ol_client, (struct sockaddr *)&addr, sizeof(addr),
+		      ol_connect_done);
+
+	iterate_for(q, ASOCK_OVERLOAD_RETRY * 5);
+	assert(ol_connects == 1);
+	assert(!ol_accepts);
+
+	ol_drain();
+	iterate_for(q, ASOCK_OVERLOAD_RETRY * 5);
+	assert(ol_accepts == 1);
+	assert(asock_get_accept_count(&ol_listener) == 1);
+	assert(asock_get_handle(&ol_accepted) >= 0);
+
+	ol_finish(q);
+}
+
+/* A shedding listener resets the client, without reporting it. */
+static void test_overload_shed(struct ioq *q)
+{
+	struct sockaddr_in addr;
+
+	printf("Overload (shed):\n");
+	ol_start(q, &addr, ASOCK_OVERLOAD_SHED);
+	ol_load();
+
+	asock_accept(&ol_listener, &ol_accepted, ol_accept_done);
+	asock_connect(&ol_client, (struct sockaddr *)&addr, sizeof(addr),
+		      ol_shed_connect_done);
+
+	while (!ol_resets) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+
+	assert(!ol_accepts);
+
+	/* Once drained, the next client is accepted */
+	ol_drain();
+	asock_connect(&ol_client, (struct sockaddr *)&addr, sizeof(addr),
+		      ol_connect_done);
+	while (!ol_accepts) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+
+	assert(asock_get_handle(&ol_accepted) >= 0);
+	ol_finish(q);
+}
+
+/* Closing a paused listener completes the accept, and leaves the
+ * client untouched.
+ */
+static void test_overload_close(struct ioq *q)
+{
+	struct sockaddr_in addr;
+
+	printf("Overload (close while paused):\n");
+	ol_start(q, &addr, ASOCK_OVERLOAD_PAUSE);
+	ol_load();
+
+	asock_accept(&ol_listener, &ol_accepted, ol_accept_done);
+	iterate_for(q, ASOCK_OVERLOAD_RETRY * 2);
+	assert(!ol_accepts);
+
+	asock_close(&ol_listener);
+	while (!ol_accepts) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+
+	assert(!asock_get_accept_count(&ol_listener));
+	assert(asock_get_handle(&ol_accepted) < 0);
+
+	ol_drain();
+	ol_finish(q);
+}
+
+static void test_overload(void)
+{
+	struct ioq q;
+	int i;
+
+	i = ioq_init(&q, 0);
+	assert(i >= 0);
+
+	runq_init(&ol_queue, 0);
+	overload_init(&ol_detector, &ol_queue, 1, 0);
+	for (i = 0; i < N_LOAD; i++)
+		runq_task_init(&ol_tasks[i], &ol_queue);
+
+	test_overload_pause(&q);
+	test_overload_shed(&q);
+	test_overload_close(&q);
+
+	overload_destroy(&ol_detector);
+	runq_destroy(&ol_queue);
+	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * Closing during a zero-copy send
+ */
+
+#define ZC_SIZE		(1 << 20)
+
+static uint8_t zc_data[ZC_SIZE];
+static struct asock zc_listener;
+static struct asock zc_server;
+static struct asock zc_client;
+static int zc_events;
+static int zc_completed;
+static neterr_t zc_error;
+
+static void zc_event(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	zc_events++;
+}
+
+static void zc_send_done(struct asock *a)
+{
+	zc_error = asock_get_send_error(a);
+	zc_completed++;
+}
+
+static void test_zerocopy_close(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int rcvbuf = 4096;
+	struct ioq q;
+	int r;
+
+	printf("Close during zero-copy send:\n");
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	asock_init(&zc_listener, &q);
+	asock_init(&zc_server, &q);
+	asock_init(&zc_client, &q);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	r = asock_listen(&zc_listener, (struct sockaddr *)&addr,
+			 sizeof(addr));
+	assert(r >= 0);
+
+	r = getsockname(asock_get_handle(&zc_listener),
+			(struct sockaddr *)&addr, &len);
+	assert(r >= 0);
+
+	/* The server never reads, and its window is small, so most of
+	 * the data stays queued in the client and the kernel can't
+	 * release the buffer.
+	 */
+	setsockopt(asock_get_handle(&zc_listener), SOL_SOCKET, SO_RCVBUF,
+		   &rcvbuf, sizeof(rcvbuf));
+
+	asock_accept(&zc_listener, &zc_server, zc_event);
+	asock_connect(&zc_client, (struct sockaddr *)&addr, sizeof(addr),
+		      zc_event);
+	while (zc_events < 2) {
+		r = ioq_iterate(&q);
+		assert(r >= 0);
+	}
+
+	if (asock_set_zerocopy(&zc_client, 1) < 0) {
+		printf("  zero-copy not supported\n");
+	} else {
+		asock_send(&zc_client, zc_data, sizeof(zc_data),
+			   zc_send_done);
+		iterate_for(&q, 50);
+
+		assert(!zc_completed);
+		assert(asock_get_zerocopy_sent(&zc_client) == 1);
+		assert(!asock_get_zerocopy_done(&zc_client));
+
+		asock_close(&zc_client);
+		while (!zc_completed) {
+			r = ioq_iterate(&q);
+			assert(r >= 0);
+		}
+
+		printf("  send error: %d\n", zc_error);
+		assert(zc_error == ECANCELED);
+	}
+
+	asock_close(&zc_listener);
+	asock_close(&zc_server);
+	asock_close(&zc_client);
+	iterate_for(&q, 20);
+
+	asock_destroy(&zc_listener);
+	asock_destroy(&zc_server);
+	asock_destroy(&zc_client);
+	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * Optimistic send and receive. The ioq's run queue is dispatched
+ * without polling, so that an operation is seen to complete only if it
+ * didn't have to wait for readiness.
+ */
+
+#define OPT_SIZE	65536
+
+static uint8_t opt_buf[OPT_SIZE];
+static struct asock opt_listener;
+static struct asock opt_server;
+static struct asock opt_client;
+static int opt_events;
+static int opt_sent;
+static int opt_received;
+
+static void opt_event(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	opt_events++;
+}
+
+static void opt_send_done(struct asock *a)
+{
+	assert(!asock_get_send_error(a));
+	opt_sent++;
+}
+
+static void opt_recv_done(struct asock *a)
+{
+	assert(!asock_get_recv_error(a));
+	opt_received++;
+}
+
+static void test_optimistic(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct pollfd pfd;
+	int sndbuf = 4096;
+	struct ioq q;
+	int r;
+	int i;
+
+	printf("Optimistic send/recv:\n");
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	asock_init(&opt_listener, &q);
+	asock_init(&opt_server, &q);
+	asock_init(&opt_client, &q);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	r = asock_listen(&opt_listener, (struct sockaddr *)&addr,
+			 sizeof(addr));
+	assert(r >= 0);
+	r = getsockname(asock_get_handle(&opt_listener),
+			(struct sockaddr *)&addr, &len);
+	assert(r >= 0);
+
+	asock_accept(&opt_listener, &opt_server, opt_event);
+	asock_connect(&opt_client, (struct sockaddr *)&addr, sizeof(addr),
+		      opt_event);
+	while (opt_events < 2) {
+		r = ioq_iterate(&q);
+		assert(r >= 0);
+	}
+
+	/* Data already buffered is received without a wait, and the
+	 * callback isn't invoked from within asock_recv().
+	 */
+	r = send(asock_get_handle(&opt_server), pattern, 16, 0);
+	assert(r == 16);
+
+	pfd.fd = asock_get_handle(&opt_client);
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, 1000);
+	assert(r == 1);
+
+	asock_recv(&opt_client, opt_buf, sizeof(opt_buf), opt_recv_done);
+	assert(!opt_received);
+	runq_dispatch(ioq_runq(&q), 0);
+	assert(opt_received == 1);
+	assert(asock_get_recv_size(&opt_client) == 16);
+	assert(!memcmp(opt_buf, pattern, 16));
+
+	/* Likewise for a send with room in the socket buffer */
+	asock_send(&opt_client, pattern, 16, opt_send_done);
+	assert(!opt_sent);
+	runq_dispatch(ioq_runq(&q), 0);
+	assert(opt_sent == 1);
+	assert(asock_get_send_size(&opt_client) == 16);
+
+	/* The server doesn't read, so the client's buffer fills, and a
+	 * send eventually has to wait.
+	 */
+	setsockopt(asock_get_handle(&opt_client), SOL_SOCKET, SO_SNDBUF,
+		   &sndbuf, sizeof(sndbuf));
+
+	for (i = 0; i < 1000; i++) {
+		opt_sent = 0;
+		asock_send(&opt_client, opt_buf, sizeof(opt_buf),
+			   opt_send_done);
+		assert(!opt_sent);
+		runq_dispatch(ioq_runq(&q), 0);
+
+		if (!opt_sent)
+			break;
+	}
+
+	printf("  %d sends before waiting\n", i);
+	assert(i < 1000);
+
+	iterate_for(&q, 20);
+	assert(!opt_sent);
+
+	/* Draining the server makes room, and the send completes */
+	while (!opt_sent) {
+		uint8_t sink[4096];
+
+		while (recv(asock_get_handle(&opt_server), sink, sizeof(sink),
+			    MSG_DONTWAIT) > 0)
+			;
+
+		iterate_for(&q, 10);
+	}
+
+	assert(asock_get_send_size(&opt_client) > 0);
+
+	asock_close(&opt_listener);
+	asock_close(&opt_server);
+	asock_close(&opt_client);
+	iterate_for(&q, 20);
+
+	asock_destroy(&opt_listener);
+	asock_destroy(&opt_server);
+	asock_destroy(&opt_client);
+	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * Main thread/test
+ */
+
+static void init_pattern(void)
+{
+	int i;
+	prng_t prng;
+
+	prng_init(&prng, 1);
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = prng_next(&prng);
+
+	pattern_file = tmpfile();
+	assert(pattern_file);
+	i = fwrite(pattern, sizeof(pattern), 1, pattern_file);
+	assert(i == 1);
+	fflush(pattern_file);
+}
+
+static void run_test(const struct sockaddr *listen_sa,
+		     const struct sockaddr *connect_sa, size_t sa_len)
+{
+	struct ioq q;
+	int r;
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	reader_init(&q, listen_sa, sa_len);
+	writer_init(&q, connect_sa, sa_len);
+
+	while (!is_done) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+
+	writer_exit();
+	reader_exit();
+	ioq_destroy(&q);
+}
+
+static void test_inet(void)
+{
+	struct sockaddr_in any;
+	struct sockaddr_in peer;
+
+	printf("AF_INET:\n");
+
+	any.sin_family = AF_INET;
+	any.sin_addr.s_addr = INADDR_ANY;
+	any.sin_port = htons(50999);
+
+	peer.sin_family = AF_INET;
+	peer.sin_addr.s_addr = inet_addr("127.0.0.1");
+	peer.sin_port = htons(50999);
+
+	run_test((struct sockaddr *)&any, (struct sockaddr *)&peer,
+		 sizeof(peer));
+}
+
+static void test_unix(void)
+{
+	struct sockaddr_un addr;
+
+	printf("AF_UNIX:\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path),
+		 "/tmp/test_asock.%d", (int)getpid());
+	unlink(addr.sun_path);
+
+	run_test((struct sockaddr *)&addr, (struct sockaddr *)&addr,
+		 sizeof(addr));
+	unlink(addr.sun_path);
+}
+
+static void test_inet6(void)
+{
+	struct sockaddr_in6 addr;
+	int probe;
+
+	printf("AF_INET6:\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_loopback;
+
+	/* Skip if the loopback interface has no IPv6 address */
+	probe = socket(AF_INET6, SOCK_STREAM, 0);
+	if (probe < 0 ||
+	    bind(probe, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("  not available\n");
+		if (probe >= 0)
+			close(probe);
+		return;
+	}
+
+	close(probe);
+
+	addr.sin6_port = htons(50998);
+	run_test((struct sockaddr *)&addr, (struct sockaddr *)&addr,
+		 sizeof(addr));
+}
+
+/************************************************************************
+ * Fast open and deferred accept
+ */
+
+#define FO_DELAY_MS	100
+
+static struct asock fo_listener;
+static struct asock fo_accepted;
+static struct asock fo_client;
+static struct waitq_timer fo_timer;
+static const uint8_t fo_request[] = "request";
+static uint8_t fo_buf[sizeof(fo_request)];
+static size_t fo_received;
+static int fo_connected;
+static clock_ticks_t fo_connect_time;
+static clock_ticks_t fo_accept_time;
+
+static void fo_recv_done(struct asock *a)
+{
+	const size_t len = asock_get_recv_size(a);
+
+	assert(!asock_get_recv_error(a));
+	assert(len);
+
+	fo_received += len;
+	if (fo_received < sizeof(fo_buf)) {
+		asock_recv(a, fo_buf + fo_received,
+			   sizeof(fo_buf) - fo_received, fo_recv_done);
+		return;
+	}
+
+	assert(!memcmp(fo_buf, fo_request, sizeof(fo_buf)));
+}
+
+static void fo_accept_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	fo_accept_time = clock_now();
+
+	asock_recv(&fo_accepted, fo_buf, sizeof(fo_buf), fo_recv_done);
+}
+
+static void fo_send_done(struct asock *a)
+{
+	assert(!asock_get_send_error(a));
+}
+
+/* Send whatever didn't go with the SYN */
+static void fo_send_rest(void)
+{
+	const size_t sent = asock_get_connect_sent(&fo_client);
+
+	assert(sent <= sizeof(fo_request));
+	if (sent < sizeof(fo_request))
+		asock_send(&fo_client, fo_request + sent,
+			   sizeof(fo_request) - sent, fo_send_done);
+}
+
+static void fo_timer_done(struct waitq_timer *t)
+{
+	fo_send_rest();
+}
+
+static void fo_delayed_connect_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	fo_connected = 1;
+	fo_connect_time = clock_now();
+	waitq_timer_wait(&fo_timer, FO_DELAY_MS, fo_timer_done);
+}
+
+static void fo_connect_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	printf("  %d bytes sent with connect\n", (int)asock_get_connect_sent(a));
+	fo_connected = 1;
+	fo_send_rest();
+}
+
+static void fo_run(struct ioq *q)
+{
+	fo_received = 0;
+	fo_connected = 0;
+	asock_accept(&fo_listener, &fo_accepted, fo_accept_done);
+
+	/* The request may arrive before the client learns that it's
+	 * connected.
+	 */
+	while (!fo_connected || fo_received < sizeof(fo_buf)) {
+		const int r = ioq_iterate(q);
+
+		assert(r >= 0);
+	}
+
+	asock_close(&fo_accepted);
+	asock_close(&fo_client);
+}
+
+static void test_fastopen(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct ioq q;
+	int r;
+	int i;
+
+	printf("Fast open and deferred accept:\n");
+
+	r = ioq_init(&q, 0);
+	assert(r >= 0);
+
+	asock_init(&fo_listener, &q);
+	asock_init(&fo_accepted, &q);
+	asock_init(&fo_client, &q);
+	waitq_timer_init(&fo_timer, ioq_waitq(&q));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	r = asock_listen(&fo_listener, (struct sockaddr *)&addr, sizeof(addr));
+	assert(r >= 0);
+	r = getsockname(asock_get_handle(&fo_listener),
+			(struct sockaddr *)&addr, &len);
+	assert(r >= 0);
+
+	r = asock_set_fastopen(&fo_listener, 16);
+	assert(r >= 0);
+	r = asock_set_defer_accept(&fo_listener, 5);
+	assert(r >= 0);
+
+	/* The accept waits for the request, not the handshake */
+	asock_connect(&fo_client, (struct sockaddr *)&addr, sizeof(addr),
+		      fo_delayed_connect_done);
+	fo_run(&q);
+	printf("  accepted after %d ms\n",
+	       (int)(fo_accept_time - fo_connect_time));
+	assert(fo_accept_time - fo_connect_time >= FO_DELAY_MS / 2);
+
+	/* The first connection obtains a cookie, if the system allows
+	 * server-side fast open. The rest may send data with the SYN.
+	 */
+	for (i = 0; i < 2; i++) {
+		asock_connect_data(&fo_client, (struct sockaddr *)&addr,
+				   sizeof(addr), fo_request,
+				   sizeof(fo_request), fo_connect_done);
+		fo_run(&q);
+	}
+
+	asock_close(&fo_listener);
+
+	asock_destroy(&fo_listener);
+	asock_destroy(&fo_accepted);
+	asock_destroy(&fo_client);
+	ioq_destroy(&q);
+}
+
+/************************************************************************
+ * AF_UNIX connect with a full backlog
+ */
+
+#define N_BACKLOG	8
+
+static struct asock backlog_clients[N_BACKLOG];
+static int backlog_done;
+static int backlog_refused;
+
+static void backlog_connect_done(struct asock *a)
+{
+	const neterr_t err = asock_get_error(a);
+
+	assert(!err || err == EAGAIN);
+	if (err)
+		backlog_refused++;
+
+	backlog_done++;
+}
+
+static void test_unix_backlog(void)
+{
+	struct sockaddr_un addr;
+	struct ioq q;
+	int fd;
+	int i;
+
+	printf("AF_UNIX with full backlog:\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path),
+		 "/tmp/test_asock_backlog.%d", (int)getpid());
+	unlink(addr.sun_path);
+
+	/* A listener which never accepts, and queues at most one */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	i = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(i >= 0);
+	i = listen(fd, 0);
+	assert(i >= 0);
+
+	i = ioq_init(&q, 0);
+	assert(i >= 0);
+
+	/* Every attempt must complete, rather than waiting for room */
+	for (i = 0; i < N_BACKLOG; i++) {
+		asock_init(&backlog_clients[i], &q);
+		asock_connect(&backlog_clients[i], (struct sockaddr *)&addr,
+			      sizeof(addr), backlog_connect_done);
+	}
+
+	while (backlog_done < N_BACKLOG) {
+		const int r = ioq_iterate(&q);
+
+		assert(r >= 0);
+	}
+
+	printf("  %d of %d refused\n", backlog_refused, N_BACKLOG);
+	assert(backlog_refused > 0);
+
+	for (i = 0; i < N_BACKLOG; i++) {
+		asock_close(&backlog_clients[i]);
+		asock_destroy(&backlog_clients[i]);
+	}
+
+	ioq_destroy(&q);
+	close(fd);
+	unlink(addr.sun_path);
+}
+
+int main(void)
+{
+	int r;
+
+	init_pattern();
+	asock_bufpool_init(&read_pool, 2048, 1);
+
+	r = net_start();
+	assert(r >= 0);
+
+	test_inet();
+	test_inet6();
+	test_unix();
+	test_unix_backlog();
+	test_fastopen();
+	test_optimistic();
+	test_group();
+	test_proxy();
+	test_overload();
+	test_zerocopy_close();
+
 	net_stop();
+	fclose(pattern_file);
+	asock_bufpool_destroy(&read_pool);
 	return 0;
 }
@@ -0,0 +1,293 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "prng.h"
+#include "bytes.h"
+#include "astream.h"
+
+/* Both read-ahead buffers are much smaller than the units which pass
+ * through them, so they wrap constantly.
+ */
+#define RX_SIZE		64
+#define TX_SIZE		256
+#define BLOCK_SIZE	1000
+#define FRAME_SIZE	300
+#define LONG_LINE	100
+#define LINE_MAX	50
+#define WRITE_CHUNK	7
+
+static uint8_t pattern[BLOCK_SIZE];
+static int is_done;
+
+/************************************************************************
+ * Client: writes a script in small pieces
+ */
+
+static struct astream client;
+static uint8_t client_rx[RX_SIZE];
+static uint8_t client_tx[TX_SIZE];
+
+static uint8_t script[4096];
+static size_t script_len;
+static size_t script_ptr;
+
+static void script_add(const void *data, size_t len)
+{
+	assert(script_len + len <= sizeof(script));
+	memcpy(script + script_len, data, len);
+	script_len += len;
+}
+
+static void script_frame(const uint8_t *data, size_t len)
+{
+	uint8_t header[ASTREAM_FRAME_HEADER];
+
+	bytes_w32net(header, len);
+	script_add(header, sizeof(header));
+	script_add(data, len);
+}
+
+static void script_init(void)
+{
+	uint8_t line[LONG_LINE];
+
+	script_add("hello\n", 6);
+	script_add("world\n", 6);
+	script_add(pattern, BLOCK_SIZE);
+	script_frame(pattern, FRAME_SIZE);
+	script_frame(pattern, 0);
+
+	memset(line, 'x', sizeof(line));
+	script_add(line, sizeof(line));
+	script_add("\n", 1);
+
+	/* A frame cut short by the end of the stream */
+	script_add("\0\0", 2);
+}
+
+static void write_more(struct astream *s);
+
+static void flush_done(struct astream *s)
+{
+	assert(!astream_get_write_error(s));
+
+	if (script_ptr < script_len) {
+		write_more(s);
+		return;
+	}
+
+	printf("client: done\n");
+	astream_close(s);
+}
+
+static void write_more(struct astream *s)
+{
+	while (script_ptr < script_len) {
+		size_t len = script_len - script_ptr;
+		size_t r;
+
+		if (len > WRITE_CHUNK)
+			len = WRITE_CHUNK;
+
+		r = astream_write(s, script + script_ptr, len);
+		script_ptr += r;
+
+		if (r < len)
+			break;
+	}
+
+	astream_flush(s, flush_done);
+}
+
+static void connect_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	printf("client: connected\n");
+
+	/* Frames are all-or-nothing */
+	assert(astream_write_frame(&client, pattern, TX_SIZE) < 0);
+	write_more(&client);
+}
+
+/************************************************************************
+ * Server: reads the script back
+ */
+
+static struct asock listener;
+static struct astream server;
+static uint8_t server_rx[RX_SIZE];
+static uint8_t server_tx[TX_SIZE];
+static uint8_t read_buf[BLOCK_SIZE];
+
+static void read_final(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(!astream_get_read_size(s));
+	assert(astream_get_read_eof(s));
+
+	printf("server: EOF\n");
+	astream_close(s);
+	is_done = 1;
+}
+
+static void read_truncated(struct astream *s)
+{
+	assert(astream_get_read_error(s) == ASTREAM_ERR_TRUNCATED);
+	assert(!astream_get_read_eof(s));
+
+	printf("server: truncated frame\n");
+	astream_read(s, read_buf, 1, read_final);
+}
+
+static void read_rest_of_line(struct astream *s)
+{
+	const size_t len = astream_get_read_size(s);
+
+	assert(!astream_get_read_error(s));
+	assert(len == LONG_LINE - LINE_MAX + 1);
+	assert(read_buf[len - 1] == '\n');
+
+	astream_read_frame(s, read_buf, sizeof(read_buf), read_truncated);
+}
+
+static void read_long_line(struct astream *s)
+{
+	assert(astream_get_read_error(s) == ASTREAM_ERR_TOO_BIG);
+	assert(astream_get_read_size(s) == LINE_MAX);
+
+	printf("server: line too long\n");
+	astream_read_until(s, read_buf, sizeof(read_buf), '\n',
+			   read_rest_of_line);
+}
+
+static void read_empty_frame(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(!astream_get_read_size(s));
+	assert(!astream_get_read_eof(s));
+
+	astream_read_until(s, read_buf, LINE_MAX, '\n', read_long_line);
+}
+
+static void read_frame_done(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(astream_get_read_size(s) == FRAME_SIZE);
+	assert(!memcmp(read_buf, pattern, FRAME_SIZE));
+
+	printf("server: frame\n");
+	astream_read_frame(s, read_buf, sizeof(read_buf), read_empty_frame);
+}
+
+static void read_block_done(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(astream_get_read_size(s) == BLOCK_SIZE);
+	assert(!memcmp(read_buf, pattern, BLOCK_SIZE));
+
+	printf("server: block\n");
+	astream_read_frame(s, read_buf, sizeof(read_buf), read_frame_done);
+}
+
+static void read_second_line(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(astream_get_read_size(s) == 6);
+	assert(!memcmp(read_buf, "world\n", 6));
+
+	astream_read(s, read_buf, BLOCK_SIZE, read_block_done);
+}
+
+static void read_first_line(struct astream *s)
+{
+	assert(!astream_get_read_error(s));
+	assert(astream_get_read_size(s) == 6);
+	assert(!memcmp(read_buf, "hello\n", 6));
+
+	printf("server: lines\n");
+	astream_read_until(s, read_buf, LINE_MAX, '\n', read_second_line);
+}
+
+static void accept_done(struct asock *a)
+{
+	assert(!asock_get_error(a));
+	printf("server: accepted\n");
+
+	astream_read_until(&server, read_buf, LINE_MAX, '\n',
+			   read_first_line);
+}
+
+/************************************************************************
+ * Main thread/test
+ */
+
+int main(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	prng_t prng;
+	struct ioq q;
+	int i;
+
+	prng_init(&prng, 1);
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = prng_next(&prng);
+
+	script_init();
+
+	i = net_start();
+	assert(!i);
+
+	i = ioq_init(&q, 0);
+	assert(i >= 0);
+
+	asock_init(&listener, &q);
+	astream_init(&server, &q, server_rx, sizeof(server_rx),
+		     server_tx, sizeof(server_tx));
+	astream_init(&client, &q, client_rx, sizeof(client_rx),
+		     client_tx, sizeof(client_tx));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = 0;
+
+	i = asock_listen(&listener, (struct sockaddr *)&addr, sizeof(addr));
+	assert(i >= 0);
+
+	i = getsockname(asock_get_handle(&listener),
+			(struct sockaddr *)&addr, &len);
+	assert(i >= 0);
+
+	asock_accept(&listener, astream_sock(&server), accept_done);
+	asock_connect(astream_sock(&client), (struct sockaddr *)&addr,
+		      sizeof(addr), connect_done);
+
+	while (!is_done) {
+		i = ioq_iterate(&q);
+		assert(i >= 0);
+	}
+
+	asock_close(&listener);
+	asock_destroy(&listener);
+	astream_destroy(&server);
+	astream_destroy(&client);
+	ioq_destroy(&q);
+	net_stop();
+	return 0;
+}
@@ -136,6 +136,14 @@ static void reader_start(struct reader_proc *r, struct ioq *q, int fd)
  * Main thread/test
  */
 
+#define NUM_THREADS	4
+
+struct loop_proc {
+	struct ioq		*ioq;
+	struct reader_proc	*reader;
+	thr_thread_t		thread;
+};
+
 static void init_pattern(void)
 {
 	int i;
@@ -144,15 +152,30 @@ static void init_pattern(void)
 		pattern[i] = random();
 }
 
-int main(void)
+static void loop_func(void *arg)
+{
+	struct loop_proc *p = (struct loop_proc *)arg;
+
+	while (!p->reader->eof) {
+		const int r = ioq_iterate(p->ioq);
+
+		assert(r >= 0);
+	}
+}
+
+static void run_test(int num_threads, int use_timerfd)
 {
 	struct ioq ioq;
 	struct writer_proc writer;
 	struct reader_proc reader;
+	struct loop_proc loops[NUM_THREADS];
 	int pfd[2];
 	int r;
+	int i;
 
-	init_pattern();
+	printf("Testing with %d thread(s)%s\n", num_threads,
+	       use_timerfd ? ", timerfd" : "");
+	memset(out, 0, sizeof(out));
 
 	r = pipe(pfd);
 	assert(r >= 0);
@@ -160,16 +183,42 @@ int main(void)
 	r = ioq_init(&ioq, 0);
 	assert(r >= 0);
 
+	if (use_timerfd) {
+		r = ioq_use_timerfd(&ioq);
+		assert(r >= 0);
+	}
+
 	writer_start(&writer, &ioq, pfd[1]);
 	reader_start(&reader, &ioq, pfd[0]);
 
-	while (!reader.eof) {
-		r = ioq_iterate(&ioq);
-		assert(r >= 0);
+	for (i = 1; i < num_threads; i++) {
+		loops[i].ioq = &ioq;
+		loops[i].reader = &reader;
+		r = thr_start(&loops[i].thread, loop_func, &loops[i]);
+		assert(!r);
 	}
 
+	loops[0].ioq = &ioq;
+	loops[0].reader = &reader;
+	loop_func(&loops[0]);
+
+	/* Release any threads still waiting for events */
+	ioq_notify(&ioq);
+	for (i = 1; i < num_threads; i++)
+		thr_join(loops[i].thread);
+
 	ioq_destroy(&ioq);
 
 	assert(!memcmp(pattern, out, N));
+}
+
+int main(void)
+{
+	init_pattern();
+
+	run_test(1, 0);
+	run_test(NUM_THREADS, 0);
+	run_test(1, 1);
+	run_test(NUM_THREADS, 1);
 	return 0;
 }
@@ -0,0 +1,151 @@
+/* libdlb - data structures and utilities library
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include "clock.h"
+#include "runq.h"
+#include "overload.h"
+
+#define N_TASKS		16
+
+static struct runq_task		tasks[N_TASKS];
+static struct runq		queue;
+
+static void task_func(struct runq_task *t)
+{
+}
+
+static void test_depth(void)
+{
+	struct overload ol;
+	int i;
+
+	printf("Depth limit\n");
+	runq_init(&queue, 0);
+	overload_init(&ol, &queue, 8, 0);
+
+	for (i = 0; i < 8; i++) {
+		runq_task_init(&tasks[i], &queue);
+		runq_task_exec(&tasks[i], task_func);
+	}
+
+	assert(runq_depth(&queue) == 8);
+	assert(!overload_check(&ol));
+
+	runq_task_init(&tasks[8], &queue);
+	runq_task_exec(&tasks[8], task_func);
+	assert(overload_check(&ol));
+
+	/* Hysteresis: stays overloaded until we reach half the limit */
+	runq_dispatch(&queue, 4);
+	assert(runq_depth(&queue) == 5);
+	assert(overload_check(&ol));
+
+	runq_dispatch(&queue, 1);
+	assert(!overload_check(&ol));
+
+	runq_dispatch(&queue, 0);
+	assert(!runq_depth(&queue));
+
+	overload_destroy(&ol);
+	runq_destroy(&queue);
+}
+
+static void test_delay(void)
+{
+	struct overload ol;
+	struct slist batch;
+	int i;
+
+	printf("Delay limit\n");
+	runq_init(&queue, 0);
+	overload_init(&ol, &queue, 0, 50);
+
+	assert(!runq_delay(&queue));
+
+	runq_task_init(&tasks[0], &queue);
+	runq_task_exec(&tasks[0], task_func);
+	assert(!overload_check(&ol));
+
+	clock_wait(100);
+	assert(runq_delay(&queue) >= 90);
+	assert(overload_check(&ol));
+
+	runq_dispatch(&queue, 0);
+	assert(!runq_delay(&queue));
+	assert(!overload_check(&ol));
+
+	slist_init(&batch);
+	for (i = 0; i < N_TASKS; i++) {
+		runq_task_init(&tasks[i], &queue);
+		tasks[i].func = task_func;
+		slist_append(&batch, &tasks[i].job_list);
+	}
+
+	runq_exec_list(&queue, &batch);
+	assert(runq_depth(&queue) == N_TASKS);
+
+	clock_wait(100);
+	assert(overload_check(&ol));
+
+	runq_dispatch(&queue, 0);
+	assert(!overload_check(&ol));
+
+	overload_destroy(&ol);
+	runq_destroy(&queue);
+}
+
+/* Enabling delay tracking on a live queue must not count the time
+ * before it was enabled.
+ */
+static void test_late(void)
+{
+	struct overload ol;
+	int i;
+
+	printf("Late delay limit\n");
+	runq_init(&queue, 0);
+
+	for (i = 0; i < N_TASKS; i++) {
+		runq_task_init(&tasks[i], &queue);
+		tasks[i].queued = 0;
+		runq_task_exec(&tasks[i], task_func);
+	}
+
+	clock_wait(100);
+	overload_init(&ol, &queue, 0, 50);
+	assert(runq_delay(&queue) < 50);
+	assert(!overload_check(&ol));
+
+	clock_wait(100);
+	assert(runq_delay(&queue) >= 90);
+	assert(overload_check(&ol));
+
+	runq_dispatch(&queue, 0);
+	assert(!overload_check(&ol));
+
+	overload_destroy(&ol);
+	runq_destroy(&queue);
+}
+
+int main(void)
+{
+	test_depth();
+	test_delay();
+	test_late();
+	return 0;
+}
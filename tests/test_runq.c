@@ -63,6 +63,7 @@ static void wait_counter(unsigned int bg_threads)
 
 static void test_tasks(unsigned int bg_threads)
 {
+	struct slist batch;
 	int i;
 
 	printf("Test with %d background threads\n", bg_threads);
@@ -93,6 +94,22 @@ static void test_tasks(unsigned int bg_threads)
 	i = read_counter();
 	assert(i == N_TASKS * 2);
 
+	slist_init(&batch);
+	for (i = 0; i < N_TASKS; i++) {
+		tests[i].func = task_func;
+		slist_append(&batch, &tests[i].job_list);
+	}
+
+	runq_exec_list(&queue, &batch);
+	assert(slist_is_empty(&batch));
+
+	while (read_counter() != N_TASKS * 3)
+		wait_counter(bg_threads);
+
+	clock_wait(100);
+	i = read_counter();
+	assert(i == N_TASKS * 3);
+
 	runq_destroy(&queue);
 	printf("\n");
 }
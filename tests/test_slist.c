@@ -80,6 +80,30 @@ static void test_pop(void)
 	assert(!n);
 }
 
+/* Split the nodes across two lists and join them with slist_concat().
+ */
+static void test_concat(void)
+{
+	struct slist other;
+	int i;
+
+	slist_init(&other);
+	slist_concat(&lst, &other);
+	assert(slist_is_empty(&lst));
+
+	for (i = 0; i < N / 2; i++)
+		slist_append(&other, &recs[i]);
+
+	slist_concat(&lst, &other);
+	assert(slist_is_empty(&other));
+
+	for (; i < N; i++)
+		slist_append(&other, &recs[i]);
+
+	slist_concat(&lst, &other);
+	assert(slist_is_empty(&other));
+}
+
 int main(void)
 {
 	slist_init(&lst);
@@ -92,6 +116,11 @@ int main(void)
 
 	test_push();
 	test_verify();
+	test_pop();
+
+	test_concat();
+	test_verify();
+	test_pop();
 
 	return 0;
 }
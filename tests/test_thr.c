@@ -81,6 +81,66 @@ static void test_timedwait(void)
 	assert(after <= before + 50);
 }
 
+/* Mirror the asock dispatcher: producers set bits, and only the one
+ * which finds the word empty schedules a claim. Every claim must find
+ * the word non-empty, and nothing may be left over at the end.
+ */
+#define ATOMIC_ROUNDS	1000
+
+static thr_atomic_t atomic_word;
+static thr_atomic_t atomic_scheduled;
+static thr_atomic_t atomic_finished;
+
+static void atomic_func(void *arg)
+{
+	const int bit = *(const int *)arg;
+	int i;
+
+	for (i = 0; i < ATOMIC_ROUNDS; i++) {
+		if (!thr_atomic_or(&atomic_word, bit))
+			thr_atomic_swap(&atomic_scheduled, 1);
+
+		/* Wait for our bit to be claimed before pushing again */
+		while (thr_atomic_or(&atomic_word, 0) & bit)
+			clock_wait(0);
+	}
+
+	thr_atomic_or(&atomic_finished, bit);
+}
+
+static void test_atomic(void)
+{
+	static const int bits[2] = {1, 2};
+	thr_thread_t a, b;
+	int claims = 0;
+
+	printf("Atomic dispatch word...\n");
+	thr_start(&a, atomic_func, (void *)&bits[0]);
+	thr_start(&b, atomic_func, (void *)&bits[1]);
+
+	for (;;) {
+		const int finished = thr_atomic_or(&atomic_finished, 0);
+
+		if (thr_atomic_swap(&atomic_scheduled, 0)) {
+			const int ops = thr_atomic_swap(&atomic_word, 0);
+
+			assert(ops && !(ops & ~3));
+			claims++;
+		} else if (finished == 3) {
+			break;
+		} else {
+			clock_wait(0);
+		}
+	}
+
+	thr_join(a);
+	thr_join(b);
+
+	assert(!atomic_word);
+	assert(claims >= ATOMIC_ROUNDS);
+	printf("  %d claims\n", claims);
+}
+
 int main(void)
 {
 	int my_count = 5;
@@ -104,6 +164,7 @@ int main(void)
 	thr_join(worker);
 
 	test_timedwait();
+	test_atomic();
 
 	thr_event_destroy(&event);
 	thr_mutex_destroy(&mutex);